@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# Write a VPP script metering packet generator streams on pg0, e.g.
+#
+#   ./bench.sh -f 1000000 -b 256 -6 20 > /tmp/bench.vpp
+#   vppctl exec /tmp/bench.vpp
+#   vppctl clear runtime; sleep 10; vppctl show runtime ipfix-meter-ip4
+#
+# for the clocks per packet of the meter nodes with the whole graph
+# around them. "test ipfix benchmark" times the meter, expiry and
+# encoding on their own.
+
+flows=100000
+burst=256
+ip6=0
+packets=0
+rate=0
+size=100
+
+usage() {
+    echo "Usage $0 [-f flows] [-b burst] [-6 ip6-percent] [-n packets] [-r pps] [-s ip-size]"
+    echo "  flows    distinct 5-tuples, split between IPv4 and IPv6 (default $flows)"
+    echo "  burst    packets per frame, the vector size the meter sees (default $burst)"
+    echo "  ip6      percentage of the flows and packets that are IPv6 (default $ip6)"
+    echo "  packets  packets to send, 0 to send until disabled (default $packets)"
+    echo "  pps      packets per second, 0 for as fast as possible (default $rate)"
+    echo "  ip-size  IP length of every packet (default $size)"
+    exit 1
+}
+
+while getopts "f:b:6:n:r:s:h" opt; do
+    case "$opt" in
+        f) flows=$OPTARG;;
+        b) burst=$OPTARG;;
+        6) ip6=$OPTARG;;
+        n) packets=$OPTARG;;
+        r) rate=$OPTARG;;
+        s) size=$OPTARG;;
+        *) usage;;
+    esac
+done
+
+if [ "$flows" -lt 1 ] || [ "$burst" -lt 1 ] || [ "$burst" -gt 256 ] \
+   || [ "$ip6" -lt 0 ] || [ "$ip6" -gt 100 ] || [ "$size" -lt 48 ]; then
+    usage
+fi
+
+flows6=$(( flows * ip6 / 100 ))
+flows4=$(( flows - flows6 ))
+
+# one stream per family, or per 64k flows of IPv6 whose ports make the
+# flows, the packets, rate and limit split between them like the flows
+stream() {
+    local name=$1 n_flows=$2 header=$3 src=$4 dst=$5 ports=$6
+    local limit=$(( packets * n_flows / flows ))
+    local pps=$(( rate * n_flows / flows ))
+
+    # a limit or rate of 0 means none to pg
+    [ "$limit" -lt 1 ] && limit=1
+    [ "$pps" -lt 1 ] && pps=1
+
+    echo "packet-generator new {"
+    echo "  name $name"
+    [ "$packets" -gt 0 ] && echo "  limit $limit"
+    [ "$rate" -gt 0 ] && echo "  rate $pps"
+    echo "  size $(( size + 14 ))-$(( size + 14 ))"
+    echo "  maxframe $burst"
+    echo "  interface pg0"
+    echo "  node ethernet-input"
+    echo "  data {"
+    echo "    $header: 00:00:00:00:00:01 -> 02:fe:00:00:00:00"
+    echo "    UDP: $src -> $dst"
+    echo "    UDP: $ports -> 80"
+    echo "    incrementing $(( size - header_size ))"
+    echo "  }"
+    echo "}"
+}
+
+echo "create packet-generator interface pg0"
+echo "set int mac address pg0 02:fe:00:00:00:00"
+echo "set int ip address pg0 192.168.0.2/24"
+echo "set int ip address pg0 2001:db8:1::2/64"
+echo "set int state pg0 up"
+echo "ipfix flow-meter pg0"
+
+if [ "$flows4" -gt 0 ]; then
+    header_size=28
+    last=$(( flows4 - 1 ))
+    stream ipfix-ip4 "$flows4" IP4 \
+        "10.0.0.0 - 10.$(( last >> 16 & 255 )).$(( last >> 8 & 255 )).$(( last & 255 ))" \
+        192.168.0.1 1024
+fi
+
+i=0
+header_size=48
+while [ "$flows6" -gt 0 ]; do
+    n=$(( flows6 < 64512 ? flows6 : 64512 ))
+    stream "ipfix-ip6-$i" "$n" IP6 "2001:db8::$(printf %x $i)" 2001:db8:1::1 \
+        "1024 - $(( 1024 + n - 1 ))"
+    flows6=$(( flows6 - n ))
+    i=$(( i + 1 ))
+done
+
+echo "packet-generator enable-stream"
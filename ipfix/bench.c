@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2017 Igalia
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * @file
+ * @brief IPFIX Plugin, microbenchmark of the meter, expiry and encoding.
+ *
+ * "test ipfix benchmark" meters synthetic packets into an empty flow
+ * table, expires every flow and encodes the records, timing each step
+ * on its own. The table stands in for the calling thread's for the
+ * run, the real one and its counters are put back after. For the whole
+ * data path under load see bench.sh, which sets up pg streams.
+ */
+
+#include <vnet/vnet.h>
+#include <vnet/ip/ip.h>
+#include <vnet/udp/udp_packet.h>
+#include <ipfix/ipfix.h>
+
+/* IP length of the synthetic packets */
+#define IPFIX_BENCH_PACKET_SIZE 100
+/* flows the IPv4 source addresses have room for, 10.0.0.0/8 */
+#define IPFIX_BENCH_MAX_FLOWS (1 << 24)
+
+/* What a run borrows from the calling thread and gives back */
+typedef struct {
+  ipfix_per_thread_data_t ptd;
+  ipfix_ip4_flow_value_t * export_queue_ip4;
+  ipfix_ip6_flow_value_t * export_queue_ip6;
+  u32 export_queue_head_ip4;
+  u32 export_queue_head_ip6;
+  u32 export_queue_dropped;
+  counter_t counters[IPFIX_N_COUNTER];
+} ipfix_bench_saved_t;
+
+/* Flow `flow` is a UDP flow from 10.0.0.0 + flow or 2001:db8::flow */
+static void ipfix_bench_fill (vlib_buffer_t * b, u32 flow, u8 is_ipv6)
+{
+  udp_header_t * udp;
+
+  memset (b->data, 0, sizeof (ip6_header_t) + sizeof (udp_header_t));
+  b->current_data = 0;
+  b->current_length = IPFIX_BENCH_PACKET_SIZE;
+  b->flow_id = 0;
+
+  if (is_ipv6) {
+    ip6_header_t * ip = (ip6_header_t *) b->data;
+
+    ip->ip_version_traffic_class_and_flow_label =
+      clib_host_to_net_u32 (0x60000000);
+    ip->payload_length =
+      clib_host_to_net_u16 (IPFIX_BENCH_PACKET_SIZE - sizeof (*ip));
+    ip->protocol = IP_PROTOCOL_UDP;
+    ip->hop_limit = 64;
+    ip->src_address.as_u64[0] = clib_host_to_net_u64 (0x20010db800000000ULL);
+    ip->src_address.as_u64[1] = clib_host_to_net_u64 (flow);
+    ip->dst_address.as_u64[0] = clib_host_to_net_u64 (0x20010db800010000ULL);
+    ip->dst_address.as_u64[1] = clib_host_to_net_u64 (1);
+    udp = (udp_header_t *) (ip + 1);
+    udp->length = ip->payload_length;
+  } else {
+    ip4_header_t * ip = (ip4_header_t *) b->data;
+
+    ip->ip_version_and_header_length = 0x45;
+    ip->length = clib_host_to_net_u16 (IPFIX_BENCH_PACKET_SIZE);
+    ip->ttl = 64;
+    ip->protocol = IP_PROTOCOL_UDP;
+    ip->src_address.as_u32 = clib_host_to_net_u32 (0x0a000000 + flow);
+    ip->dst_address.as_u32 = clib_host_to_net_u32 (0xc0a80001);
+    ip->checksum = ip4_header_checksum (ip);
+    udp = (udp_header_t *) (ip + 1);
+    udp->length = clib_host_to_net_u16 (IPFIX_BENCH_PACKET_SIZE
+                                        - sizeof (*ip));
+  }
+  udp->src_port = clib_host_to_net_u16 (1024);
+  udp->dst_port = clib_host_to_net_u16 (80);
+}
+
+/* Swap the thread's flow table and the export queues for empty ones,
+ * the hashes sized for `n_flows` */
+static void ipfix_bench_swap_in (ipfix_bench_saved_t * saved,
+                                 u32 thread_index, u32 n_flows)
+{
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_per_thread_data_t * ptd = vec_elt_at_index (im->per_thread_data,
+                                                    thread_index);
+  u32 n_buckets = clib_max (n_flows / 2, 1024);
+  uword memory = clib_max ((uword) n_flows * 128, IPFIX_DEFAULT_HASH_MEMORY);
+  u32 i;
+
+  saved->ptd = *ptd;
+  saved->export_queue_ip4 = im->export_queue_ip4;
+  saved->export_queue_ip6 = im->export_queue_ip6;
+  saved->export_queue_head_ip4 = im->export_queue_head_ip4;
+  saved->export_queue_head_ip6 = im->export_queue_head_ip6;
+  saved->export_queue_dropped = im->export_queue_dropped;
+  for (i = 0; i < IPFIX_N_COUNTER; i++)
+    saved->counters[i] = im->counters[i].counters[thread_index][0];
+
+  ipfix_init_thread_data (ptd);
+  clib_bihash_init_16_8 (&ptd->flow_hash_ip4, "ipfix-bench-ip4", n_buckets,
+                         memory);
+  clib_bihash_init_40_8 (&ptd->flow_hash_ip6, "ipfix-bench-ip6", n_buckets,
+                         memory);
+  im->export_queue_ip4 = 0;
+  im->export_queue_ip6 = 0;
+  im->export_queue_head_ip4 = 0;
+  im->export_queue_head_ip6 = 0;
+  im->export_queue_dropped = 0;
+}
+
+static void ipfix_bench_swap_out (ipfix_bench_saved_t * saved,
+                                  u32 thread_index)
+{
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_per_thread_data_t * ptd = vec_elt_at_index (im->per_thread_data,
+                                                    thread_index);
+  u32 i;
+
+  clib_bihash_free_16_8 (&ptd->flow_hash_ip4);
+  clib_bihash_free_40_8 (&ptd->flow_hash_ip6);
+  vec_free (ptd->flow_cache_ip4);
+  vec_free (ptd->flow_cache_ip6);
+  pool_free (ptd->flow_records_ip4);
+  pool_free (ptd->flow_records_ip6);
+  vec_free (ptd->flow_counters_ip4);
+  vec_free (ptd->flow_counters_ip6);
+  vec_free (ptd->reverse_counters_ip4);
+  vec_free (ptd->reverse_counters_ip6);
+  tw_timer_wheel_free_2t_1w_2048sl (&ptd->timer_wheel);
+  vec_free (ptd->expired_timers);
+  vec_free (ptd->evicted_records_ip4);
+  vec_free (ptd->evicted_records_ip6);
+  vec_free (ptd->offload_candidates);
+  vec_free (ptd->frag_cache);
+  vec_free (ptd->samplers);
+  vec_free (im->export_queue_ip4);
+  vec_free (im->export_queue_ip6);
+
+  *ptd = saved->ptd;
+  im->export_queue_ip4 = saved->export_queue_ip4;
+  im->export_queue_ip6 = saved->export_queue_ip6;
+  im->export_queue_head_ip4 = saved->export_queue_head_ip4;
+  im->export_queue_head_ip6 = saved->export_queue_head_ip6;
+  im->export_queue_dropped = saved->export_queue_dropped;
+  for (i = 0; i < IPFIX_N_COUNTER; i++)
+    im->counters[i].counters[thread_index][0] = saved->counters[i];
+}
+
+static clib_error_t * ipfix_bench_command_fn (vlib_main_t * vm,
+                                              unformat_input_t * input,
+                                              vlib_cli_command_t * cmd)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 n_flows = 100000, n_packets = 10000000, frame = VLIB_FRAME_SIZE;
+  u32 repeat = 1, ip6_percent = 0;
+  u32 buffers[VLIB_FRAME_SIZE], metered[2][VLIB_FRAME_SIZE], n_metered[2];
+  u32 thread_index = vm->thread_index;
+  ipfix_bench_saved_t * saved;
+  ipfix_per_thread_data_t * ptd;
+  u64 meter_cycles = 0, expire_cycles, encode_cycles, t, now, jump;
+  u32 p, i, n, flow, n_alloc, n_live, n_expired, n_dropped, n_messages;
+  f64 cps = vm->clib_time.clocks_per_second;
+  u8 is_ipv6, * message = 0;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "flows %u", &n_flows))
+      ;
+    else if (unformat (input, "packets %u", &n_packets))
+      ;
+    else if (unformat (input, "frame %u", &frame))
+      ;
+    else if (unformat (input, "repeat %u", &repeat))
+      ;
+    else if (unformat (input, "ip6 %u", &ip6_percent))
+      ;
+    else
+      return clib_error_return (0, "unknown input `%U'",
+                                format_unformat_error, input);
+  }
+
+  if (n_flows == 0 || n_flows > IPFIX_BENCH_MAX_FLOWS)
+    return clib_error_return (0, "flows must be 1 to %u",
+                              IPFIX_BENCH_MAX_FLOWS);
+  if (frame == 0 || frame > VLIB_FRAME_SIZE)
+    return clib_error_return (0, "frame must be 1 to %u", VLIB_FRAME_SIZE);
+  if (n_packets == 0 || repeat == 0 || ip6_percent > 100)
+    return clib_error_return (0, "expected packets and repeat of 1 or more "
+                              "and ip6 as a percentage");
+
+  n_alloc = vlib_buffer_alloc (vm, buffers, frame);
+  if (n_alloc < frame) {
+    if (n_alloc)
+      vlib_buffer_free (vm, buffers, n_alloc);
+    return clib_error_return (0, "could not allocate %u buffers", frame);
+  }
+
+  saved = clib_mem_alloc_aligned (sizeof (*saved), CLIB_CACHE_LINE_BYTES);
+  ipfix_bench_swap_in (saved, thread_index, n_flows);
+  ptd = vec_elt_at_index (im->per_thread_data, thread_index);
+
+  /* the new timer wheel starts at time 0, bring it to now first */
+  ipfix_bench_expire (ptd, vlib_time_now (vm), ipfix_time_now (vm));
+
+  /* Meter: packets of flow after flow, `repeat` in a row, the families
+   * go to their meter separately as they would to their node */
+  for (p = 0; p < n_packets; p += n) {
+    n = clib_min (frame, n_packets - p);
+    n_metered[0] = n_metered[1] = 0;
+    for (i = 0; i < n; i++) {
+      flow = ((p + i) / repeat) % n_flows;
+      is_ipv6 = flow % 100 < ip6_percent;
+      ipfix_bench_fill (vlib_get_buffer (vm, buffers[i]), flow, is_ipv6);
+      metered[is_ipv6][n_metered[is_ipv6]++] = buffers[i];
+    }
+
+    now = ipfix_time_now (vm);
+    t = clib_cpu_time_now ();
+    if (n_metered[0])
+      ipfix_bench_meter (vm, ptd, metered[0], n_metered[0], 0, now);
+    if (n_metered[1])
+      ipfix_bench_meter (vm, ptd, metered[1], n_metered[1], 1, now);
+    meter_cycles += clib_cpu_time_now () - t;
+  }
+  n_live = pool_elts (ptd->flow_records_ip4)
+    + pool_elts (ptd->flow_records_ip6);
+
+  /* Expire: past both timeouts every flow is due */
+  jump = clib_max (im->idle_flow_timeout, im->active_flow_timeout) + 2000;
+  t = clib_cpu_time_now ();
+  ipfix_bench_expire (ptd, vlib_time_now (vm) + jump * 1e-3,
+                      ipfix_time_now (vm) + jump);
+  expire_cycles = clib_cpu_time_now () - t;
+  n_expired = vec_len (im->export_queue_ip4) + vec_len (im->export_queue_ip6);
+  n_dropped = im->export_queue_dropped;
+
+  /* Encode: the expired records, a path MTU sized message at a time */
+  vec_validate (message, im->path_mtu - 1);
+  t = clib_cpu_time_now ();
+  n_messages = ipfix_bench_encode (message, 0, im->export_queue_ip4,
+                                   vec_len (im->export_queue_ip4));
+  n_messages += ipfix_bench_encode (message, 1, im->export_queue_ip6,
+                                    vec_len (im->export_queue_ip6));
+  encode_cycles = clib_cpu_time_now () - t;
+
+  ipfix_bench_swap_out (saved, thread_index);
+  clib_mem_free (saved);
+  vec_free (message);
+  vlib_buffer_free (vm, buffers, frame);
+
+  vlib_cli_output (vm, "meter:  %u packets, %u flows, %u in the table, "
+                   "%.1f cycles/packet, %.2f Mpps",
+                   n_packets, n_flows, n_live,
+                   (f64) meter_cycles / n_packets,
+                   meter_cycles ? n_packets * cps / meter_cycles * 1e-6 : 0);
+  vlib_cli_output (vm, "expire: %u records, %u over the export queue, "
+                   "%.1f cycles/record, %.2f Mrecords/s", n_expired, n_dropped,
+                   n_expired ? (f64) expire_cycles / n_expired : 0,
+                   expire_cycles ? n_expired * cps / expire_cycles * 1e-6 : 0);
+  vlib_cli_output (vm, "encode: %u records in %u messages, %.1f cycles/record, "
+                   "%.2f Mrecords/s", n_expired, n_messages,
+                   n_expired ? (f64) encode_cycles / n_expired : 0,
+                   encode_cycles ? n_expired * cps / encode_cycles * 1e-6 : 0);
+  return 0;
+}
+
+/**
+ * @brief CLI command to time the meter, expiry and encoding.
+ *
+ * Runs on the main thread, which stops metering its own packets for the
+ * duration. `repeat` is how many packets of a flow come in a row, `ip6`
+ * the percentage of IPv6 flows.
+ */
+VLIB_CLI_COMMAND (ipfix_bench_command, static) = {
+  .path = "test ipfix benchmark",
+  .short_help = "test ipfix benchmark [flows <n>] [packets <n>] [frame <n>] [repeat <n>] [ip6 <percent>]",
+  .function = ipfix_bench_command_fn,
+};
@@ -26,6 +26,11 @@
 #include <vlibmemory/api.h>
 
 #include <vppinfra/random.h>
+#include <sys/mman.h>
+
+/* vnet brings the other bihash types, the IPv6 flow table's is ours */
+#include <vppinfra/bihash_40_8.h>
+#include <vppinfra/bihash_template.c>
 
 /* define message IDs */
 #include <ipfix/ipfix_msg_enum.h>
@@ -57,7 +62,14 @@
 /* List of message types that this plugin understands */
 
 #define foreach_ipfix_plugin_api_msg                           \
-_(IPFIX_FLOW_METER_ENABLE_DISABLE, ipfix_flow_meter_enable_disable)
+_(IPFIX_FLOW_METER_ENABLE_DISABLE, ipfix_flow_meter_enable_disable)    \
+_(IPFIX_FLOW_METER_ENABLE_DISABLE_BULK,                                 \
+  ipfix_flow_meter_enable_disable_bulk)                                 \
+_(IPFIX_EXPORTER_SET, ipfix_exporter_set)                               \
+_(IPFIX_COLLECTOR_ADD_DEL, ipfix_collector_add_del)                     \
+_(IPFIX_TIMEOUTS_SET, ipfix_timeouts_set)                               \
+_(IPFIX_TEMPLATE_SET, ipfix_template_set)                               \
+_(IPFIX_FLOW_DUMP, ipfix_flow_dump)
 
 /* *INDENT-OFF* */
 VLIB_PLUGIN_REGISTER () = {
@@ -67,33 +79,78 @@ VLIB_PLUGIN_REGISTER () = {
 /* *INDENT-ON* */
 
 /**
- * @brief Enable/disable the flow_meter plugin.
+ * @brief Enable/disable the flow_meter plugin on a set of interfaces.
  *
- * Action function shared between message handler and debug CLI.
+ * Action function shared between message handlers and debug CLI. Any
+ * interface, sub-interfaces included, can be metered. All of them are
+ * checked before any is changed, and the workers are held once for the
+ * whole set.
  */
-
-int ipfix_flow_meter_enable_disable (ipfix_main_t * sm, u32 sw_if_index,
-                                   int enable_disable)
+int ipfix_flow_meter_enable_disable_bulk (ipfix_main_t * sm,
+                                          u32 * sw_if_indices, u32 n,
+                                          int enable_disable,
+                                          u32 sampling_interval,
+                                          u8 sampling_random)
 {
-  vnet_sw_interface_t * sw;
-  int rv = 0;
+  ipfix_per_thread_data_t * ptd;
+  ipfix_sampling_t * sampling;
+  u32 i, sw_if_index;
 
   /* Utterly wrong? */
-  if (pool_is_free_index (sm->vnet_main->interface_main.sw_interfaces, 
-                          sw_if_index))
-    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
-
-  /* Not a physical port? */
-  sw = vnet_get_sw_interface (sm->vnet_main, sw_if_index);
-  if (sw->type != VNET_SW_INTERFACE_TYPE_HARDWARE)
-    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
-  
-  vnet_feature_enable_disable ("ip4-unicast", "ipfix-meter-ip4",
-                               sw_if_index, enable_disable, 0, 0);
-  vnet_feature_enable_disable ("ip6-unicast", "ipfix-meter-ip6",
-                               sw_if_index, enable_disable, 0, 0);
+  for (i = 0; i < n; i++) {
+    if (pool_is_free_index (sm->vnet_main->interface_main.sw_interfaces,
+                            sw_if_indices[i]))
+      return VNET_API_ERROR_INVALID_SW_IF_INDEX;
+  }
 
-  return rv;
+  if (!enable_disable || sampling_interval < 2) {
+    sampling_interval = 0;
+    sampling_random = 0;
+  }
+
+  /* the meter nodes read this on every packet */
+  vlib_worker_thread_barrier_sync (sm->vlib_main);
+
+  for (i = 0; i < n; i++) {
+    sw_if_index = sw_if_indices[i];
+
+    vec_validate (sm->sampling, sw_if_index);
+    sampling = vec_elt_at_index (sm->sampling, sw_if_index);
+    sm->n_sampling_interfaces += (sampling_interval != 0)
+      - (sampling->interval != 0);
+    sampling->interval = sampling_interval;
+    sampling->is_random = sampling_random;
+
+    vec_foreach (ptd, sm->per_thread_data) {
+      vec_validate (ptd->samplers, sw_if_index);
+      ptd->samplers[sw_if_index].position = 0;
+      ptd->samplers[sw_if_index].pick = 0;
+    }
+  }
+
+  vlib_worker_thread_barrier_release (sm->vlib_main);
+
+  /* report the new sampling with the next templates */
+  sm->template_last_sent = 0;
+
+  for (i = 0; i < n; i++) {
+    vnet_feature_enable_disable ("ip4-unicast", "ipfix-meter-ip4",
+                                 sw_if_indices[i], enable_disable, 0, 0);
+    vnet_feature_enable_disable ("ip6-unicast", "ipfix-meter-ip6",
+                                 sw_if_indices[i], enable_disable, 0, 0);
+  }
+
+  return 0;
+}
+
+int ipfix_flow_meter_enable_disable (ipfix_main_t * sm, u32 sw_if_index,
+                                   int enable_disable, u32 sampling_interval,
+                                   u8 sampling_random)
+{
+  return ipfix_flow_meter_enable_disable_bulk (sm, &sw_if_index, 1,
+                                               enable_disable,
+                                               sampling_interval,
+                                               sampling_random);
 }
 
 static clib_error_t *
@@ -102,33 +159,43 @@ flow_meter_enable_disable_command_fn (vlib_main_t * vm,
                                    vlib_cli_command_t * cmd)
 {
   ipfix_main_t * sm = &ipfix_main;
-  u32 sw_if_index = ~0;
+  u32 sw_if_index, * sw_if_indices = 0;
   int enable_disable = 1;
+  u32 sampling_interval = 0;
+  u8 sampling_random = 0;
     
   int rv;
 
   while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
     if (unformat (input, "disable"))
       enable_disable = 0;
+    else if (unformat (input, "sampling %u", &sampling_interval))
+      ;
+    else if (unformat (input, "random"))
+      sampling_random = 1;
     else if (unformat (input, "%U", unformat_vnet_sw_interface,
                        sm->vnet_main, &sw_if_index))
-      ;
+      vec_add1 (sw_if_indices, sw_if_index);
     else
       break;
   }
 
-  if (sw_if_index == ~0)
+  if (vec_len (sw_if_indices) == 0)
     return clib_error_return (0, "Please specify an interface...");
     
-  rv = ipfix_flow_meter_enable_disable (sm, sw_if_index, enable_disable);
+  rv = ipfix_flow_meter_enable_disable_bulk (sm, sw_if_indices,
+                                             vec_len (sw_if_indices),
+                                             enable_disable,
+                                             sampling_interval,
+                                             sampling_random);
+  vec_free (sw_if_indices);
 
   switch(rv) {
   case 0:
     break;
 
   case VNET_API_ERROR_INVALID_SW_IF_INDEX:
-    return clib_error_return 
-      (0, "Invalid interface, only works on physical ports");
+    return clib_error_return (0, "Invalid interface");
     break;
 
   case VNET_API_ERROR_UNIMPLEMENTED:
@@ -142,20 +209,90 @@ flow_meter_enable_disable_command_fn (vlib_main_t * vm,
   return 0;
 }
 
+/* An IPv4 or IPv6 address, telling which */
+static uword unformat_ipfix_address (unformat_input_t * input, va_list * args)
+{
+  ip46_address_t *address = va_arg (*args, ip46_address_t *);
+  u8 *is_ipv6 = va_arg (*args, u8 *);
+
+  memset(address, 0, sizeof(*address));
+  if (unformat(input, "%U", unformat_ip4_address, &address->ip4)) {
+    *is_ipv6 = 0;
+    return 1;
+  }
+  if (unformat(input, "%U", unformat_ip6_address, &address->ip6)) {
+    *is_ipv6 = 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* New idle and active timeouts, in milliseconds. The armed timers only
+ * fire early for a raised one, where expiry arms them again; a lowered
+ * one needs them all armed again. */
+static void ipfix_set_flow_timeouts (ipfix_main_t * im, u64 idle, u64 active)
+{
+  u8 lowered = idle < im->idle_flow_timeout
+    || active < im->active_flow_timeout;
+
+  im->idle_flow_timeout = idle;
+  im->active_flow_timeout = active;
+  if (lowered)
+    ipfix_rearm_timers (im->vlib_main);
+}
+
+/* A new exporter address, port or observation domain is a new session
+ * to every collector: the templates go out again and the sequence
+ * numbers start over */
+static void ipfix_restart_sessions (ipfix_main_t * im)
+{
+  ipfix_collector_t *collector;
+
+  vec_foreach(collector, im->collectors) {
+    collector->sequence_number = 0;
+  }
+  im->template_last_sent = 0;
+}
+
 static clib_error_t * ipfix_set_command_fn (vlib_main_t * vm,
                                             unformat_input_t * input,
                                             vlib_cli_command_t * cmd)
 {
   u32 val = 0;
-  ip4_address_t addr;
+  uword size;
+  ip46_address_t addr;
   ipfix_main_t * im = &ipfix_main;
+  ipfix_field_t field, *fields = 0;
+  u8 is_ipv6;
 
   while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
-    if (unformat(input, "timeout")) {
+    if (unformat(input, "template")) {
+      if (unformat(input, "ip4")) {
+        is_ipv6 = 0;
+      } else if (unformat(input, "ip6")) {
+        is_ipv6 = 1;
+      } else {
+        return clib_error_return(0,
+                                 "expected template ip4 or ip6, got `%U`",
+                                 format_unformat_error, input);
+      }
+      /* the fields run to the end of the line */
+      while (unformat(input, "%U", unformat_ipfix_field, &field)) {
+        vec_add1(fields, field);
+      }
+      if (unformat_check_input (input) != UNFORMAT_END_OF_INPUT
+          || vec_len(fields) == 0) {
+        vec_free(fields);
+        return clib_error_return(0, "expected template fields, got `%U`",
+                                 format_unformat_error, input);
+      }
+      ipfix_set_template(is_ipv6, fields);
+      vec_free(fields);
+    } else if (unformat(input, "timeout")) {
       if (unformat(input, "idle %u", &val)) {
-        im->idle_flow_timeout = val * 1e3;
+        ipfix_set_flow_timeouts(im, val * 1e3, im->active_flow_timeout);
       } else if (unformat(input, "active %u", &val)) {
-        im->active_flow_timeout = val * 1e3;
+        ipfix_set_flow_timeouts(im, im->idle_flow_timeout, val * 1e3);
       } else if (unformat(input, "template %u", &val)) {
         im->template_timeout = val * 1e3;
       } else {
@@ -168,29 +305,162 @@ static clib_error_t * ipfix_set_command_fn (vlib_main_t * vm,
         if (val > 65536) {
           return clib_error_return(0, "expected valid port");
         }
-        im->exporter_port = val;
-      } else if (unformat(input, "collector %u")) {
+        if (im->exporter_port != val) {
+          im->exporter_port = val;
+          ipfix_restart_sessions(im);
+        }
+      } else if (unformat(input, "collector %u", &val)) {
         if (val > 65536) {
           return clib_error_return(0, "expected valid port");
         }
-        im->collector_port = val;
+        if (vec_len(im->collectors) == 0) {
+          return clib_error_return(0, "no collector, see set ipfix collector");
+        }
+        im->collectors[0].port = val;
+        im->collectors[0].sequence_number = 0;
+        im->template_last_sent = 0;
       } else {
         return clib_error_return(0,
                                  "expected port command, got `%U`",
                                  format_unformat_error, input);
       }
     } else if (unformat(input, "ip")) {
-      if (unformat(input, "exporter %U", unformat_ip4_address, &addr)) {
-        im->exporter_ip = addr;
-      } else if (unformat(input, "collector %U", unformat_ip4_address, &addr)) {
-        im->collector_ip = addr;
+      if (unformat(input, "exporter %U", unformat_ipfix_address, &addr,
+                   &is_ipv6)) {
+        if (is_ipv6 ? !ip6_address_is_equal(&im->exporter_ip6, &addr.ip6)
+            : im->exporter_ip.as_u32 != addr.ip4.as_u32) {
+          ipfix_restart_sessions(im);
+        }
+        if (is_ipv6) {
+          im->exporter_ip6 = addr.ip6;
+        } else {
+          im->exporter_ip = addr.ip4;
+        }
+      } else if (unformat(input, "collector %U", unformat_ipfix_address,
+                          &addr, &is_ipv6)) {
+        if (vec_len(im->collectors) == 0) {
+          ipfix_add_del_collector(&addr, 4739, is_ipv6, 1);
+        } else {
+          im->collectors[0].address = addr;
+          im->collectors[0].is_ipv6 = is_ipv6;
+          im->collectors[0].sequence_number = 0;
+          im->template_last_sent = 0;
+        }
       } else {
         return clib_error_return(0,
                                  "expected port command, got `%U`",
                                  format_unformat_error, input);
       }
+    } else if (unformat(input, "collector-mode replicate")) {
+      im->collector_mode = IPFIX_COLLECTORS_REPLICATE;
+    } else if (unformat(input, "collector-mode hash")) {
+      im->collector_mode = IPFIX_COLLECTORS_HASH;
+    } else if (unformat(input, "collector")) {
+      u8 is_add;
+      int rv;
+
+      if (unformat(input, "add")) {
+        is_add = 1;
+      } else if (unformat(input, "del")) {
+        is_add = 0;
+      } else {
+        return clib_error_return(0, "expected collector add or del, got `%U`",
+                                 format_unformat_error, input);
+      }
+      if (!unformat(input, "%U", unformat_ipfix_address, &addr, &is_ipv6)) {
+        return clib_error_return(0, "expected collector address, got `%U`",
+                                 format_unformat_error, input);
+      }
+      val = 4739;
+      if (unformat(input, "port %u", &val) && val > 65535) {
+        return clib_error_return(0, "expected valid port");
+      }
+      rv = ipfix_add_del_collector(&addr, val, is_ipv6, is_add);
+      if (rv != 0) {
+        return clib_error_return(0, is_add ? "collector already added"
+                                 : "no such collector");
+      }
+    } else if (unformat(input, "aggregate")) {
+      u32 src_len, dst_len;
+      u8 ports = 1, protocol = 1;
+
+      if (unformat(input, "ip4")) {
+        is_ipv6 = 0;
+      } else if (unformat(input, "ip6")) {
+        is_ipv6 = 1;
+      } else {
+        return clib_error_return(0,
+                                 "expected aggregate ip4 or ip6, got `%U`",
+                                 format_unformat_error, input);
+      }
+      src_len = dst_len = is_ipv6 ? 128 : 32;
+      /* the masks run to the end of the line */
+      while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+        if (unformat(input, "src-prefix %u", &src_len)) {
+          ;
+        } else if (unformat(input, "dst-prefix %u", &dst_len)) {
+          ;
+        } else if (unformat(input, "no-ports")) {
+          ports = 0;
+        } else if (unformat(input, "no-protocol")) {
+          protocol = 0;
+        } else if (unformat(input, "off")) {
+          ;
+        } else {
+          return clib_error_return(0, "expected aggregate masks, got `%U`",
+                                   format_unformat_error, input);
+        }
+      }
+      if (src_len > 128 || dst_len > 128
+          || ipfix_set_aggregation(is_ipv6, src_len, dst_len, ports,
+                                   protocol) != 0) {
+        return clib_error_return(0, "expected prefix lengths up to %u",
+                                 is_ipv6 ? 128 : 32);
+      }
+    } else if (unformat(input, "biflow on")) {
+      ipfix_set_biflow(1);
+    } else if (unformat(input, "biflow off")) {
+      ipfix_set_biflow(0);
+    } else if (unformat(input, "max-flows %u", &val)) {
+      if (val == 0) {
+        return clib_error_return(0, "expected at least one flow");
+      }
+      im->max_flows = val;
+    } else if (unformat(input, "max-memory %U", unformat_memory_size, &size)) {
+      /* what a flow costs at most: its record halves and bihash entry */
+      size /= sizeof(ipfix_ip6_flow_record_t) + sizeof(ipfix_flow_counters_t)
+        + sizeof(clib_bihash_kv_40_8_t);
+      if (size == 0) {
+        return clib_error_return(0, "expected room for at least one flow");
+      }
+      im->max_flows = clib_min(size, ~0U);
+    } else if (unformat(input, "offload-threshold %u", &val)) {
+      im->offload_threshold = val;
+    } else if (unformat(input, "max-offloads %u", &val)) {
+      if (val >= IPFIX_OFFLOAD_MARK_BASE) {
+        return clib_error_return(0, "expected fewer than %u offloads",
+                                 IPFIX_OFFLOAD_MARK_BASE);
+      }
+      im->max_offloads = val;
+    } else if (unformat(input, "export-rate %u", &val)) {
+      im->export_rate = val;
+    } else if (unformat(input, "export-queue %u", &val)) {
+      if (val == 0) {
+        return clib_error_return(0, "expected room for at least one record");
+      }
+      im->export_queue_max = val;
     } else if (unformat(input, "observation-domain %u", &val)) {
-      im->observation_domain = val;
+      if (im->observation_domain != val) {
+        im->observation_domain = val;
+        ipfix_restart_sessions(im);
+      }
+    } else if (unformat(input, "path-mtu %u", &val)) {
+      /* must hold a full IPFIX message in a single buffer */
+      if (val < 576 || val > VLIB_BUFFER_DATA_SIZE) {
+        return clib_error_return(0, "expected path MTU between 576 and %u",
+                                 VLIB_BUFFER_DATA_SIZE);
+      }
+      im->path_mtu = val;
     } else {
       return clib_error_return(0, "unknown command");
     }
@@ -204,7 +474,7 @@ static clib_error_t * ipfix_set_command_fn (vlib_main_t * vm,
  */
 VLIB_CLI_COMMAND (ipfix_enable_command, static) = {
   .path = "ipfix flow-meter",
-  .short_help = "ipfix flow-meter <interface-name> [disable]",
+  .short_help = "ipfix flow-meter <interface-name> [<interface-name> ...] [disable] [sampling <n> [random]]",
   .function = flow_meter_enable_disable_command_fn,
 };
 
@@ -213,7 +483,7 @@ VLIB_CLI_COMMAND (ipfix_enable_command, static) = {
  */
 VLIB_CLI_COMMAND (ipfix_set_command, static) = {
   .path = "set ipfix",
-  .short_help = "set ipfix [timeout {idle|active|template} <seconds>] [{port|ip} {collector|exporter} <value>] [observation-domain <num>]",
+  .short_help = "set ipfix [timeout {idle|active|template} <seconds>] [{port|ip} {collector|exporter} <value>] [collector {add|del} <ip4|ip6> [port <n>]] [collector-mode {replicate|hash}] [max-flows <n>|max-memory <size>] [offload-threshold <packets>] [max-offloads <n>] [export-rate <packets/s>] [export-queue <records>] [biflow {on|off}] [aggregate {ip4|ip6} {off|[src-prefix <len>] [dst-prefix <len>] [no-ports] [no-protocol]}] [observation-domain <num>] [path-mtu <bytes>] [template {ip4|ip6} <field> ...]",
   .function = ipfix_set_command_fn,
 };
 
@@ -228,11 +498,245 @@ static void vl_api_ipfix_flow_meter_enable_disable_t_handler
   int rv;
 
   rv = ipfix_flow_meter_enable_disable (sm, ntohl(mp->sw_if_index),
-                                        (int) (mp->enable_disable));
+                                        (int) (mp->enable_disable),
+                                        ntohl(mp->sampling_interval),
+                                        mp->sampling_random);
   
   REPLY_MACRO(VL_API_IPFIX_FLOW_METER_ENABLE_DISABLE_REPLY);
 }
 
+static void vl_api_ipfix_flow_meter_enable_disable_bulk_t_handler
+(vl_api_ipfix_flow_meter_enable_disable_bulk_t * mp)
+{
+  vl_api_ipfix_flow_meter_enable_disable_bulk_reply_t * rmp;
+  ipfix_main_t * sm = &ipfix_main;
+  u32 count = ntohl (mp->count), * sw_if_indices = 0, i;
+  int rv;
+
+  /* the count must not run past the message */
+  if (vl_msg_api_get_msg_length (mp)
+      < sizeof (*mp) + (u64) count * sizeof (mp->sw_if_indices[0])) {
+    rv = VNET_API_ERROR_INVALID_VALUE;
+    goto reply;
+  }
+
+  vec_resize (sw_if_indices, count);
+  for (i = 0; i < count; i++)
+    sw_if_indices[i] = ntohl (mp->sw_if_indices[i]);
+
+  rv = ipfix_flow_meter_enable_disable_bulk (sm, sw_if_indices, count,
+                                             (int) (mp->enable_disable),
+                                             ntohl (mp->sampling_interval),
+                                             mp->sampling_random);
+  vec_free (sw_if_indices);
+
+ reply:
+  REPLY_MACRO(VL_API_IPFIX_FLOW_METER_ENABLE_DISABLE_BULK_REPLY);
+}
+
+static void vl_api_ipfix_exporter_set_t_handler
+(vl_api_ipfix_exporter_set_t * mp)
+{
+  vl_api_ipfix_exporter_set_reply_t * rmp;
+  ipfix_main_t * sm = &ipfix_main;
+  u32 path_mtu = ntohl (mp->path_mtu);
+  int changed, rv = 0;
+
+  /* must hold a full IPFIX message in a single buffer */
+  if (path_mtu < 576 || path_mtu > VLIB_BUFFER_DATA_SIZE
+      || mp->collector_mode > IPFIX_COLLECTORS_HASH) {
+    rv = VNET_API_ERROR_INVALID_VALUE;
+    goto reply;
+  }
+
+  if (mp->is_ipv6) {
+    changed = memcmp (sm->exporter_ip6.as_u8, mp->exporter_address, 16);
+    clib_memcpy (sm->exporter_ip6.as_u8, mp->exporter_address, 16);
+  } else {
+    changed = memcmp (sm->exporter_ip.as_u8, mp->exporter_address, 4);
+    clib_memcpy (sm->exporter_ip.as_u8, mp->exporter_address, 4);
+  }
+  changed |= sm->exporter_port != ntohs (mp->exporter_port)
+    || sm->observation_domain != ntohl (mp->observation_domain);
+  sm->exporter_port = ntohs (mp->exporter_port);
+  sm->observation_domain = ntohl (mp->observation_domain);
+  if (changed)
+    ipfix_restart_sessions (sm);
+  sm->path_mtu = path_mtu;
+  sm->collector_mode = mp->collector_mode;
+
+ reply:
+  REPLY_MACRO(VL_API_IPFIX_EXPORTER_SET_REPLY);
+}
+
+static void vl_api_ipfix_collector_add_del_t_handler
+(vl_api_ipfix_collector_add_del_t * mp)
+{
+  vl_api_ipfix_collector_add_del_reply_t * rmp;
+  ipfix_main_t * sm = &ipfix_main;
+  ip46_address_t address;
+  u16 port = ntohs (mp->port);
+  int rv;
+
+  memset (&address, 0, sizeof (address));
+  if (mp->is_ipv6) {
+    clib_memcpy (address.as_u8, mp->address, 16);
+  } else {
+    clib_memcpy (address.ip4.as_u8, mp->address, 4);
+  }
+
+  rv = ipfix_add_del_collector (&address, port ? port : 4739, mp->is_ipv6,
+                                mp->is_add);
+
+  REPLY_MACRO(VL_API_IPFIX_COLLECTOR_ADD_DEL_REPLY);
+}
+
+static void vl_api_ipfix_timeouts_set_t_handler
+(vl_api_ipfix_timeouts_set_t * mp)
+{
+  vl_api_ipfix_timeouts_set_reply_t * rmp;
+  ipfix_main_t * sm = &ipfix_main;
+  int rv = 0;
+
+  ipfix_set_flow_timeouts (sm, ntohl (mp->idle_timeout) * 1e3,
+                           ntohl (mp->active_timeout) * 1e3);
+  sm->template_timeout = ntohl (mp->template_timeout) * 1e3;
+
+  REPLY_MACRO(VL_API_IPFIX_TIMEOUTS_SET_REPLY);
+}
+
+static void vl_api_ipfix_template_set_t_handler
+(vl_api_ipfix_template_set_t * mp)
+{
+  vl_api_ipfix_template_set_reply_t * rmp;
+  ipfix_main_t * sm = &ipfix_main;
+  unformat_input_t input;
+  ipfix_field_t field, * fields = 0;
+  int rv;
+
+  mp->fields[sizeof (mp->fields) - 1] = 0;
+  unformat_init_string (&input, (char *) mp->fields,
+                        strlen ((char *) mp->fields));
+  while (unformat (&input, "%U", unformat_ipfix_field, &field))
+    vec_add1 (fields, field);
+
+  if (unformat_check_input (&input) != UNFORMAT_END_OF_INPUT
+      || vec_len (fields) == 0)
+    rv = VNET_API_ERROR_INVALID_VALUE;
+  else
+    rv = ipfix_set_template (mp->is_ipv6 != 0, fields);
+
+  unformat_free (&input);
+  vec_free (fields);
+
+  REPLY_MACRO(VL_API_IPFIX_TEMPLATE_SET_REPLY);
+}
+
+/* Dump cursors pack a flow walk cursor: thread, family, record index */
+#define IPFIX_DUMP_CURSOR(thread, is_ipv6, index)               \
+  (((u64) (thread) << 33) | ((u64) (is_ipv6) << 32) | (index))
+
+static void ipfix_api_prefix (ip46_address_t * prefix, u8 * address,
+                              u8 is_ipv6)
+{
+  memset(prefix, 0, sizeof(*prefix));
+  if (is_ipv6) {
+    clib_memcpy(prefix->as_u8, address, 16);
+  } else {
+    clib_memcpy(prefix->ip4.as_u8, address, 4);
+  }
+}
+
+static void send_ipfix_flow_details (vl_api_registration_t * reg,
+                                     u32 context, ipfix_flow_info_t * flow)
+{
+  ipfix_main_t * sm = &ipfix_main;
+  vl_api_ipfix_flow_details_t * rmp;
+
+  rmp = vl_msg_api_alloc (sizeof (*rmp));
+  memset (rmp, 0, sizeof (*rmp));
+  rmp->_vl_msg_id = ntohs (VL_API_IPFIX_FLOW_DETAILS + sm->msg_id_base);
+  rmp->context = context;
+  rmp->thread_index = htonl (flow->thread_index);
+  rmp->record_index = htonl (flow->record_index);
+  rmp->is_ipv6 = flow->is_ipv6;
+  if (flow->is_ipv6) {
+    clib_memcpy (rmp->src_address, flow->src.as_u8, 16);
+    clib_memcpy (rmp->dst_address, flow->dst.as_u8, 16);
+  } else {
+    clib_memcpy (rmp->src_address, flow->src.ip4.as_u8, 4);
+    clib_memcpy (rmp->dst_address, flow->dst.ip4.as_u8, 4);
+  }
+  /* already in network order, like in the flow key */
+  rmp->src_port = flow->src_port;
+  rmp->dst_port = flow->dst_port;
+  rmp->protocol = flow->protocol;
+  rmp->flow_start = clib_host_to_net_u64 (flow->flow_start);
+  rmp->flow_end = clib_host_to_net_u64 (flow->flow_end);
+  rmp->packets = clib_host_to_net_u64 (flow->packets);
+  rmp->octets = clib_host_to_net_u64 (flow->octets);
+  rmp->reverse_packets = clib_host_to_net_u64 (flow->reverse_packets);
+  rmp->reverse_octets = clib_host_to_net_u64 (flow->reverse_octets);
+  rmp->cursor = clib_host_to_net_u64
+    (IPFIX_DUMP_CURSOR (flow->thread_index, flow->is_ipv6,
+                        flow->record_index + 1));
+
+  vl_api_send_msg (reg, (u8 *) rmp);
+}
+
+/**
+ * @brief Stream the live flows, a flow walk page at a time so the
+ * workers run in between; max_flows and the cursor let a client page
+ * through a large table in several dumps.
+ *
+ * One dump stops after IPFIX_FLOW_DUMP_PAGES pages, so that the main
+ * thread is not held until a whole table is queued. The budget only
+ * counts once a flow was sent: a dump that sends none has reached the
+ * end of the table, the client resumes from the last cursor until then.
+ */
+static void vl_api_ipfix_flow_dump_t_handler (vl_api_ipfix_flow_dump_t * mp)
+{
+  vl_api_registration_t * reg;
+  ipfix_flow_filter_t filter;
+  ipfix_flow_cursor_t cursor;
+  ipfix_flow_info_t * flows = 0, * flow;
+  u64 start = clib_net_to_host_u64 (mp->cursor);
+  u32 max_flows = ntohl (mp->max_flows), n_sent = 0, n_pages = 0;
+  int done = 0;
+
+  reg = vl_api_client_index_to_registration (mp->client_index);
+  if (!reg)
+    return;
+
+  memset (&filter, 0, sizeof (filter));
+  ipfix_api_prefix (&filter.src, mp->src_address, mp->src_is_ipv6);
+  ipfix_api_prefix (&filter.dst, mp->dst_address, mp->dst_is_ipv6);
+  filter.src_is_ipv6 = mp->src_is_ipv6;
+  filter.dst_is_ipv6 = mp->dst_is_ipv6;
+  filter.src_prefix_len = mp->src_prefix_len;
+  filter.dst_prefix_len = mp->dst_prefix_len;
+
+  cursor.thread_index = start >> 33;
+  cursor.is_ipv6 = (start >> 32) & 1;
+  cursor.record_index = (u32) start;
+
+  if (max_flows == 0)
+    max_flows = ~0;
+
+  while (!done && n_sent < max_flows
+         && (n_sent == 0 || n_pages < IPFIX_FLOW_DUMP_PAGES)) {
+    done = ipfix_flow_walk (&cursor, &filter, max_flows - n_sent, &flows);
+    n_pages++;
+    vec_foreach (flow, flows) {
+      send_ipfix_flow_details (reg, mp->context, flow);
+    }
+    n_sent += vec_len (flows);
+    vec_reset_length (flows);
+  }
+
+  vec_free (flows);
+}
+
 /**
  * @brief Set up the API message handling tables.
  */
@@ -267,112 +771,747 @@ setup_message_id_table (ipfix_main_t * sm, api_main_t *am)
 #undef _
 }
 
-/* TODO: Replace with the user configurable template.
- * Parsed from the CSV file describing the fields
- */
+typedef struct {
+  char *name;
+  u8 host_byte_order;
+  u32 enterprise_number;
+  /* per address family, indexed by is_ipv6 */
+  u16 identifier[2];
+  u16 size[2];
+  u32 record_offset[2];
+} ipfix_field_info_t;
+
+/* Where every template field is found in the exported flow values */
+static ipfix_field_info_t ipfix_fields[] = {
+#define _(sym,n,ie4,ie6,pen,member,host_order)                          \
+  { .name = n, .host_byte_order = host_order, .enterprise_number = pen, \
+    .identifier = { ie4, ie6 },                                         \
+    .size = { sizeof (((ipfix_ip4_flow_value_t *) 0)->member),          \
+              sizeof (((ipfix_ip6_flow_value_t *) 0)->member) },        \
+    .record_offset = { STRUCT_OFFSET_OF (ipfix_ip4_flow_value_t, member), \
+                       STRUCT_OFFSET_OF (ipfix_ip6_flow_value_t, member) } },
+  foreach_ipfix_field
+#undef _
+};
+
+uword unformat_ipfix_field (unformat_input_t * input, va_list * args)
+{
+  ipfix_field_t *field = va_arg (*args, ipfix_field_t *);
+  u32 i;
+
+  for (i = 0; i < IPFIX_N_FIELDS; i++) {
+    if (unformat (input, ipfix_fields[i].name)) {
+      *field = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Turn the fields of a template set into its encoder steps. Fields that
+ * follow each other in the flow value without needing a byte swap are
+ * merged into one copy, copies of common sizes get a fixed size step. */
+static void ipfix_compile_template_set(netflow_v10_template_set_t *set)
+{
+  netflow_v10_field_specifier_t *field;
+  netflow_v10_encode_step_t *step = 0;
+  u16 data_offset = 0;
+
+  vec_reset_length(set->encoder);
+
+  vec_foreach(field, set->fields) {
+    if (step && !field->host_byte_order
+        && step->op == NETFLOW_V10_ENCODE_COPY
+        && step->record_offset + step->size == field->record_offset) {
+      step->size += field->size;
+    } else {
+      vec_add2(set->encoder, step, 1);
+      step->op = NETFLOW_V10_ENCODE_COPY;
+      step->size = field->size;
+      step->data_offset = data_offset;
+      step->record_offset = field->record_offset;
+
+      if (field->host_byte_order) {
+        switch (field->size) {
+        case 8:
+          step->op = NETFLOW_V10_ENCODE_SWAP64;
+          break;
+        case 4:
+          step->op = NETFLOW_V10_ENCODE_SWAP32;
+          break;
+        case 2:
+          step->op = NETFLOW_V10_ENCODE_SWAP16;
+          break;
+        }
+      }
+    }
+    data_offset += field->size;
+  }
+
+  vec_foreach(step, set->encoder) {
+    if (step->op != NETFLOW_V10_ENCODE_COPY) {
+      continue;
+    }
+    switch (step->size) {
+    case 1:
+      step->op = NETFLOW_V10_ENCODE_COPY1;
+      break;
+    case 2:
+      step->op = NETFLOW_V10_ENCODE_COPY2;
+      break;
+    case 4:
+      step->op = NETFLOW_V10_ENCODE_COPY4;
+      break;
+    case 8:
+      step->op = NETFLOW_V10_ENCODE_COPY8;
+      break;
+    case 16:
+      step->op = NETFLOW_V10_ENCODE_COPY16;
+      break;
+    }
+  }
+
+  set->record_size = data_offset;
+}
+
 static void ipfix_make_v10_template(netflow_v10_template_t *template,
-                                    u8 is_ipv6)
+                                    u16 id, u8 is_ipv6,
+                                    ipfix_field_t *fields)
 {
-  /* Initialize an empty flow key to calculate the offsets against. */
-  ipfix_ip4_flow_value_t record_ip4;
-  ipfix_ip6_flow_value_t record_ip6;
+  netflow_v10_template_set_t set = { 0 };
+  ipfix_field_t *field;
 
   /* Initialize the set vector. */
   template->sets = 0;
 
-  /* Create a single set for these */
-  netflow_v10_template_set_t set;
   /* Data record sets start from #256 */
-  set.id = 256 + is_ipv6;
-  set.fields = 0; // Initialize the fields vector.
-
-  netflow_v10_field_specifier_t src_address;
-  netflow_v10_field_specifier_t dst_address;
-  netflow_v10_field_specifier_t protocol;
-  netflow_v10_field_specifier_t src_port;
-  netflow_v10_field_specifier_t dst_port;
-  netflow_v10_field_specifier_t flow_start;
-  netflow_v10_field_specifier_t flow_end;
-  netflow_v10_field_specifier_t octet_count;
-  netflow_v10_field_specifier_t packet_count;
+  set.id = id;
+
+  vec_foreach(field, fields) {
+    ipfix_field_info_t *info = &ipfix_fields[*field];
+    netflow_v10_field_specifier_t spec = { 0 };
+
+    spec.identifier = info->identifier[is_ipv6];
+    spec.size = info->size[is_ipv6];
+    spec.record_offset = info->record_offset[is_ipv6];
+    spec.host_byte_order = info->host_byte_order;
+    spec.enterprise_number = info->enterprise_number;
+    vec_add1(set.fields, spec);
+  }
+
+  ipfix_compile_template_set(&set);
+  vec_add1(template->sets, set);
+}
+
+static void ipfix_free_v10_template(netflow_v10_template_t *template)
+{
+  netflow_v10_template_set_t *set;
+
+  vec_foreach(set, template->sets) {
+    vec_free(set->fields);
+    vec_free(set->encoder);
+  }
+  vec_free(template->sets);
+}
+
+/* Options template reporting the sampling of an interface, the field
+ * values are ipfix_sampling_value_t members */
+static void ipfix_make_sampling_template(netflow_v10_template_t *template,
+                                         u16 id, u8 is_random)
+{
+  netflow_v10_template_set_t set = { 0 };
+  netflow_v10_field_specifier_t spec = { 0 };
+
+  template->sets = 0;
+  set.id = id;
+  set.scope_field_count = 1;
+  spec.host_byte_order = 1;
+
+#define _(ie, member)                                                   \
+  spec.identifier = ie;                                                 \
+  spec.size = sizeof (((ipfix_sampling_value_t *) 0)->member);          \
+  spec.record_offset = STRUCT_OFFSET_OF (ipfix_sampling_value_t, member); \
+  vec_add1(set.fields, spec);
+
+  _(ingressInterface, ingress_interface);
+  _(selectorAlgorithm, selector_algorithm);
+  if (is_random) {
+    _(samplingSize, sampling_n);
+    _(samplingPopulation, sampling_m);
+  } else {
+    _(samplingPacketInterval, sampling_n);
+    _(samplingPacketSpace, sampling_m);
+  }
+#undef _
+
+  ipfix_compile_template_set(&set);
+  vec_add1(template->sets, set);
+}
+
+/* Replace the template of an address family with one made of `fields`,
+ * which is copied. Runs on the main thread, as does all exporting, so
+ * the next export already uses it; it is announced under a new id before
+ * any data records. */
+int ipfix_set_template (u8 is_ipv6, ipfix_field_t * fields)
+{
+  ipfix_main_t * im = &ipfix_main;
+  netflow_v10_template_t *template;
+  ipfix_field_t **template_fields;
+
+  if (vec_len(fields) == 0) {
+    return VNET_API_ERROR_INVALID_VALUE;
+  }
+
+  template = is_ipv6 ? im->template_ip6 : im->template_ip4;
+  template_fields = is_ipv6 ? &im->template_fields_ip6
+    : &im->template_fields_ip4;
+
+  ipfix_free_v10_template(template);
+  ipfix_make_v10_template(template, im->next_template_id, is_ipv6, fields);
+
+  vec_free(*template_fields);
+  *template_fields = vec_dup(fields);
+
+  /* ids below 256 are reserved for template and options sets */
+  im->next_template_id = clib_max(256, im->next_template_id + 1);
+  im->template_last_sent = 0;
+
+  return 0;
+}
+
+/* Set the first `len` bits of an address of `size` octets */
+static void ipfix_prefix_mask (u8 * mask, u32 size, u32 len)
+{
+  u32 i;
+
+  for (i = 0; i < size; i++, len -= clib_min(len, 8)) {
+    mask[i] = len >= 8 ? 0xff : (u8) (0xff << (8 - len));
+  }
+}
 
+/* Fill `mask`, as bihash key words, with the key mask of an address
+ * family. Returns 1 if it aggregates flows at all. */
+static u8 ipfix_make_key_mask (u8 is_ipv6, u8 src_prefix_len,
+                               u8 dst_prefix_len, u8 ports, u8 protocol,
+                               u64 * mask)
+{
   if (is_ipv6) {
-    src_address.identifier = sourceIPv6Address;
-    src_address.size = sizeof(u8) * 16;
-
-    dst_address.identifier = destinationIPv6Address;
-    dst_address.size = sizeof(u8) * 16;
-
-    src_address.record_offset = (size_t)&record_ip6.flow_key.src - (size_t)&record_ip6;
-    dst_address.record_offset = (size_t)&record_ip6.flow_key.dst - (size_t)&record_ip6;
-    protocol.record_offset = (size_t)&record_ip6.flow_key.protocol - (size_t)&record_ip6;
-    src_port.record_offset = (size_t)&record_ip6.flow_key.src_port - (size_t)&record_ip6;
-    dst_port.record_offset = (size_t)&record_ip6.flow_key.dst_port - (size_t)&record_ip6;
-    flow_start.record_offset = (size_t)&record_ip6.flow_start - (size_t)&record_ip6;
-    flow_end.record_offset = (size_t)&record_ip6.flow_end - (size_t)&record_ip6;
-    octet_count.record_offset = (size_t)&record_ip6.octet_delta_count - (size_t)&record_ip6;
-    packet_count.record_offset = (size_t)&record_ip6.packet_delta_count - (size_t)&record_ip6;
+    ipfix_ip6_flow_key_t key;
+
+    memset(&key, 0, sizeof(key));
+    ipfix_prefix_mask(key.src.as_u8, sizeof(key.src), src_prefix_len);
+    ipfix_prefix_mask(key.dst.as_u8, sizeof(key.dst), dst_prefix_len);
+    key.src_port = key.dst_port = ports ? 0xffff : 0;
+    key.protocol = protocol ? 0xff : 0;
+    memcpy(mask, &key, sizeof(key));
+    return src_prefix_len < 128 || dst_prefix_len < 128 || !ports
+      || !protocol;
   } else {
-    src_address.identifier = sourceIPv4Address;
-    src_address.size = sizeof(u8) * 4;
+    ipfix_ip4_flow_key_t key;
+
+    memset(&key, 0, sizeof(key));
+    ipfix_prefix_mask(key.src.as_u8, sizeof(key.src), src_prefix_len);
+    ipfix_prefix_mask(key.dst.as_u8, sizeof(key.dst), dst_prefix_len);
+    key.src_port = key.dst_port = ports ? 0xffff : 0;
+    key.protocol = protocol ? 0xff : 0;
+    memcpy(mask, &key, sizeof(key));
+    return src_prefix_len < 32 || dst_prefix_len < 32 || !ports
+      || !protocol;
+  }
+}
 
-    dst_address.identifier = destinationIPv4Address;
-    dst_address.size = sizeof(u8) * 4;
+/* Meter flows keyed on the leading bits of their addresses only, with or
+ * without their ports and protocol; with full length prefixes and both
+ * kept, flows are keyed on the full 5-tuple again. Flows in the tables
+ * are left alone and expire as usual. */
+int ipfix_set_aggregation (u8 is_ipv6, u8 src_prefix_len, u8 dst_prefix_len,
+                           u8 ports, u8 protocol)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 addr_bits = is_ipv6 ? 128 : 32;
+  u64 mask[5];
+  u8 aggregate;
 
-    src_address.record_offset = (size_t)&record_ip4.flow_key.src - (size_t)&record_ip4;
-    dst_address.record_offset = (size_t)&record_ip4.flow_key.dst - (size_t)&record_ip4;
-    protocol.record_offset = (size_t)&record_ip4.flow_key.protocol - (size_t)&record_ip4;
-    src_port.record_offset = (size_t)&record_ip4.flow_key.src_port - (size_t)&record_ip4;
-    dst_port.record_offset = (size_t)&record_ip4.flow_key.dst_port - (size_t)&record_ip4;
-    flow_start.record_offset = (size_t)&record_ip4.flow_start - (size_t)&record_ip4;
-    flow_end.record_offset = (size_t)&record_ip4.flow_end - (size_t)&record_ip4;
-    octet_count.record_offset = (size_t)&record_ip4.octet_delta_count - (size_t)&record_ip4;
-    packet_count.record_offset = (size_t)&record_ip4.packet_delta_count - (size_t)&record_ip4;
+  if (src_prefix_len > addr_bits || dst_prefix_len > addr_bits) {
+    return VNET_API_ERROR_INVALID_VALUE;
   }
+  aggregate = ipfix_make_key_mask(is_ipv6, src_prefix_len, dst_prefix_len,
+                                  ports, protocol, mask);
 
-  protocol.identifier = protocolIdentifier;
-  protocol.size = sizeof(u8);
+  vlib_worker_thread_barrier_sync (im->vlib_main);
+  if (is_ipv6) {
+    memcpy(im->key_mask_ip6, mask, sizeof(im->key_mask_ip6));
+    im->aggregate_ip6 = aggregate;
+  } else {
+    memcpy(im->key_mask_ip4, mask, sizeof(im->key_mask_ip4));
+    im->aggregate_ip4 = aggregate;
+  }
+  vlib_worker_thread_barrier_release (im->vlib_main);
 
-  src_port.identifier = sourceTransportPort;
-  src_port.size = sizeof(u16);
+  return 0;
+}
 
-  dst_port.identifier = destinationTransportPort;
-  dst_port.size = sizeof(u16);
+/* Add a collector, or remove the one at `address` and `port`. Like all
+ * exporting this runs on the main thread, the process node picks the
+ * change up on its next message. */
+int ipfix_add_del_collector (ip46_address_t * address, u16 port, u8 is_ipv6,
+                             u8 is_add)
+{
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_collector_t *collector;
 
-  flow_start.identifier = flowStartMilliseconds;
-  flow_start.size = sizeof(u64);
+  vec_foreach(collector, im->collectors) {
+    if (collector->is_ipv6 == is_ipv6 && collector->port == port
+        && ip46_address_cmp(&collector->address, address) == 0) {
+      if (is_add) {
+        return VNET_API_ERROR_VALUE_EXIST;
+      }
+      vec_delete(im->collectors, 1, collector - im->collectors);
+      return 0;
+    }
+  }
+  if (!is_add) {
+    return VNET_API_ERROR_NO_SUCH_ENTRY;
+  }
 
-  flow_end.identifier = flowEndMilliseconds;
-  flow_end.size = sizeof(u64);
+  vec_add2(im->collectors, collector, 1);
+  collector->address = *address;
+  collector->port = port;
+  collector->is_ipv6 = is_ipv6;
+  collector->sequence_number = 0;
+  /* a new session, it needs the templates before any data */
+  im->template_last_sent = 0;
 
-  octet_count.identifier = octetDeltaCount;
-  octet_count.size = sizeof(u64);
+  return 0;
+}
 
-  packet_count.identifier = packetDeltaCount;
-  packet_count.size = sizeof(u64);
+/* The octets of an address as the prefix filters compare them */
+static u8 * ipfix_address_bytes (ip46_address_t * address, u8 is_ipv6)
+{
+  return is_ipv6 ? address->as_u8 : address->ip4.as_u8;
+}
 
-  vec_add1(set.fields, src_address);
-  vec_add1(set.fields, dst_address);
-  vec_add1(set.fields, protocol);
-  vec_add1(set.fields, src_port);
-  vec_add1(set.fields, dst_port);
-  vec_add1(set.fields, flow_start);
-  vec_add1(set.fields, flow_end);
-  vec_add1(set.fields, octet_count);
-  vec_add1(set.fields, packet_count);
+/* Whether an address is in a prefix of its family, a prefix of length 0
+ * holds any address of either */
+static int ipfix_prefix_match (ip46_address_t * address, u8 is_ipv6,
+                               ip46_address_t * prefix, u8 prefix_is_ipv6,
+                               u8 prefix_len)
+{
+  u8 *a = ipfix_address_bytes(address, is_ipv6);
+  u8 *p = ipfix_address_bytes(prefix, prefix_is_ipv6);
+  u8 mask[16];
+  u32 i, size = is_ipv6 ? 16 : 4;
 
-  vec_add1(template->sets, set);
+  if (prefix_len == 0) {
+    return 1;
+  }
+  if (prefix_is_ipv6 != is_ipv6) {
+    return 0;
+  }
+
+  ipfix_prefix_mask(mask, size, prefix_len);
+  for (i = 0; i < size; i++) {
+    if ((a[i] ^ p[i]) & mask[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void ipfix_flow_info_ip4 (ipfix_per_thread_data_t * ptd, u32 index,
+                                 ipfix_flow_info_t * info)
+{
+  ipfix_ip4_flow_value_t value;
+
+  ipfix_flow_value_ip4(ptd, index, &value);
+  memset(info, 0, sizeof(*info));
+  ip46_address_set_ip4(&info->src, &value.flow_key.src);
+  ip46_address_set_ip4(&info->dst, &value.flow_key.dst);
+  info->src_port = value.flow_key.src_port;
+  info->dst_port = value.flow_key.dst_port;
+  info->protocol = value.flow_key.protocol;
+  info->flow_start = value.flow_start;
+  info->flow_end = value.flow_end;
+  info->packets = value.packet_delta_count;
+  info->octets = value.octet_delta_count;
+  info->reverse_packets = value.reverse_packet_delta_count;
+  info->reverse_octets = value.reverse_octet_delta_count;
+}
+
+static void ipfix_flow_info_ip6 (ipfix_per_thread_data_t * ptd, u32 index,
+                                 ipfix_flow_info_t * info)
+{
+  ipfix_ip6_flow_value_t value;
+
+  ipfix_flow_value_ip6(ptd, index, &value);
+  memset(info, 0, sizeof(*info));
+  info->src.ip6 = value.flow_key.src;
+  info->dst.ip6 = value.flow_key.dst;
+  info->src_port = value.flow_key.src_port;
+  info->dst_port = value.flow_key.dst_port;
+  info->protocol = value.flow_key.protocol;
+  info->is_ipv6 = 1;
+  info->flow_start = value.flow_start;
+  info->flow_end = value.flow_end;
+  info->packets = value.packet_delta_count;
+  info->octets = value.octet_delta_count;
+  info->reverse_packets = value.reverse_packet_delta_count;
+  info->reverse_octets = value.reverse_octet_delta_count;
+}
+
+/* Add the flows matching `filter` to `flows`, from `cursor` on, and move
+ * the cursor past them. The workers are held for one page of at most
+ * IPFIX_FLOW_WALK_PAGE records, so a walk of a large table is a series
+ * of calls that lets them run in between; flows created or expired
+ * meanwhile may or may not be seen. A call also stops after `max_flows`
+ * matches.
+ *
+ * Returns 1 once the walk is past the last record of the last thread. */
+int ipfix_flow_walk (ipfix_flow_cursor_t * cursor,
+                     ipfix_flow_filter_t * filter, u32 max_flows,
+                     ipfix_flow_info_t ** flows)
+{
+  ipfix_main_t * im = &ipfix_main;
+  vlib_main_t * vm = vlib_get_main ();
+  ipfix_per_thread_data_t * ptd;
+  ipfix_flow_info_t * info;
+  u32 n_visited = 0, n_found = 0, n_slots;
+
+  vlib_worker_thread_barrier_sync (vm);
+
+  while (cursor->thread_index < vec_len(im->per_thread_data)) {
+    ptd = vec_elt_at_index(im->per_thread_data, cursor->thread_index);
+    n_slots = cursor->is_ipv6 ? vec_len(ptd->flow_records_ip6)
+      : vec_len(ptd->flow_records_ip4);
+
+    for (; cursor->record_index < n_slots; cursor->record_index++) {
+      if (n_visited == IPFIX_FLOW_WALK_PAGE || n_found == max_flows) {
+        goto done;
+      }
+      n_visited++;
+
+      if (cursor->is_ipv6) {
+        if (pool_is_free_index(ptd->flow_records_ip6, cursor->record_index)) {
+          continue;
+        }
+        vec_add2(*flows, info, 1);
+        ipfix_flow_info_ip6(ptd, cursor->record_index, info);
+      } else {
+        if (pool_is_free_index(ptd->flow_records_ip4, cursor->record_index)) {
+          continue;
+        }
+        vec_add2(*flows, info, 1);
+        ipfix_flow_info_ip4(ptd, cursor->record_index, info);
+      }
+      info->thread_index = cursor->thread_index;
+      info->record_index = cursor->record_index;
+      info->flow_start += im->wall_clock_offset;
+      info->flow_end += im->wall_clock_offset;
+
+      if (!ipfix_prefix_match(&info->src, info->is_ipv6, &filter->src,
+                              filter->src_is_ipv6, filter->src_prefix_len)
+          || !ipfix_prefix_match(&info->dst, info->is_ipv6, &filter->dst,
+                                 filter->dst_is_ipv6,
+                                 filter->dst_prefix_len)) {
+        _vec_len(*flows) -= 1;
+        continue;
+      }
+      n_found++;
+    }
+
+    /* IPv4 then IPv6, then the next thread */
+    cursor->record_index = 0;
+    if (cursor->is_ipv6) {
+      cursor->is_ipv6 = 0;
+      cursor->thread_index++;
+    } else {
+      cursor->is_ipv6 = 1;
+    }
+  }
+
+ done:
+  vlib_worker_thread_barrier_release (vm);
+  return cursor->thread_index >= vec_len(im->per_thread_data);
+}
+
+/* How a top-N listing ranks flows, both directions together */
+always_inline u64 ipfix_flow_rank (ipfix_flow_info_t * flow, u8 by_packets)
+{
+  return by_packets ? flow->packets + flow->reverse_packets
+    : flow->octets + flow->reverse_octets;
+}
+
+/* Partial selection: move the `n` highest ranked of `flows` to its front,
+ * in no particular order, in linear time on average. Ties are split
+ * three ways so that a table of equal counters stays linear too. */
+static void ipfix_flow_select (ipfix_flow_info_t * flows, u32 n,
+                               u8 by_packets)
+{
+  ipfix_flow_info_t tmp;
+  u32 lo = 0, hi = vec_len(flows), lt, gt, i;
+  u64 pivot, rank;
+
+  while (lo < n && n < hi) {
+    /* [lo, lt) ranks above the pivot, [lt, i) with it, [gt, hi) below */
+    pivot = ipfix_flow_rank(&flows[lo + (hi - lo) / 2], by_packets);
+    lt = i = lo;
+    gt = hi;
+    while (i < gt) {
+      rank = ipfix_flow_rank(&flows[i], by_packets);
+      if (rank > pivot) {
+        tmp = flows[i];
+        flows[i++] = flows[lt];
+        flows[lt++] = tmp;
+      } else if (rank < pivot) {
+        tmp = flows[i];
+        flows[i] = flows[--gt];
+        flows[gt] = tmp;
+      } else {
+        i++;
+      }
+    }
+
+    if (n < lt) {
+      hi = lt;
+    } else if (n > gt) {
+      lo = gt;
+    } else {
+      break;
+    }
+  }
+}
+
+static int ipfix_flow_compare_octets (void * a1, void * a2)
+{
+  u64 r1 = ipfix_flow_rank(a1, 0), r2 = ipfix_flow_rank(a2, 0);
+
+  return r1 < r2 ? 1 : r1 > r2 ? -1 : 0;
+}
+
+static int ipfix_flow_compare_packets (void * a1, void * a2)
+{
+  u64 r1 = ipfix_flow_rank(a1, 1), r2 = ipfix_flow_rank(a2, 1);
+
+  return r1 < r2 ? 1 : r1 > r2 ? -1 : 0;
+}
+
+static u8 * format_ipfix_flow_info (u8 * s, va_list * args)
+{
+  ipfix_flow_info_t * flow = va_arg (*args, ipfix_flow_info_t *);
+  ip46_type_t type = flow->is_ipv6 ? IP46_TYPE_IP6 : IP46_TYPE_IP4;
+
+  s = format (s, "[%u:%u] %U %U:%U -> %U:%U, %lu packets, %lu octets",
+              flow->thread_index, flow->record_index,
+              format_ip_protocol, flow->protocol,
+              format_ip46_address, &flow->src, type,
+              format_tcp_udp_port, flow->src_port,
+              format_ip46_address, &flow->dst, type,
+              format_tcp_udp_port, flow->dst_port,
+              flow->packets, flow->octets);
+  if (flow->reverse_packets) {
+    s = format (s, ", reverse %lu packets, %lu octets",
+                flow->reverse_packets, flow->reverse_octets);
+  }
+  s = format (s, ", %.3fs", (flow->flow_end - flow->flow_start) * 1e-3);
+  return s;
+}
+
+static clib_error_t * ipfix_show_flows_command_fn (vlib_main_t * vm,
+                                                   unformat_input_t * input,
+                                                   vlib_cli_command_t * cmd)
+{
+  ipfix_flow_filter_t filter;
+  ipfix_flow_cursor_t cursor;
+  ipfix_flow_info_t * flows = 0, * flow;
+  u32 top = 0, limit = 100, src_len, dst_len;
+  u8 by_packets = 0;
+  int done;
+
+  memset(&filter, 0, sizeof(filter));
+  memset(&cursor, 0, sizeof(cursor));
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat(input, "top %u", &top)) {
+      ;
+    } else if (unformat(input, "by packets")) {
+      by_packets = 1;
+    } else if (unformat(input, "by bytes")) {
+      by_packets = 0;
+    } else if (unformat(input, "src %U/%u", unformat_ipfix_address,
+                        &filter.src, &filter.src_is_ipv6, &src_len)) {
+      if (src_len > (filter.src_is_ipv6 ? 128 : 32)) {
+        return clib_error_return(0, "expected valid prefix length");
+      }
+      filter.src_prefix_len = src_len;
+    } else if (unformat(input, "dst %U/%u", unformat_ipfix_address,
+                        &filter.dst, &filter.dst_is_ipv6, &dst_len)) {
+      if (dst_len > (filter.dst_is_ipv6 ? 128 : 32)) {
+        return clib_error_return(0, "expected valid prefix length");
+      }
+      filter.dst_prefix_len = dst_len;
+    } else if (unformat(input, "limit %u", &limit)) {
+      ;
+    } else {
+      return clib_error_return(0, "unknown input `%U`",
+                               format_unformat_error, input);
+    }
+  }
+
+  if (top == 0 && limit == 0) {
+    return 0;
+  }
+
+  /* a page at a time; for a top-N only the best 2N are kept in between,
+   * so memory and selection stay bounded by N, not by the table */
+  do {
+    done = ipfix_flow_walk(&cursor, &filter,
+                           top ? ~0 : limit - vec_len(flows), &flows);
+    if (top && vec_len(flows) >= 2 * top) {
+      ipfix_flow_select(flows, top, by_packets);
+      _vec_len(flows) = top;
+    }
+  } while (!done && (top || vec_len(flows) < limit));
+
+  if (top) {
+    if (vec_len(flows) > top) {
+      ipfix_flow_select(flows, top, by_packets);
+      _vec_len(flows) = top;
+    }
+    vec_sort_with_function(flows, by_packets ? ipfix_flow_compare_packets
+                           : ipfix_flow_compare_octets);
+  }
+
+  vec_foreach(flow, flows) {
+    vlib_cli_output(vm, "%U", format_ipfix_flow_info, flow);
+  }
+  if (!done && !top) {
+    vlib_cli_output(vm, "stopped at the limit of %u flows", limit);
+  }
+
+  vec_free(flows);
+  return 0;
+}
+
+/**
+ * @brief CLI command to list live flows.
+ */
+VLIB_CLI_COMMAND (ipfix_show_flows_command, static) = {
+  .path = "show ipfix flows",
+  .short_help = "show ipfix flows [top <n> [by {bytes|packets}]] [src <prefix>/<len>] [dst <prefix>/<len>] [limit <n>]",
+  .function = ipfix_show_flows_command_fn,
+};
+
+/* Add the reverse counters to a template, or take them out */
+static void ipfix_set_template_biflow (u8 is_ipv6, u8 enable)
+{
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_field_t *fields = 0, *field;
+
+  vec_foreach(field, is_ipv6 ? im->template_fields_ip6
+              : im->template_fields_ip4) {
+    if (*field != IPFIX_FIELD_REVERSE_OCTETS
+        && *field != IPFIX_FIELD_REVERSE_PACKETS) {
+      vec_add1(fields, *field);
+    }
+  }
+  if (enable) {
+    vec_add1(fields, IPFIX_FIELD_REVERSE_OCTETS);
+    vec_add1(fields, IPFIX_FIELD_REVERSE_PACKETS);
+  }
+  ipfix_set_template(is_ipv6, fields);
+  vec_free(fields);
+}
+
+/* Switch between unidirectional flows and RFC 5103 biflows. Flows in
+ * the tables are left alone and packets are keyed the new way from now
+ * on, so a flow live across the switch may be reported twice. */
+int ipfix_set_biflow (u8 enable)
+{
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_per_thread_data_t * ptd;
+
+  enable = !!enable;
+  if (im->biflow == enable) {
+    return 0;
+  }
+
+  vlib_worker_thread_barrier_sync (im->vlib_main);
+  if (enable) {
+    /* the reverse counters start out empty for every live flow */
+    vec_foreach (ptd, im->per_thread_data) {
+      vec_validate_aligned(ptd->reverse_counters_ip4,
+                           vec_len(ptd->flow_counters_ip4),
+                           CLIB_CACHE_LINE_BYTES);
+      vec_validate_aligned(ptd->reverse_counters_ip6,
+                           vec_len(ptd->flow_counters_ip6),
+                           CLIB_CACHE_LINE_BYTES);
+      memset(ptd->reverse_counters_ip4, 0,
+             vec_bytes(ptd->reverse_counters_ip4));
+      memset(ptd->reverse_counters_ip6, 0,
+             vec_bytes(ptd->reverse_counters_ip6));
+    }
+  }
+  im->biflow = enable;
+  vlib_worker_thread_barrier_release (im->vlib_main);
+
+  ipfix_set_template_biflow(0, enable);
+  ipfix_set_template_biflow(1, enable);
+
+  return 0;
+}
+
+/**
+ * @brief Set up an empty flow table, but for its hashes which the startup
+ * config sizes.
+ */
+void ipfix_init_thread_data (ipfix_per_thread_data_t * ptd)
+{
+  ipfix_main_t * sm = &ipfix_main;
+
+  ptd->flow_records_ip4 = 0;
+  ptd->flow_records_ip6 = 0;
+  ptd->flow_counters_ip4 = 0;
+  ptd->flow_counters_ip6 = 0;
+  ptd->reverse_counters_ip4 = 0;
+  ptd->reverse_counters_ip6 = 0;
+  tw_timer_wheel_init_2t_1w_2048sl(&ptd->timer_wheel, 0 /* no callback */,
+                                   IPFIX_TIMER_TICK, ~0);
+  ptd->expired_timers = 0;
+  ptd->evicted_records_ip4 = 0;
+  ptd->evicted_records_ip6 = 0;
+  ptd->offload_candidates = 0;
+  ptd->flow_cache_ip4 = 0;
+  ptd->flow_cache_ip6 = 0;
+  vec_validate_aligned(ptd->flow_cache_ip4, IPFIX_FLOW_CACHE_SIZE - 1,
+                       CLIB_CACHE_LINE_BYTES);
+  vec_validate_aligned(ptd->flow_cache_ip6, IPFIX_FLOW_CACHE_SIZE - 1,
+                       CLIB_CACHE_LINE_BYTES);
+  memset(ptd->flow_cache_ip4, 0xff, vec_bytes(ptd->flow_cache_ip4));
+  memset(ptd->flow_cache_ip6, 0xff, vec_bytes(ptd->flow_cache_ip6));
+  ptd->frag_cache = 0;
+  vec_validate_aligned(ptd->frag_cache, IPFIX_FRAG_CACHE_SIZE - 1,
+                       CLIB_CACHE_LINE_BYTES);
+  ptd->samplers = 0;
+  ptd->random_seed = random_u32(&sm->random_seed);
 }
 
 /**
  * @brief Initialize the ipfix plugin.
  */
+static char * ipfix_counter_names[] = {
+#define _(sym,name) name,
+  foreach_ipfix_counter
+#undef _
+};
+
 static clib_error_t * ipfix_init (vlib_main_t * vm)
 {
   ipfix_main_t * sm = &ipfix_main;
+  vlib_thread_main_t * tm = vlib_get_thread_main ();
+  ipfix_per_thread_data_t * ptd;
   clib_error_t * error = 0;
   u8 * name;
-  u32 rand_port;
+  u32 rand_port, i;
 
   sm->vnet_main =  vnet_get_main ();
 
@@ -391,40 +1530,115 @@ static clib_error_t * ipfix_init (vlib_main_t * vm)
 
   /* Initialize configuration values */
   sm->exporter_port = rand_port;
-  sm->collector_port = 4739;
-  sm->collector_ip.data[0] = 10;
-  sm->collector_ip.data[1] = 10;
-  sm->collector_ip.data[2] = 1;
-  sm->collector_ip.data[3] = 1;
+  sm->collectors = 0;
+  sm->collector_mode = IPFIX_COLLECTORS_REPLICATE;
+  sm->collector_records = 0;
+  {
+    ip46_address_t collector;
+
+    memset(&collector, 0, sizeof(collector));
+    collector.ip4.data[0] = 10;
+    collector.ip4.data[1] = 10;
+    collector.ip4.data[2] = 1;
+    collector.ip4.data[3] = 1;
+    ipfix_add_del_collector(&collector, 4739, 0, 1);
+  }
+  memset(&sm->exporter_ip6, 0, sizeof(sm->exporter_ip6));
   sm->exporter_ip.data[0] = 10;
   sm->exporter_ip.data[1] = 10;
   sm->exporter_ip.data[2] = 1;
   sm->exporter_ip.data[3] = 2;
   sm->observation_domain = 256;
+  sm->path_mtu = 1500;
   sm->idle_flow_timeout = 300 * 1e3;
   sm->active_flow_timeout = 120 * 1e3;
   sm->template_timeout = 600 * 1e3;
-
-  /* Initialize templates */
-  /* FIXME: do we need to free these at some point? */
+  sm->max_flows = IPFIX_DEFAULT_MAX_FLOWS;
+  sm->offload_threshold = 0;
+  sm->max_offloads = IPFIX_DEFAULT_MAX_OFFLOADS;
+  sm->offloads = 0;
+  sm->offload_unsupported = 0;
+  sm->aggregate_ip4 = ipfix_make_key_mask(0, 32, 32, 1, 1, sm->key_mask_ip4);
+  sm->aggregate_ip6 = ipfix_make_key_mask(1, 128, 128, 1, 1,
+                                          sm->key_mask_ip6);
+
+  /* Initialize templates, by default with every standard field */
   sm->template_ip4 = clib_mem_alloc(sizeof(netflow_v10_template_t));
   sm->template_ip6 = clib_mem_alloc(sizeof(netflow_v10_template_t));
-  ipfix_make_v10_template(sm->template_ip4, 0);
-  ipfix_make_v10_template(sm->template_ip6, 1);
-
-  /* Initialize flow records vector */
-  sm->flow_records_ip4 = 0;
-  sm->flow_records_ip6 = 0;
-
-  /* Initialize expired flow records vector */
-  sm->expired_records_ip4 = 0;
-  sm->expired_records_ip6 = 0;
-
-  /* Initialize IPFIX data packets vector */
-  sm->data_packets = 0;
+  sm->template_ip4->sets = 0;
+  sm->template_ip6->sets = 0;
+  sm->template_fields_ip4 = 0;
+  sm->template_fields_ip6 = 0;
+  sm->template_last_sent = 0;
+  sm->next_template_id = 256;
+  {
+    ipfix_field_t *fields = 0;
+    ipfix_field_t field;
+
+    for (field = 0; field < IPFIX_N_FIELDS; field++) {
+      if (ipfix_fields[field].enterprise_number == 0) {
+        vec_add1(fields, field);
+      }
+    }
+    ipfix_set_template(0, fields);
+    ipfix_set_template(1, fields);
+    vec_free(fields);
+  }
+  sm->template_sampling[0] = clib_mem_alloc(sizeof(netflow_v10_template_t));
+  sm->template_sampling[1] = clib_mem_alloc(sizeof(netflow_v10_template_t));
+  ipfix_make_sampling_template(sm->template_sampling[0],
+                               sm->next_template_id++, 0);
+  ipfix_make_sampling_template(sm->template_sampling[1],
+                               sm->next_template_id++, 1);
+  sm->sampling = 0;
+  sm->n_sampling_interfaces = 0;
+
+  /* One flow table per vlib main (main thread and workers) */
+  vec_validate_aligned (sm->per_thread_data, tm->n_vlib_mains - 1,
+                        CLIB_CACHE_LINE_BYTES);
+  /* the flow hashes are sized by ipfix_config */
+  vec_foreach (ptd, sm->per_thread_data) {
+    ipfix_init_thread_data (ptd);
+  }
 
-  clib_bihash_init_16_8(&sm->flow_hash_ip4, "flowhash", 20000, 128<<20);
-  clib_bihash_init_48_8(&sm->flow_hash_ip6, "flowhash", 20000, 128<<20);
+  /* Meter timestamps come from vlib time, remember how to get back to
+   * wall clock time for the exported records. Unsigned arithmetic, the
+   * offset may well be "negative". */
+  sm->wall_clock_offset = (u64) (unix_time_now() * 1e3) - ipfix_time_now(vm);
+
+  /* Export packets are routed, resolve the next node once */
+  sm->lookup_node_index[0] = ip4_lookup_node.index;
+  sm->lookup_node_index[1] = ip6_lookup_node.index;
+  sm->export_frame[0] = 0;
+  sm->export_frame[1] = 0;
+  sm->export_buffers = 0;
+
+  /* Initialize the export queues */
+  sm->export_queue_ip4 = 0;
+  sm->export_queue_ip6 = 0;
+  sm->export_queue_head_ip4 = 0;
+  sm->export_queue_head_ip6 = 0;
+  sm->export_queue_max = IPFIX_DEFAULT_EXPORT_QUEUE;
+  sm->export_queue_dropped = 0;
+  sm->export_rate = 0;
+  /* no spill file and no snapshot unless the startup config has them */
+  memset(sm->spill, 0, sizeof(sm->spill));
+  sm->spill[0].fd = sm->spill[1].fd = -1;
+  sm->snapshot_path = 0;
+
+  /* Counters go to the stats segment, one slot per thread */
+  for (i = 0; i < IPFIX_N_COUNTER; i++) {
+    sm->counters[i].name = ipfix_counter_names[i];
+    sm->counters[i].stat_segment_name = ipfix_counter_names[i];
+    vlib_validate_simple_counter(&sm->counters[i], 0);
+    vlib_zero_simple_counter(&sm->counters[i], 0);
+  }
+  sm->meter_cycles.name = "/ipfix/meter-cycles";
+  sm->meter_cycles.stat_segment_name = "/ipfix/meter-cycles";
+  for (i = 0; i < IPFIX_CYCLES_BUCKETS; i++) {
+    vlib_validate_simple_counter(&sm->meter_cycles, i);
+    vlib_zero_simple_counter(&sm->meter_cycles, i);
+  }
 
   error = ipfix_plugin_api_hookup (vm);
 
@@ -438,6 +1652,117 @@ static clib_error_t * ipfix_init (vlib_main_t * vm)
 
 VLIB_INIT_FUNCTION (ipfix_init);
 
+/* Ask for transparent huge pages to back the whole pages of a range */
+static void ipfix_advise_hugepages (void * p, uword size)
+{
+  uword page_size = clib_mem_get_page_size ();
+  uword start = round_pow2 (pointer_to_uword (p), page_size);
+  uword end = (pointer_to_uword (p) + size) & ~(page_size - 1);
+
+  if (end > start
+      && madvise (uword_to_pointer (start, void *), end - start,
+                  MADV_HUGEPAGE) != 0) {
+    clib_unix_warning ("madvise MADV_HUGEPAGE");
+  }
+}
+
+/**
+ * @brief Size the flow tables from the "ipfix { ... }" startup stanza.
+ *
+ * Config functions run after the init functions, ipfix_init has already
+ * set up the per thread data. This is called without the stanza too.
+ */
+static clib_error_t * ipfix_config (vlib_main_t * vm, unformat_input_t * input)
+{
+  ipfix_main_t * sm = &ipfix_main;
+  ipfix_per_thread_data_t * ptd;
+  u32 ip4_buckets = IPFIX_DEFAULT_BUCKETS;
+  u32 ip6_buckets = IPFIX_DEFAULT_BUCKETS;
+  uword ip4_memory = IPFIX_DEFAULT_HASH_MEMORY;
+  uword ip6_memory = IPFIX_DEFAULT_HASH_MEMORY;
+  uword memory;
+  u8 hugepages = 0;
+  u8 * spill_path = 0;
+  clib_error_t * error;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "ip4-buckets %u", &ip4_buckets))
+      ;
+    else if (unformat (input, "ip6-buckets %u", &ip6_buckets))
+      ;
+    else if (unformat (input, "ip4-memory %U", unformat_memory_size,
+                       &ip4_memory))
+      ;
+    else if (unformat (input, "ip6-memory %U", unformat_memory_size,
+                       &ip6_memory))
+      ;
+    else if (unformat (input, "memory %U", unformat_memory_size, &memory))
+      ip4_memory = ip6_memory = memory;
+    else if (unformat (input, "max-flows %u", &sm->max_flows))
+      ;
+    else if (unformat (input, "hugepages"))
+      hugepages = 1;
+    else if (unformat (input, "snapshot %s", &sm->snapshot_path))
+      vec_add1 (sm->snapshot_path, 0);
+    else if (unformat (input, "spill %s", &spill_path))
+      vec_add1 (spill_path, 0);
+    else
+      return clib_error_return (0, "unknown input `%U'",
+                                format_unformat_error, input);
+  }
+
+  if (spill_path) {
+    error = ipfix_spill_open ((char *) spill_path);
+    vec_free (spill_path);
+    if (error)
+      return error;
+  }
+
+  if (ip4_buckets == 0 || ip6_buckets == 0 || sm->max_flows == 0)
+    return clib_error_return (0, "buckets and max-flows must not be zero");
+
+  vec_foreach (ptd, sm->per_thread_data) {
+    clib_bihash_init_16_8(&ptd->flow_hash_ip4, "ipfix-flowhash-ip4",
+                          ip4_buckets, ip4_memory);
+    clib_bihash_init_40_8(&ptd->flow_hash_ip6, "ipfix-flowhash-ip6",
+                          ip6_buckets, ip6_memory);
+
+    if (!hugepages)
+      continue;
+
+    /* With huge pages the records get room for max-flows in each family
+     * up front, so the data plane never grows them into small pages */
+    ipfix_advise_hugepages (uword_to_pointer (ptd->flow_hash_ip4.alloc_arena,
+                                              void *),
+                            ptd->flow_hash_ip4.alloc_arena_size);
+    ipfix_advise_hugepages (uword_to_pointer (ptd->flow_hash_ip6.alloc_arena,
+                                              void *),
+                            ptd->flow_hash_ip6.alloc_arena_size);
+
+    pool_alloc_aligned (ptd->flow_records_ip4, sm->max_flows,
+                        CLIB_CACHE_LINE_BYTES);
+    pool_alloc_aligned (ptd->flow_records_ip6, sm->max_flows,
+                        CLIB_CACHE_LINE_BYTES);
+    vec_validate_aligned (ptd->flow_counters_ip4, sm->max_flows - 1,
+                          CLIB_CACHE_LINE_BYTES);
+    vec_validate_aligned (ptd->flow_counters_ip6, sm->max_flows - 1,
+                          CLIB_CACHE_LINE_BYTES);
+
+    ipfix_advise_hugepages (ptd->flow_records_ip4,
+                            sm->max_flows * sizeof (ptd->flow_records_ip4[0]));
+    ipfix_advise_hugepages (ptd->flow_records_ip6,
+                            sm->max_flows * sizeof (ptd->flow_records_ip6[0]));
+    ipfix_advise_hugepages (ptd->flow_counters_ip4,
+                            vec_bytes (ptd->flow_counters_ip4));
+    ipfix_advise_hugepages (ptd->flow_counters_ip6,
+                            vec_bytes (ptd->flow_counters_ip6));
+  }
+
+  return 0;
+}
+
+VLIB_CONFIG_FUNCTION (ipfix_config, "ipfix");
+
 /**
  * @brief Hook the ipfix plugins into the VPP graph hierarchy.
  */
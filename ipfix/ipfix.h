@@ -19,13 +19,81 @@
 #include <vnet/ip/ip.h>
 #include <vnet/ethernet/ethernet.h>
 #include <vppinfra/bihash_16_8.h>
-#include <vppinfra/bihash_48_8.h>
+#include <vppinfra/bihash_40_8.h>
 #include <vppinfra/hash.h>
 #include <vppinfra/error.h>
 #include <vppinfra/elog.h>
 #include <vppinfra/vec.h>
+#include <vppinfra/tw_timer_2t_1w_2048sl.h>
 #include <ipfix/netflow_v10.h>
 
+/* Flow expiry timer wheel: one second ticks, the timer id tells which
+ * record pool the timer's pool index refers to. Deadlines beyond the
+ * wheel's reach are handled by re-arming when the timer fires. */
+#define IPFIX_TIMER_TICK 1.0
+#define IPFIX_TIMER_MAX_TICKS 2047
+#define IPFIX_TIMER_IP4 0
+#define IPFIX_TIMER_IP6 1
+
+/* Flows per thread unless configured otherwise, and how many evicted
+ * records a thread may hold for the process node before it stops
+ * metering new flows */
+#define IPFIX_DEFAULT_MAX_FLOWS (1 << 20)
+#define IPFIX_MAX_EVICTED_RECORDS (64 << 10)
+
+/* Expired records per family waiting to be exported before new ones are
+ * dropped, or spilled to disk, unless configured otherwise. The process
+ * node sends them a batch of packets at a time and yields in between,
+ * for at least IPFIX_EXPORT_YIELD seconds. */
+#define IPFIX_DEFAULT_EXPORT_QUEUE (1 << 20)
+#define IPFIX_EXPORT_BATCH 32
+#define IPFIX_EXPORT_YIELD 1e-4
+/* spilled records read back into a queue per batch, at most */
+#define IPFIX_SPILL_CHUNK 4096
+
+/* Per thread cache of the ports of fragmented packets, see the slow
+ * path nodes. Entries are only trusted for a while, fragment ids wrap. */
+#define IPFIX_FRAG_CACHE_SIZE 1024
+#define IPFIX_FRAG_LIFETIME 2000 // milliseconds
+/* longest IPv6 extension header chain walked */
+#define IPFIX_IP6_MAX_EXT_HEADERS 8
+
+/* Per thread direct mapped cache of recent flow lookups, by hash */
+#define IPFIX_FLOW_CACHE_SIZE 1024
+
+/* Flows past a packet count can be marked by the NIC, see
+ * ipfix_sync_offloads. The mark is the offload's index from a base that
+ * tells it from other marks. */
+#define IPFIX_DEFAULT_MAX_OFFLOADS 1024
+#define IPFIX_OFFLOAD_MARK_BASE (1 << 24)
+
+/* Flow hash sizing per thread and family, see the ipfix startup stanza */
+#define IPFIX_DEFAULT_BUCKETS 20000
+#define IPFIX_DEFAULT_HASH_MEMORY (128 << 20)
+
+/* Per thread counters in the stats segment, for scraping without the
+ * CLI. Active flows is a gauge, the rest count up. */
+#define foreach_ipfix_counter                                   \
+_(ACTIVE_FLOWS, "/ipfix/active-flows")                          \
+_(FLOWS_CREATED, "/ipfix/flows-created")                        \
+_(FLOWS_EXPIRED, "/ipfix/flows-expired")                        \
+_(FLOWS_EVICTED, "/ipfix/flows-evicted")                        \
+_(HASH_ADD_FAILED, "/ipfix/hash-add-failures")                  \
+_(RECORDS_EXPORTED, "/ipfix/records-exported")                  \
+_(PACKETS_EXPORTED, "/ipfix/packets-exported")                  \
+_(EXPORT_DROPS, "/ipfix/export-drops")
+
+typedef enum {
+#define _(sym,name) IPFIX_COUNTER_##sym,
+  foreach_ipfix_counter
+#undef _
+  IPFIX_N_COUNTER,
+} ipfix_counter_t;
+
+/* Meter cycles per frame, as a histogram: bucket i of the
+ * "/ipfix/meter-cycles" counter counts frames of 2^i to 2^(i+1) cycles */
+#define IPFIX_CYCLES_BUCKETS 32
+
 typedef struct {
   ip4_address_t src;
   ip4_address_t dst;
@@ -34,20 +102,37 @@ typedef struct {
   u16 dst_port;
 } ipfix_ip4_flow_key_t;
 
-typedef struct {
-  ip6_address_t src;
-  ip6_address_t dst;
-  u8 protocol;
-  u16 src_port;
-  u16 dst_port;
+STATIC_ASSERT (sizeof (ipfix_ip4_flow_key_t) == 16,
+               "IPv4 flow key must fill a bihash_16_8 key");
+
+/* Exactly a bihash_40_8 key, built a word at a time: the addresses in
+ * the order they are in the header, then one word for the rest */
+typedef union {
+  struct {
+    ip6_address_t src;
+    ip6_address_t dst;
+    u16 src_port;
+    u16 dst_port;
+    u8 protocol;
+    u8 pad[3];
+  };
+  u64 as_u64[5];
 } ipfix_ip6_flow_key_t;
 
+STATIC_ASSERT (sizeof (ipfix_ip6_flow_key_t) == 40,
+               "IPv6 flow key must fill a bihash_40_8 key");
+
+/* Exported flow records, as the templates describe them: the key is kept
+ * as it is on the wire, timestamps and counters in host byte order */
 typedef struct {
   ipfix_ip4_flow_key_t flow_key;
   u64 flow_start; //milliseconds;
   u64 flow_end; // milliseconds;
   u64 packet_delta_count;
   u64 octet_delta_count;
+  /* biflows only, from the responder to the initiator */
+  u64 reverse_packet_delta_count;
+  u64 reverse_octet_delta_count;
 } ipfix_ip4_flow_value_t;
 
 typedef struct {
@@ -56,42 +141,362 @@ typedef struct {
   u64 flow_end;
   u64 packet_delta_count;
   u64 octet_delta_count;
+  u64 reverse_packet_delta_count;
+  u64 reverse_octet_delta_count;
 } ipfix_ip6_flow_value_t;
 
+/* RFC 5103 reverse information elements are the forward ones under this
+ * private enterprise number */
+#define IPFIX_REVERSE_PEN 29305
+
+/* Fields a template can be made of, in the default template's order:
+ * _(symbol, CLI name, IPv4 element, IPv6 element, enterprise number,
+ *   flow value member, kept in host byte order) */
+#define foreach_ipfix_field                                             \
+_(SRC_ADDRESS, "src-address", sourceIPv4Address, sourceIPv6Address, 0, \
+  flow_key.src, 0)                                                      \
+_(DST_ADDRESS, "dst-address", destinationIPv4Address,                  \
+  destinationIPv6Address, 0, flow_key.dst, 0)                           \
+_(PROTOCOL, "protocol", protocolIdentifier, protocolIdentifier, 0,     \
+  flow_key.protocol, 0)                                                 \
+_(SRC_PORT, "src-port", sourceTransportPort, sourceTransportPort, 0,   \
+  flow_key.src_port, 0)                                                 \
+_(DST_PORT, "dst-port", destinationTransportPort,                      \
+  destinationTransportPort, 0, flow_key.dst_port, 0)                    \
+_(FLOW_START, "flow-start", flowStartMilliseconds,                     \
+  flowStartMilliseconds, 0, flow_start, 1)                              \
+_(FLOW_END, "flow-end", flowEndMilliseconds, flowEndMilliseconds, 0,   \
+  flow_end, 1)                                                          \
+_(OCTETS, "octets", octetDeltaCount, octetDeltaCount, 0,               \
+  octet_delta_count, 1)                                                 \
+_(PACKETS, "packets", packetDeltaCount, packetDeltaCount, 0,           \
+  packet_delta_count, 1)                                                \
+_(REVERSE_OCTETS, "reverse-octets", octetDeltaCount, octetDeltaCount,  \
+  IPFIX_REVERSE_PEN, reverse_octet_delta_count, 1)                      \
+_(REVERSE_PACKETS, "reverse-packets", packetDeltaCount,                \
+  packetDeltaCount, IPFIX_REVERSE_PEN, reverse_packet_delta_count, 1)
+
+typedef enum {
+#define _(sym,name,ie4,ie6,pen,member,host_order) IPFIX_FIELD_##sym,
+  foreach_ipfix_field
+#undef _
+  IPFIX_N_FIELDS,
+} ipfix_field_t;
+
+/* Ports of a fragmented packet, taken from its first fragment */
 typedef struct {
-  /* API message ID base */
-  u16 msg_id_base;
+  /* addresses, fragment id, protocol and address family */
+  u64 id[5];
+  u32 ports;
+  /* low 32 bits of the vlib time in milliseconds */
+  u32 seen;
+} ipfix_frag_entry_t;
+
+/* Packet sampling of an interface, as configured */
+typedef struct {
+  /* one packet out of this many is metered, 0 or 1 to meter them all */
+  u32 interval;
+  /* pick it at random rather than the first of every interval */
+  u8 is_random;
+} ipfix_sampling_t;
+
+/* Where a thread is at in the sampling interval of an interface */
+typedef struct {
+  u32 position;
+  /* position of the packet to meter in the current interval */
+  u32 pick;
+} ipfix_sampler_t;
+
+/* Options data record reporting the sampling of an interface. The last
+ * two fields are the packet interval and space for systematic sampling,
+ * the sample size and population for random sampling. */
+typedef struct {
+  u32 ingress_interface;
+  u16 selector_algorithm;
+  u32 sampling_n;
+  u32 sampling_m;
+} ipfix_sampling_value_t;
+
+/* Live flows are split in two arrays sharing the record index. The part
+ * every packet updates is kept dense, padded to 32 bytes so that two
+ * records fill a cache line and none straddles two: a meter update
+ * touches a single line. The counters are deltas since the last report.
+ * They are 64 bits: the active timeout is not bounded, and a single flow
+ * at line rate wraps 32 bits within minutes. */
+typedef struct {
+  u64 octet_delta_count;
+  u64 packet_delta_count;
+  /* low 32 bits of the last-seen time, see ipfix_flow_end */
+  u32 flow_end;
+  u32 pad[3];
+} ipfix_flow_counters_t;
+
+STATIC_ASSERT (CLIB_CACHE_LINE_BYTES % sizeof (ipfix_flow_counters_t) == 0,
+               "flow counters must not straddle cache lines");
+
+/* The part only looked at on creation and expiry */
+typedef struct {
+  ipfix_ip4_flow_key_t flow_key;
+  u64 flow_start;
+  u32 timer_handle;
+  /* index in ipfix_main.offloads, ~0 unless the NIC marks the flow */
+  u32 offload_index;
+  /* biflows: the key is ordered, set if the initiator is its dst */
+  u8 initiator_reversed;
+} ipfix_ip4_flow_record_t;
+
+typedef struct {
+  ipfix_ip6_flow_key_t flow_key;
+  u64 flow_start;
+  u32 timer_handle;
+  u32 offload_index;
+  u8 initiator_reversed;
+} ipfix_ip6_flow_record_t;
+
+/* The bihash value of a flow: its record index, and for biflows whether
+ * the initiator is the key's dst, so that the meter knows the direction
+ * of a packet without reading the record */
+#define IPFIX_VALUE_REVERSED (1ULL << 32)
+#define ipfix_value_index(v) ((u32) (v))
+
+/* Where export packets go. Each collector is a transport session of its
+ * own and so has its own sequence number, RFC 7011 section 3.1 */
+typedef struct {
+  ip46_address_t address;
+  u16 port;
+  u8 is_ipv6;
+  /* data records sent to this collector so far */
+  u32 sequence_number;
+} ipfix_collector_t;
+
+typedef enum {
+  /* every collector gets every message */
+  IPFIX_COLLECTORS_REPLICATE,
+  /* data records are spread by flow key, templates still go to all */
+  IPFIX_COLLECTORS_HASH,
+} ipfix_collector_mode_t;
+
+/* A vnet_flow rule marking the packets of one flow on one interface.
+ * Biflows get a second rule for the swapped tuple, ~0 otherwise. */
+typedef struct {
+  u32 flow_index;
+  u32 reverse_flow_index;
+  u32 hw_if_index;
+  /* the thread owning the record and its bihash value, which the marked
+   * packets are counted with; ~0 once the record is gone */
+  u32 thread_index;
+  u8 is_ipv6;
+  u64 record_value;
+} ipfix_offload_t;
+
+/* A record that crossed the offload threshold, for the process node */
+typedef struct {
+  u32 record_idx;
+  u32 sw_if_index;
+  u8 is_ipv6;
+} ipfix_offload_candidate_t;
+
+/* Flow times are milliseconds of vlib time from this base on. vlib time
+ * starts near zero with each process, the base leaves room below it for
+ * the flows a snapshot brings back from before the restart. */
+#define IPFIX_TIME_BASE (1ULL << 40)
+
+always_inline u64
+ipfix_time_now (vlib_main_t * vm)
+{
+  return (u64) (vlib_time_now (vm) * 1e3) + IPFIX_TIME_BASE;
+}
+
+/* Full last-seen time of a flow. Flows are reported at least every active
+ * timeout, far less than the 49 days it takes the low bits to wrap. */
+always_inline u64
+ipfix_flow_end (u64 flow_start, u32 flow_end)
+{
+  return flow_start + (u32) (flow_end - (u32) flow_start);
+}
+
+/* Last seen in either direction, `reverse` is null unless biflow */
+always_inline u64
+ipfix_flow_last_seen (u64 flow_start, ipfix_flow_counters_t * counters,
+                      ipfix_flow_counters_t * reverse)
+{
+  u64 end = ipfix_flow_end (flow_start, counters->flow_end);
+
+  if (reverse)
+    end = clib_max (end, ipfix_flow_end (flow_start, reverse->flow_end));
+  return end;
+}
+
+/* A live flow as snapshots keep it: the key as metered, ordered for
+ * biflows, then what is the same for both families, its times in
+ * milliseconds since the epoch */
+typedef struct {
+  u64 flow_start;
+  u64 flow_end;
+  u64 octet_delta_count;
+  u64 packet_delta_count;
+  u64 reverse_octet_delta_count;
+  u64 reverse_packet_delta_count;
+  u32 thread_index;
+  u8 initiator_reversed;
+} ipfix_flow_snapshot_t;
+
+typedef struct {
+  ipfix_ip4_flow_key_t flow_key;
+  ipfix_flow_snapshot_t flow;
+} ipfix_ip4_flow_snapshot_t;
+
+typedef struct {
+  ipfix_ip6_flow_key_t flow_key;
+  ipfix_flow_snapshot_t flow;
+} ipfix_ip6_flow_snapshot_t;
+
+/* Export records that did not fit in an export queue, appended to a file
+ * and read back from the front once the queue has room */
+typedef struct {
+  int fd;
+  u64 read_offset;
+  u64 write_offset;
+} ipfix_spill_t;
+
+/* Flow state owned by a single vlib thread. Only the owning thread
+ * touches it from the data plane; the process node only walks it with
+ * the workers held at the barrier. */
+typedef struct {
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline0);
 
   clib_bihash_16_8_t flow_hash_ip4;
-  clib_bihash_48_8_t flow_hash_ip6;
+  clib_bihash_40_8_t flow_hash_ip6;
 
-  /* vector of flow records */
-  ipfix_ip4_flow_value_t * flow_records_ip4;
-  ipfix_ip6_flow_value_t * flow_records_ip6;
+  /* the last key and value seen at each IPFIX_FLOW_CACHE_SIZE slot of
+   * the hashes above, cleared with the record; free slots hold a key no
+   * packet has, all ones */
+  clib_bihash_kv_16_8_t * flow_cache_ip4;
+  clib_bihash_kv_40_8_t * flow_cache_ip6;
 
-  /* exporter configuration */
+  /* pools of flow records, the bihash values are pool indices */
+  ipfix_ip4_flow_record_t * flow_records_ip4;
+  ipfix_ip6_flow_record_t * flow_records_ip6;
+
+  /* per-packet counters of the records above, by the same index */
+  ipfix_flow_counters_t * flow_counters_ip4;
+  ipfix_flow_counters_t * flow_counters_ip6;
+  /* biflows only, the responder's direction, by the same index */
+  ipfix_flow_counters_t * reverse_counters_ip4;
+  ipfix_flow_counters_t * reverse_counters_ip6;
+
+  /* idle/active expiry deadlines of the records above */
+  tw_timer_wheel_2t_1w_2048sl_t timer_wheel;
+  u32 * expired_timers;
+
+  /* evicted from a full table, waiting to be exported */
+  ipfix_ip4_flow_value_t * evicted_records_ip4;
+  ipfix_ip6_flow_value_t * evicted_records_ip6;
+
+  /* records to have the NIC mark, on the next process node run */
+  ipfix_offload_candidate_t * offload_candidates;
+
+  /* direct mapped, IPFIX_FRAG_CACHE_SIZE entries */
+  ipfix_frag_entry_t * frag_cache;
+
+  /* sampling state, indexed by sw_if_index */
+  ipfix_sampler_t * samplers;
+  u32 random_seed;
+} ipfix_per_thread_data_t;
+
+typedef struct {
+  /* API message ID base */
+  u16 msg_id_base;
+
+  /* per vlib thread flow tables, indexed by thread index */
+  ipfix_per_thread_data_t * per_thread_data;
+
+  /* exporter configuration, source addresses per transport family */
   ip4_address_t exporter_ip;
-  ip4_address_t collector_ip;
+  ip6_address_t exporter_ip6;
   u16 exporter_port;
-  u16 collector_port;
   u32 observation_domain;
+  /* collectors to export to, the first is the one "set ipfix ip
+   * collector" changes */
+  ipfix_collector_t * collectors;
+  u8 collector_mode;
+  /* largest IP datagram to export, data packets are filled up to it */
+  u16 path_mtu;
   u64 idle_flow_timeout;
   u64 active_flow_timeout;
   u64 template_timeout;
+  /* live flows per thread, both families, before evicting */
+  u32 max_flows;
+  /* meter both directions of a connection as one RFC 5103 biflow */
+  u8 biflow;
+  /* packets after which a flow is offloaded, 0 for never, and how many
+   * flow rules the NICs are given at most */
+  u32 offload_threshold;
+  u32 max_offloads;
+  ipfix_offload_t * offloads;
+  /* hw_if_index of interfaces that refused a flow rule */
+  uword * offload_unsupported;
+  /* aggregated flows: keys are and-ed with these masks before hashing,
+   * as bihash key words */
+  u8 aggregate_ip4;
+  u8 aggregate_ip6;
+  u64 key_mask_ip4[2];
+  u64 key_mask_ip6[5];
 
-  /* allocate templates to use in nodes just once */
+  /* templates in use, rebuilt by ipfix_set_template */
   netflow_v10_template_t * template_ip4;
   netflow_v10_template_t * template_ip6;
+  ipfix_field_t * template_fields_ip4;
+  ipfix_field_t * template_fields_ip6;
+  /* changed templates get a fresh id, collectors may still cache the
+   * old definition */
+  u16 next_template_id;
+  /* when the templates were last sent, 0 to send them on the next run */
+  u64 template_last_sent;
 
-  /* vector of expired flows to export */
-  ipfix_ip4_flow_value_t * expired_records_ip4;
-  ipfix_ip6_flow_value_t * expired_records_ip6;
+  /* packet sampling by sw_if_index, and how many interfaces sample */
+  ipfix_sampling_t * sampling;
+  u32 n_sampling_interfaces;
+  /* options templates reporting it, indexed by is_random */
+  netflow_v10_template_t * template_sampling[2];
 
-  /* vector of IPFIX data packets to be transmitted */
-  netflow_v10_data_packet_t *data_packets;
+  /* expired flows waiting to be exported, from the head index on */
+  ipfix_ip4_flow_value_t * export_queue_ip4;
+  ipfix_ip6_flow_value_t * export_queue_ip6;
+  u32 export_queue_head_ip4;
+  u32 export_queue_head_ip6;
+  /* records per family the queues hold, and how many did not fit since
+   * the process node last counted them */
+  u32 export_queue_max;
+  u32 export_queue_dropped;
+  /* export packets per second, 0 for as fast as buffers allow */
+  u32 export_rate;
+  /* where records past export_queue_max go instead of being dropped,
+   * indexed by is_ipv6, fd -1 unless configured */
+  ipfix_spill_t spill[2];
 
-  /* track sequence number for IPFIX packets */
-  u32 sequence_number;
+  /* flow table snapshot saved on exit and restored on start, a C string,
+   * null unless configured */
+  u8 * snapshot_path;
+
+  /* flow records are stamped with vlib time in milliseconds, adding
+   * this converts them to milliseconds since the epoch on export */
+  u64 wall_clock_offset;
+
+  /* export packets go to ip4-lookup or ip6-lookup a frame at a time,
+   * indexed by is_ipv6 */
+  u32 lookup_node_index[2];
+  vlib_frame_t * export_frame[2];
+  /* records of each collector while spreading them by flow key */
+  u8 ** collector_records;
+
+  /* buffers allocated in bulk, waiting to carry export packets */
+  u32 * export_buffers;
+
+  /* stats segment counters, indexed by ipfix_counter_t, and the meter
+   * cycles histogram */
+  vlib_simple_counter_main_t counters[IPFIX_N_COUNTER];
+  vlib_simple_counter_main_t meter_cycles;
 
   u32 random_seed;
 
@@ -102,6 +507,153 @@ typedef struct {
 
 extern ipfix_main_t ipfix_main;
 
+/* The responder's counters of a flow, null unless metering biflows */
+always_inline ipfix_flow_counters_t *
+ipfix_flow_reverse_ip4 (ipfix_per_thread_data_t * ptd, u32 index)
+{
+  if (PREDICT_TRUE (!ipfix_main.biflow))
+    return 0;
+  return vec_elt_at_index (ptd->reverse_counters_ip4, index);
+}
+
+always_inline ipfix_flow_counters_t *
+ipfix_flow_reverse_ip6 (ipfix_per_thread_data_t * ptd, u32 index)
+{
+  if (PREDICT_TRUE (!ipfix_main.biflow))
+    return 0;
+  return vec_elt_at_index (ptd->reverse_counters_ip6, index);
+}
+
+/* Assemble the exported view of a live flow from its two halves */
+always_inline void
+ipfix_flow_value_ip4 (ipfix_per_thread_data_t * ptd, u32 index,
+                      ipfix_ip4_flow_value_t * value)
+{
+  ipfix_ip4_flow_record_t *record = pool_elt_at_index (ptd->flow_records_ip4,
+                                                       index);
+  ipfix_flow_counters_t *counters = vec_elt_at_index (ptd->flow_counters_ip4,
+                                                      index);
+  ipfix_flow_counters_t *reverse = ipfix_flow_reverse_ip4 (ptd, index);
+
+  value->flow_key = record->flow_key;
+  value->flow_start = record->flow_start;
+  value->flow_end = ipfix_flow_last_seen (record->flow_start, counters,
+                                          reverse);
+  value->packet_delta_count = counters->packet_delta_count;
+  value->octet_delta_count = counters->octet_delta_count;
+  value->reverse_packet_delta_count = reverse ? reverse->packet_delta_count : 0;
+  value->reverse_octet_delta_count = reverse ? reverse->octet_delta_count : 0;
+
+  /* biflows are reported from the initiator's side */
+  if (record->initiator_reversed) {
+    value->flow_key.src = record->flow_key.dst;
+    value->flow_key.dst = record->flow_key.src;
+    value->flow_key.src_port = record->flow_key.dst_port;
+    value->flow_key.dst_port = record->flow_key.src_port;
+  }
+}
+
+always_inline void
+ipfix_flow_value_ip6 (ipfix_per_thread_data_t * ptd, u32 index,
+                      ipfix_ip6_flow_value_t * value)
+{
+  ipfix_ip6_flow_record_t *record = pool_elt_at_index (ptd->flow_records_ip6,
+                                                       index);
+  ipfix_flow_counters_t *counters = vec_elt_at_index (ptd->flow_counters_ip6,
+                                                      index);
+  ipfix_flow_counters_t *reverse = ipfix_flow_reverse_ip6 (ptd, index);
+
+  value->flow_key = record->flow_key;
+  value->flow_start = record->flow_start;
+  value->flow_end = ipfix_flow_last_seen (record->flow_start, counters,
+                                          reverse);
+  value->packet_delta_count = counters->packet_delta_count;
+  value->octet_delta_count = counters->octet_delta_count;
+  value->reverse_packet_delta_count = reverse ? reverse->packet_delta_count : 0;
+  value->reverse_octet_delta_count = reverse ? reverse->octet_delta_count : 0;
+
+  /* biflows are reported from the initiator's side */
+  if (record->initiator_reversed) {
+    value->flow_key.src = record->flow_key.dst;
+    value->flow_key.dst = record->flow_key.src;
+    value->flow_key.src_port = record->flow_key.dst_port;
+    value->flow_key.dst_port = record->flow_key.src_port;
+  }
+}
+
+/* A live flow of either family as the flow walks report it, from the
+ * initiator's side. Ports are in network order like in the flow key,
+ * timestamps in milliseconds since the epoch. */
+typedef struct {
+  ip46_address_t src;
+  ip46_address_t dst;
+  u16 src_port;
+  u16 dst_port;
+  u8 protocol;
+  u8 is_ipv6;
+  u32 thread_index;
+  u32 record_index;
+  u64 flow_start;
+  u64 flow_end;
+  u64 packets;
+  u64 octets;
+  u64 reverse_packets;
+  u64 reverse_octets;
+} ipfix_flow_info_t;
+
+/* The flows a walk reports. A prefix of length 0 matches any flow, a
+ * longer one only flows of its family. */
+typedef struct {
+  ip46_address_t src;
+  ip46_address_t dst;
+  u8 src_prefix_len;
+  u8 dst_prefix_len;
+  u8 src_is_ipv6;
+  u8 dst_is_ipv6;
+} ipfix_flow_filter_t;
+
+/* Where a flow walk resumes: each thread's IPv4 then IPv6 records, in
+ * pool order. All zeroes starts from the beginning. */
+typedef struct {
+  u32 thread_index;
+  u32 record_index;
+  u8 is_ipv6;
+} ipfix_flow_cursor_t;
+
+/* Records a walk looks at per barrier hold, see ipfix_flow_walk */
+#define IPFIX_FLOW_WALK_PAGE 1024
+
+/* Walk pages one ipfix_flow_dump goes through once it sent a flow */
+#define IPFIX_FLOW_DUMP_PAGES 16
+
+int ipfix_flow_walk (ipfix_flow_cursor_t * cursor,
+                     ipfix_flow_filter_t * filter, u32 max_flows,
+                     ipfix_flow_info_t ** flows);
+int ipfix_set_template (u8 is_ipv6, ipfix_field_t * fields);
+int ipfix_set_biflow (u8 enable);
+void ipfix_rearm_timers (vlib_main_t * vm);
+int ipfix_add_del_collector (ip46_address_t * address, u16 port, u8 is_ipv6,
+                             u8 is_add);
+int ipfix_set_aggregation (u8 is_ipv6, u8 src_prefix_len, u8 dst_prefix_len,
+                           u8 ports, u8 protocol);
+unformat_function_t unformat_ipfix_field;
+
+int ipfix_restore_record_ip4 (ipfix_per_thread_data_t * ptd,
+                              ipfix_ip4_flow_snapshot_t * flow, u64 now);
+int ipfix_restore_record_ip6 (ipfix_per_thread_data_t * ptd,
+                              ipfix_ip6_flow_snapshot_t * flow, u64 now);
+clib_error_t *ipfix_snapshot_save (char *path);
+clib_error_t *ipfix_spill_open (char *path);
+void ipfix_spill_queues (u8 all);
+void ipfix_unspill_queues (void);
+void ipfix_init_thread_data (ipfix_per_thread_data_t * ptd);
+void ipfix_bench_meter (vlib_main_t * vm, ipfix_per_thread_data_t * ptd,
+                        u32 * buffers, u32 n_packets, u8 is_ipv6, u64 now);
+void ipfix_bench_expire (ipfix_per_thread_data_t * ptd, f64 now,
+                         u64 current_time);
+u32 ipfix_bench_encode (u8 * buffer, u8 is_ipv6, void * records,
+                        u32 n_records);
+
 extern vlib_node_registration_t ipfix_node;
 
 #define IPFIX_PLUGIN_BUILD_VER "1.0"
@@ -63,7 +63,12 @@ typedef struct {
 ipfix_test_main_t ipfix_test_main;
 
 #define foreach_standard_reply_retval_handler   \
-_(ipfix_flow_meter_enable_disable_reply)
+_(ipfix_flow_meter_enable_disable_reply)        \
+_(ipfix_flow_meter_enable_disable_bulk_reply)   \
+_(ipfix_exporter_set_reply)                     \
+_(ipfix_collector_add_del_reply)                \
+_(ipfix_timeouts_set_reply)                     \
+_(ipfix_template_set_reply)
 
 #define _(n)                                            \
     static void vl_api_##n##_t_handler                  \
@@ -81,12 +86,37 @@ _(ipfix_flow_meter_enable_disable_reply)
 foreach_standard_reply_retval_handler;
 #undef _
 
+static void vl_api_ipfix_flow_details_t_handler
+(vl_api_ipfix_flow_details_t * mp)
+{
+    vat_main_t * vam = ipfix_test_main.vat_main;
+    format_function_t * format_address =
+        mp->is_ipv6 ? format_ip6_address : format_ip4_address;
+
+    print (vam->ofp, "[%u:%u] proto %u %U:%u -> %U:%u, %llu packets, "
+           "%llu octets, cursor %llu",
+           ntohl (mp->thread_index), ntohl (mp->record_index),
+           mp->protocol,
+           format_address, mp->src_address, ntohs (mp->src_port),
+           format_address, mp->dst_address, ntohs (mp->dst_port),
+           clib_net_to_host_u64 (mp->packets),
+           clib_net_to_host_u64 (mp->octets),
+           clib_net_to_host_u64 (mp->cursor));
+}
+
 /* 
  * Table of message reply handlers, must include boilerplate handlers
  * we just generated
  */
 #define foreach_vpe_api_reply_msg                                       \
-_(IPFIX_FLOW_METER_ENABLE_DISABLE_REPLY, ipfix_flow_meter_enable_disable_reply)
+_(IPFIX_FLOW_METER_ENABLE_DISABLE_REPLY, ipfix_flow_meter_enable_disable_reply) \
+_(IPFIX_FLOW_METER_ENABLE_DISABLE_BULK_REPLY,                           \
+  ipfix_flow_meter_enable_disable_bulk_reply)                           \
+_(IPFIX_EXPORTER_SET_REPLY, ipfix_exporter_set_reply)                   \
+_(IPFIX_COLLECTOR_ADD_DEL_REPLY, ipfix_collector_add_del_reply)         \
+_(IPFIX_TIMEOUTS_SET_REPLY, ipfix_timeouts_set_reply)                   \
+_(IPFIX_TEMPLATE_SET_REPLY, ipfix_template_set_reply)                   \
+_(IPFIX_FLOW_DETAILS, ipfix_flow_details)
 
 
 static int api_ipfix_flow_meter_enable_disable (vat_main_t * vam)
@@ -94,6 +124,8 @@ static int api_ipfix_flow_meter_enable_disable (vat_main_t * vam)
     unformat_input_t * i = vam->input;
     int enable_disable = 1;
     u32 sw_if_index = ~0;
+    u32 sampling_interval = 0;
+    u8 sampling_random = 0;
     vl_api_ipfix_flow_meter_enable_disable_t * mp;
     int ret;
 
@@ -105,6 +137,10 @@ static int api_ipfix_flow_meter_enable_disable (vat_main_t * vam)
             ;
         else if (unformat (i, "disable"))
             enable_disable = 0;
+        else if (unformat (i, "sampling %u", &sampling_interval))
+            ;
+        else if (unformat (i, "random"))
+            sampling_random = 1;
         else
             break;
     }
@@ -118,6 +154,196 @@ static int api_ipfix_flow_meter_enable_disable (vat_main_t * vam)
     M(IPFIX_FLOW_METER_ENABLE_DISABLE, mp);
     mp->sw_if_index = ntohl (sw_if_index);
     mp->enable_disable = enable_disable;
+    mp->sampling_interval = ntohl (sampling_interval);
+    mp->sampling_random = sampling_random;
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static int api_ipfix_flow_meter_enable_disable_bulk (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    int enable_disable = 1;
+    u32 sw_if_index, * sw_if_indices = 0, n, j;
+    u32 sampling_interval = 0;
+    u8 sampling_random = 0;
+    vl_api_ipfix_flow_meter_enable_disable_bulk_t * mp;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "%U", unformat_sw_if_index, vam, &sw_if_index))
+            vec_add1 (sw_if_indices, sw_if_index);
+        else if (unformat (i, "sw_if_index %d", &sw_if_index))
+            vec_add1 (sw_if_indices, sw_if_index);
+        else if (unformat (i, "disable"))
+            enable_disable = 0;
+        else if (unformat (i, "sampling %u", &sampling_interval))
+            ;
+        else if (unformat (i, "random"))
+            sampling_random = 1;
+        else
+            break;
+    }
+
+    n = vec_len (sw_if_indices);
+    if (n == 0) {
+        errmsg ("missing interface names / explicit sw_if_index numbers \n");
+        return -99;
+    }
+
+    /* Construct the API message */
+    M2(IPFIX_FLOW_METER_ENABLE_DISABLE_BULK, mp, n * sizeof (u32));
+    mp->enable_disable = enable_disable;
+    mp->sampling_interval = ntohl (sampling_interval);
+    mp->sampling_random = sampling_random;
+    mp->count = ntohl (n);
+    for (j = 0; j < n; j++)
+        mp->sw_if_indices[j] = ntohl (sw_if_indices[j]);
+    vec_free (sw_if_indices);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+/* An IPv4 address in the first four octets of `address`, or IPv6 */
+static uword unformat_ipfix_address (unformat_input_t * input, va_list * args)
+{
+    u8 * address = va_arg (*args, u8 *);
+    u8 * is_ipv6 = va_arg (*args, u8 *);
+
+    memset (address, 0, 16);
+    if (unformat (input, "%U", unformat_ip4_address, address)) {
+        *is_ipv6 = 0;
+        return 1;
+    }
+    if (unformat (input, "%U", unformat_ip6_address, address)) {
+        *is_ipv6 = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static int api_ipfix_exporter_set (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_ipfix_exporter_set_t * mp;
+    u8 address[16], is_ipv6 = 0, address_set = 0, collector_mode = 0;
+    u32 port = 0, observation_domain = 0, path_mtu = 1500;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "address %U", unformat_ipfix_address, address,
+                      &is_ipv6))
+            address_set = 1;
+        else if (unformat (i, "port %u", &port))
+            ;
+        else if (unformat (i, "observation-domain %u", &observation_domain))
+            ;
+        else if (unformat (i, "path-mtu %u", &path_mtu))
+            ;
+        else if (unformat (i, "hash"))
+            collector_mode = 1;
+        else
+            break;
+    }
+
+    if (!address_set || port == 0 || port > 65535) {
+        errmsg ("missing exporter address or port \n");
+        return -99;
+    }
+
+    /* Construct the API message */
+    M(IPFIX_EXPORTER_SET, mp);
+    mp->is_ipv6 = is_ipv6;
+    clib_memcpy (mp->exporter_address, address, 16);
+    mp->exporter_port = ntohs (port);
+    mp->observation_domain = ntohl (observation_domain);
+    mp->path_mtu = ntohl (path_mtu);
+    mp->collector_mode = collector_mode;
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static int api_ipfix_collector_add_del (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_ipfix_collector_add_del_t * mp;
+    u8 address[16], is_ipv6 = 0, address_set = 0, is_add = 1;
+    u32 port = 0;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "%U", unformat_ipfix_address, address, &is_ipv6))
+            address_set = 1;
+        else if (unformat (i, "port %u", &port))
+            ;
+        else if (unformat (i, "del"))
+            is_add = 0;
+        else
+            break;
+    }
+
+    if (!address_set || port > 65535) {
+        errmsg ("missing collector address \n");
+        return -99;
+    }
+
+    /* Construct the API message */
+    M(IPFIX_COLLECTOR_ADD_DEL, mp);
+    mp->is_add = is_add;
+    mp->is_ipv6 = is_ipv6;
+    clib_memcpy (mp->address, address, 16);
+    mp->port = ntohs (port);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static int api_ipfix_timeouts_set (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_ipfix_timeouts_set_t * mp;
+    u32 idle = 300, active = 120, template = 600;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "idle %u", &idle))
+            ;
+        else if (unformat (i, "active %u", &active))
+            ;
+        else if (unformat (i, "template %u", &template))
+            ;
+        else
+            break;
+    }
+
+    /* Construct the API message */
+    M(IPFIX_TIMEOUTS_SET, mp);
+    mp->idle_timeout = ntohl (idle);
+    mp->active_timeout = ntohl (active);
+    mp->template_timeout = ntohl (template);
 
     /* send it... */
     S(mp);
@@ -127,12 +353,123 @@ static int api_ipfix_flow_meter_enable_disable (vat_main_t * vam)
     return ret;
 }
 
+static int api_ipfix_template_set (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_ipfix_template_set_t * mp;
+    u8 is_ipv6, * fields = 0;
+    int ret;
+
+    if (unformat (i, "ip4"))
+        is_ipv6 = 0;
+    else if (unformat (i, "ip6"))
+        is_ipv6 = 1;
+    else {
+        errmsg ("expected ip4 or ip6 \n");
+        return -99;
+    }
+    /* the field names run to the end of the line */
+    if (!unformat (i, "%U", unformat_line, &fields)
+        || vec_len (fields) == 0) {
+        errmsg ("missing template fields \n");
+        return -99;
+    }
+    if (vec_len (fields) >= sizeof (mp->fields)) {
+        errmsg ("too many template fields \n");
+        vec_free (fields);
+        return -99;
+    }
+
+    /* Construct the API message */
+    M(IPFIX_TEMPLATE_SET, mp);
+    mp->is_ipv6 = is_ipv6;
+    clib_memcpy (mp->fields, fields, vec_len (fields));
+    mp->fields[vec_len (fields)] = 0;
+    vec_free (fields);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static int api_ipfix_flow_dump (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_ipfix_flow_dump_t * mp;
+    vl_api_control_ping_t * mp_ping;
+    ip4_address_t src4, dst4;
+    ip6_address_t src6, dst6;
+    u64 cursor = 0;
+    u32 max_flows = 0, src_len = 0, dst_len = 0;
+    u8 src_is_ipv6 = 0, dst_is_ipv6 = 0;
+    int ret;
+
+    memset (&src6, 0, sizeof (src6));
+    memset (&dst6, 0, sizeof (dst6));
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "cursor %llu", &cursor))
+            ;
+        else if (unformat (i, "max %u", &max_flows))
+            ;
+        else if (unformat (i, "src %U/%u", unformat_ip4_address, &src4,
+                           &src_len)) {
+            clib_memcpy (src6.as_u8, src4.as_u8, 4);
+            src_is_ipv6 = 0;
+        } else if (unformat (i, "src %U/%u", unformat_ip6_address, &src6,
+                             &src_len))
+            src_is_ipv6 = 1;
+        else if (unformat (i, "dst %U/%u", unformat_ip4_address, &dst4,
+                           &dst_len)) {
+            clib_memcpy (dst6.as_u8, dst4.as_u8, 4);
+            dst_is_ipv6 = 0;
+        } else if (unformat (i, "dst %U/%u", unformat_ip6_address, &dst6,
+                             &dst_len))
+            dst_is_ipv6 = 1;
+        else
+            break;
+    }
+
+    /* Construct the API message */
+    M(IPFIX_FLOW_DUMP, mp);
+    mp->cursor = clib_host_to_net_u64 (cursor);
+    mp->max_flows = ntohl (max_flows);
+    mp->src_is_ipv6 = src_is_ipv6;
+    clib_memcpy (mp->src_address, src6.as_u8, 16);
+    mp->src_prefix_len = src_len;
+    mp->dst_is_ipv6 = dst_is_ipv6;
+    clib_memcpy (mp->dst_address, dst6.as_u8, 16);
+    mp->dst_prefix_len = dst_len;
+
+    /* send it... */
+    S(mp);
+
+    /* Use a control ping for synchronization */
+    MPING (CONTROL_PING, mp_ping);
+    S (mp_ping);
+
+    W (ret);
+    return ret;
+}
+
 /* 
  * List of messages that the api test plugin sends,
  * and that the data plane plugin processes
  */
 #define foreach_vpe_api_msg \
-_(ipfix_flow_meter_enable_disable, "<intfc> [disable]")
+_(ipfix_flow_meter_enable_disable, "<intfc> [disable] [sampling <n> [random]]") \
+_(ipfix_flow_meter_enable_disable_bulk,                                 \
+  "<intfc> [<intfc> ...] [disable] [sampling <n> [random]]")            \
+_(ipfix_exporter_set, "address <ip4|ip6> port <n> "                     \
+  "[observation-domain <n>] [path-mtu <n>] [hash]")                     \
+_(ipfix_collector_add_del, "<ip4|ip6> [port <n>] [del]")                \
+_(ipfix_timeouts_set, "[idle <s>] [active <s>] [template <s>]")         \
+_(ipfix_template_set, "ip4|ip6 <field> ...")                            \
+_(ipfix_flow_dump, "[cursor <n>] [max <n>] [src <prefix>/<len>] [dst <prefix>/<len>]")
 
 static void ipfix_api_hookup (vat_main_t *vam)
 {
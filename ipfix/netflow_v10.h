@@ -1,6 +1,6 @@
 #include <vnet/vnet.h>
 
-// IPFIX fields. TODO: Parse from CSV file.
+// IPFIX information elements the exporter can fill in, see ipfix_fields.
 #define octetDeltaCount 1
 #define packetDeltaCount 2
 #define protocolIdentifier 4
@@ -12,6 +12,17 @@
 #define destinationIPv6Address 28
 #define flowStartMilliseconds 152
 #define flowEndMilliseconds 153
+// Packet sampling options, RFC 5477.
+#define ingressInterface 10
+#define selectorAlgorithm 304
+#define samplingPacketInterval 305
+#define samplingPacketSpace 306
+#define samplingSize 309
+#define samplingPopulation 310
+
+// selectorAlgorithm values
+#define SELECTOR_SYSTEMATIC_COUNT 1
+#define SELECTOR_RANDOM_N_OUT_OF_N 3
 
 typedef struct {
   u16 version;
@@ -27,6 +38,7 @@ typedef struct {
   u16 size; // In octets.
   u32 enterprise_number;
   size_t record_offset;
+  u8 host_byte_order; // Value is swapped to network order on export.
 } netflow_v10_field_specifier_t;
 
 typedef struct {
@@ -34,30 +46,44 @@ typedef struct {
   u16 length;
 } netflow_v10_set_header_t;
 
+/* A template set is compiled into a short list of encoder steps when it
+ * is configured. Each step moves one run of fields that sit next to each
+ * other both in the flow record and in the data record, so the encoder
+ * only dispatches once per step and message, never per field and record. */
+typedef enum {
+  NETFLOW_V10_ENCODE_COPY, // any size, memcpy
+  NETFLOW_V10_ENCODE_COPY1,
+  NETFLOW_V10_ENCODE_COPY2,
+  NETFLOW_V10_ENCODE_COPY4,
+  NETFLOW_V10_ENCODE_COPY8,
+  NETFLOW_V10_ENCODE_COPY16,
+  NETFLOW_V10_ENCODE_SWAP16,
+  NETFLOW_V10_ENCODE_SWAP32,
+  NETFLOW_V10_ENCODE_SWAP64,
+} netflow_v10_encode_op_t;
+
 typedef struct {
-  netflow_v10_set_header_t header;
-  u8 *data;
-} netflow_v10_data_set_t;
+  u8 op;
+  u16 size; // In octets.
+  u16 data_offset; // Within the encoded data record.
+  u32 record_offset; // Within the flow record.
+} netflow_v10_encode_step_t;
 
 typedef struct {
   u16 id;
 
   /* Vector of fields */
   netflow_v10_field_specifier_t *fields;
+
+  /* Compiled from the fields above */
+  netflow_v10_encode_step_t *encoder;
+  u16 record_size; // Octets per data record.
+
+  /* Non-zero for options templates: this many leading fields are scope */
+  u16 scope_field_count;
 } netflow_v10_template_set_t;
 
 typedef struct {
   /* Vector of sets. */
   netflow_v10_template_set_t *sets;
 } netflow_v10_template_t;
-/* Structures for data packets */
-
-typedef struct {
-  u8 *data; // Pointer to some data with the packet data.
-} netflow_v10_data_record_t;
-
-typedef struct {
-  netflow_v10_header_t header;
-  netflow_v10_template_t *template;
-  netflow_v10_data_set_t *sets;
-} netflow_v10_data_packet_t;
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <time.h>
 #include <vlib/vlib.h>
+#include <vnet/ip/ip.h>
 #include <vnet/ip/format.h>
 #include <vnet/ip/ip4_packet.h>
 #include <vnet/ip/ip6_packet.h>
@@ -25,12 +26,20 @@
 #include <vnet/tcp/tcp_packet.h>
 #include <vnet/vnet.h>
 #include <vnet/pg/pg.h>
+#include <vnet/flow/flow.h>
 #include <vppinfra/error.h>
 #include <vppinfra/vec.h>
+#include <vppinfra/xxhash.h>
 #include <vppinfra/bihash_16_8.h>
-#include <vppinfra/bihash_48_8.h>
+#include <vppinfra/bihash_40_8.h>
 #include <ipfix/ipfix.h>
 
+#if defined (__x86_64__)
+#include <x86intrin.h>
+#elif defined (__aarch64__)
+#include <arm_neon.h>
+#endif
+
 
 #define TCP_PROTOCOL 6
 #define UDP_PROTOCOL 17
@@ -40,11 +49,17 @@
 
 ipfix_main_t ipfix_main;
 
+/* The packet's flow as metering left it, found with one lookup. The
+ * record index is ~0 if the flow has no record, only the key is set. */
 typedef struct {
   u32 next_index;
   u32 sw_if_index;
-  clib_bihash_16_8_t flow_hash;
-  ipfix_ip4_flow_value_t *flow_records;
+  u32 record_index;
+  u8 is_ipv6;
+  union {
+    ipfix_ip4_flow_value_t ip4;
+    ipfix_ip6_flow_value_t ip6;
+  } flow;
 } ipfix_trace_t;
 
 static u8* format_timestamp(u8 *s, va_list *args) {
@@ -70,13 +85,13 @@ static u8* format_ipfix_ip4_flow(u8 *s, va_list *args) {
              flow_key.protocol,
              format_tcp_udp_port, flow_key.src_port,
              format_tcp_udp_port, flow_key.dst_port);
-  s = format(s, "[Flow record] start: %U, end: %U, count: %u, octets: %u\n",
+  s = format(s, "[Flow record] start: %U, end: %U, count: %lu, octets: %lu\n",
              format_timestamp,
-             clib_byte_swap_u64(flow_record->flow_start),
+             flow_record->flow_start + ipfix_main.wall_clock_offset,
              format_timestamp,
-             clib_byte_swap_u64(flow_record->flow_end),
-             ntohl(flow_record->packet_delta_count),
-             ntohl(flow_record->octet_delta_count));
+             flow_record->flow_end + ipfix_main.wall_clock_offset,
+             flow_record->packet_delta_count,
+             flow_record->octet_delta_count);
 
   return s;
 }
@@ -91,13 +106,13 @@ static u8* format_ipfix_ip6_flow(u8 *s, va_list *args) {
              flow_key.protocol,
              format_tcp_udp_port, flow_key.src_port,
              format_tcp_udp_port, flow_key.dst_port);
-  s = format(s, "[Flow record] start: %U, end: %U, count: %u, octets: %u\n",
+  s = format(s, "[Flow record] start: %U, end: %U, count: %lu, octets: %lu\n",
              format_timestamp,
-             clib_byte_swap_u64(flow_record->flow_start),
+             flow_record->flow_start + ipfix_main.wall_clock_offset,
              format_timestamp,
-             clib_byte_swap_u64(flow_record->flow_end),
-             ntohl(flow_record->packet_delta_count),
-             ntohl(flow_record->octet_delta_count));
+             flow_record->flow_end + ipfix_main.wall_clock_offset,
+             flow_record->packet_delta_count,
+             flow_record->octet_delta_count);
 
   return s;
 }
@@ -158,58 +173,68 @@ static u8* format_netflow_v10_template(u8 *s, va_list *args) {
   return s;
 }
 
+/* Decode an encoded IPFIX data message using the template it was built
+ * from */
 static u8* format_netflow_v10_data_packet(u8 *s, va_list *args) {
-  netflow_v10_data_packet_t *packet = va_arg (*args, netflow_v10_data_packet_t*);
+  netflow_v10_template_t *template = va_arg (*args, netflow_v10_template_t*);
+  netflow_v10_header_t *header = va_arg (*args, netflow_v10_header_t*);
   netflow_v10_template_set_t *template_set;
-  netflow_v10_data_set_t *data_set;
+  netflow_v10_set_header_t *set_header;
   netflow_v10_field_specifier_t *field_spec;
+  void *data, *end, *packet_end;
 
   s = format(s, "Netflow V10 Data Packet:\n");
 
-  // The data packet is build to mirror the template with data, It _should_ be
-  // safe to use the same indices.
-  u64 set_idx;
-  void *data;
-  vec_foreach_index(set_idx, packet->template->sets) {
-      template_set = vec_elt_at_index(packet->template->sets, set_idx);
-      data_set = vec_elt_at_index(packet->sets, set_idx);
-      s = format(s, "\tSet %u:\n", template_set->id);
-
-      data = data_set->data;
-      u64 field_idx;
-      vec_foreach_index(field_idx, template_set->fields) {
-        field_spec = vec_elt_at_index(template_set->fields, field_idx);
-
-        switch (field_spec->identifier) {
-        case sourceIPv4Address:
-        case destinationIPv4Address:
-          s = format(s, "\t\t%U", format_ip4_address, data);
-          break;
-        case sourceIPv6Address:
-        case destinationIPv6Address:
-          s = format(s, "\t\t%U", format_ip6_address, data);
-          break;
-        case protocolIdentifier:
-          s = format(s, "\t\t%u", *(u8 *)data);
-          break;
-        case sourceTransportPort:
-        case destinationTransportPort:
-          s = format(s, "\t\t%U", format_tcp_udp_port, *(u16 *)data);
-          break;
-        case flowStartMilliseconds:
-        case flowEndMilliseconds:
-          s = format(s, "\t\t%U", format_timestamp, clib_byte_swap_u64(*(u64 *)data));
-          break;
-        case octetDeltaCount:
-        case packetDeltaCount:
-          s = format(s, "\t\t%u", clib_byte_swap_u64(*(u64 *)data));
-          break;
-        default:
-          ASSERT(0); // This shouldn't happen - makes the packet unreadable.
-        }
-        data = (void *)((size_t)data + field_spec->size);
-        s = format(s, "\n");
-      };
+  packet_end = (void *)((size_t)header + clib_byte_swap_u16(header->byte_length));
+  set_header = (netflow_v10_set_header_t *)(header + 1);
+
+  // Data sets are written in template order, one per template set.
+  vec_foreach(template_set, template->sets) {
+      if ((void *)set_header >= packet_end)
+        break;
+
+      s = format(s, "\tSet %u:\n", clib_byte_swap_u16(set_header->id));
+
+      data = set_header + 1;
+      end = (void *)((size_t)set_header + clib_byte_swap_u16(set_header->length));
+      while (data < end) {
+        u64 field_idx;
+        vec_foreach_index(field_idx, template_set->fields) {
+          field_spec = vec_elt_at_index(template_set->fields, field_idx);
+
+          switch (field_spec->identifier) {
+          case sourceIPv4Address:
+          case destinationIPv4Address:
+            s = format(s, "\t\t%U", format_ip4_address, data);
+            break;
+          case sourceIPv6Address:
+          case destinationIPv6Address:
+            s = format(s, "\t\t%U", format_ip6_address, data);
+            break;
+          case protocolIdentifier:
+            s = format(s, "\t\t%u", *(u8 *)data);
+            break;
+          case sourceTransportPort:
+          case destinationTransportPort:
+            s = format(s, "\t\t%U", format_tcp_udp_port, *(u16 *)data);
+            break;
+          case flowStartMilliseconds:
+          case flowEndMilliseconds:
+            s = format(s, "\t\t%U", format_timestamp, clib_byte_swap_u64(*(u64 *)data));
+            break;
+          case octetDeltaCount:
+          case packetDeltaCount:
+            s = format(s, "\t\t%u", clib_byte_swap_u64(*(u64 *)data));
+            break;
+          default:
+            ASSERT(0); // This shouldn't happen - makes the packet unreadable.
+          }
+          data = (void *)((size_t)data + field_spec->size);
+          s = format(s, "\n");
+        };
+      }
+
+      set_header = end;
   };
 
   s = format(s, "End of packet\n");
@@ -220,7 +245,6 @@ static u8* format_netflow_v10_data_packet(u8 *s, va_list *args) {
 /* packet trace+ format function */
 static u8 * format_ipfix_trace (u8 * s, va_list * args)
 {
-  ipfix_ip4_flow_value_t * record;
   CLIB_UNUSED (vlib_main_t * vm) = va_arg (*args, vlib_main_t *);
   CLIB_UNUSED (vlib_node_t * node) = va_arg (*args, vlib_node_t *);
   ipfix_trace_t * t = va_arg (*args, ipfix_trace_t *);
@@ -228,21 +252,31 @@ static u8 * format_ipfix_trace (u8 * s, va_list * args)
   s = format (s, "IPFIX: sw_if_index %d, next index %d\n",
               t->sw_if_index, t->next_index);
 
-  vec_validate(t->flow_records, 0);
-  vec_foreach(record, t->flow_records) {
-    s = format (s, " %U", format_ipfix_ip4_flow, record);
+  if (t->record_index == ~0) {
+    s = format (s, " no flow record");
+  } else {
+    s = format (s, " flow record %u", t->record_index);
+  }
+  if (t->is_ipv6) {
+    s = format (s, " %U", format_ipfix_ip6_flow, &t->flow.ip6);
+  } else {
+    s = format (s, " %U", format_ipfix_ip4_flow, &t->flow.ip4);
   }
-
-  s = format(s, "\n");
 
   return s;
 }
 
 vlib_node_registration_t ipfix_meter_ip4_node;
 vlib_node_registration_t ipfix_meter_ip6_node;
+vlib_node_registration_t ipfix_meter_ip4_slow_node;
+vlib_node_registration_t ipfix_meter_ip6_slow_node;
 
-#define foreach_ipfix_error \
-_(SWAPPED, "Error (fixme)")
+#define foreach_ipfix_error                                     \
+_(EVICTED, "flows evicted, flow table full")                    \
+_(NOT_METERED, "packets not metered, flow table full")                 \
+_(HASH_ADD_FAILED, "packets not metered, flow hash add failed")        \
+_(FRAGMENT_NO_PORTS, "fragments metered without ports, first not seen") \
+_(EXPORT_QUEUE_FULL, "records not exported, export queue full")
 
 typedef enum {
 #define _(sym,str) IPFIX_ERROR_##sym,
@@ -259,20 +293,34 @@ static char * ipfix_error_strings[] = {
 
 typedef enum {
   IPFIX_NEXT_INTERFACE_OUTPUT,
+  /* meter nodes only, to their slow path node */
+  IPFIX_NEXT_SLOW_PATH,
   IPFIX_N_NEXT,
 } ipfix_next_t;
 
-static void insert_packet_flow_hash_ip4(clib_bihash_kv_16_8_t *keyvalue) {
+/* Bump a stats segment counter of the thread owning `ptd`. The process
+ * node does so for every thread, under the barrier. */
+static_always_inline void ipfix_count(ipfix_per_thread_data_t *ptd,
+                                      ipfix_counter_t counter, u64 n) {
   ipfix_main_t * im = &ipfix_main;
-  clib_bihash_add_del_16_8(&im->flow_hash_ip4, keyvalue, 1);
+
+  vlib_increment_simple_counter(&im->counters[counter],
+                                ptd - im->per_thread_data, 0, n);
 }
 
-static void insert_packet_flow_hash_ip6(clib_bihash_kv_48_8_t *keyvalue) {
-  ipfix_main_t * im = &ipfix_main;
-  clib_bihash_add_del_48_8(&im->flow_hash_ip6, keyvalue, 1);
+static int insert_packet_flow_hash_ip4(ipfix_per_thread_data_t *ptd,
+                                       clib_bihash_kv_16_8_t *keyvalue) {
+  return clib_bihash_add_del_16_8(&ptd->flow_hash_ip4, keyvalue, 1);
 }
 
-static void create_flow_key_ip4(ipfix_ip4_flow_key_t *flow_key, ip4_header_t *packet) {
+static int insert_packet_flow_hash_ip6(ipfix_per_thread_data_t *ptd,
+                                       clib_bihash_kv_40_8_t *keyvalue) {
+  return clib_bihash_add_del_40_8(&ptd->flow_hash_ip6, keyvalue, 1);
+}
+
+static void create_flow_key_ip4_scalar(ipfix_ip4_flow_key_t *flow_key,
+                                       ip4_header_t *packet) {
+  memset(flow_key, 0, sizeof(ipfix_ip4_flow_key_t));
   flow_key->src = packet->src_address;
   flow_key->dst = packet->dst_address;
   flow_key->protocol = packet->protocol;
@@ -296,652 +344,2823 @@ static void create_flow_key_ip4(ipfix_ip4_flow_key_t *flow_key, ip4_header_t *pa
   }
 }
 
-static void create_flow_key_ip6(ipfix_ip6_flow_key_t *flow_key, ip6_header_t *packet) {
-  flow_key->src = packet->src_address;
-  flow_key->dst = packet->dst_address;
-  flow_key->protocol = packet->protocol;
+/* Byte shuffles from the 16 header bytes at offset 8 of an option-less
+ * IPv4 packet (ttl, protocol, checksum, addresses, ports) into a flow
+ * key. 0x80 gives a zero byte on both x86 and ARM. The second one keeps
+ * the ports, for TCP and UDP only. */
+static const u8 ipfix_ip4_key_shuffle[2][16] = {
+  { 4, 5, 6, 7, 8, 9, 10, 11, 1, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 4, 5, 6, 7, 8, 9, 10, 11, 1, 0x80, 12, 13, 14, 15, 0x80, 0x80 },
+};
 
-  switch (packet->protocol) {
-    udp_header_t *udp;
-    tcp_header_t *tcp;
-  case UDP_PROTOCOL:
-    udp = ip6_next_header(packet);
-    flow_key->src_port = udp->src_port;
-    flow_key->dst_port = udp->dst_port;
-    break;
-  case TCP_PROTOCOL:
-    tcp = ip6_next_header(packet);
-    flow_key->src_port = tcp->src_port;
-    flow_key->dst_port = tcp->dst_port;
-    break;
-  default:
-    flow_key->src_port = 0;
-    flow_key->dst_port = 0;
+/* Builds the keys of `n_packets` packets into `kv`, prefetching the
+ * packets a few ahead. Keys are only right for packets without options
+ * or fragmentation, see ipfix_ip4_is_slow, but the whole 16 bytes are
+ * always written so the kv needs no clearing. */
+typedef void (ipfix_flow_keys_ip4_fn_t) (vlib_main_t * vm, u32 *buffers,
+                                         clib_bihash_kv_16_8_t *kv,
+                                         u32 n_packets);
+
+#define IPFIX_KEY_PREFETCH 4
+
+/* The packet in `buffers` i, prefetching the one IPFIX_KEY_PREFETCH on */
+static_always_inline ip4_header_t *
+ipfix_flow_keys_packet(vlib_main_t * vm, u32 *buffers, u32 i,
+                       u32 n_packets) {
+  if (i + IPFIX_KEY_PREFETCH < n_packets) {
+    vlib_buffer_t *p = vlib_get_buffer (vm, buffers[i + IPFIX_KEY_PREFETCH]);
+
+    vlib_prefetch_buffer_header (p, LOAD);
+    CLIB_PREFETCH (p->data, CLIB_CACHE_LINE_BYTES, LOAD);
   }
+  return vlib_buffer_get_current (vlib_get_buffer (vm, buffers[i]));
 }
 
-static void process_packet_ip4(ip4_header_t *packet) {
-  ipfix_main_t * im = &ipfix_main;
-  clib_bihash_kv_16_8_t search, result;
-  int status;
-
-  memset(&search, 0, sizeof(clib_bihash_kv_16_8_t));
-  memset(&result, 0, sizeof(clib_bihash_kv_16_8_t));
-
-  create_flow_key_ip4((ipfix_ip4_flow_key_t*) &search.key, packet);
-  status = clib_bihash_search_16_8(&im->flow_hash_ip4, &search, &result);
-
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
+static void ipfix_flow_keys_ip4_scalar(vlib_main_t * vm, u32 *buffers,
+                                       clib_bihash_kv_16_8_t *kv,
+                                       u32 n_packets) {
+  u32 i;
 
-  if (status < 0) {
-    ipfix_ip4_flow_value_t record;
-
-    memcpy(&record.flow_key, &search.key, sizeof(ipfix_ip4_flow_key_t));
-    record.flow_start = clib_byte_swap_u64(ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
-    record.flow_end = record.flow_start;
-    record.packet_delta_count = clib_byte_swap_u64(1);
-    record.octet_delta_count = (u64) packet->length << 48;
+  for (i = 0; i < n_packets; i++) {
+    create_flow_key_ip4_scalar((ipfix_ip4_flow_key_t *) &kv[i].key,
+                               ipfix_flow_keys_packet(vm, buffers, i,
+                                                      n_packets));
+  }
+}
 
-    vec_add1(im->flow_records_ip4, record);
-    /* FIXME: this index calculation may not work when we delete
-       records later */
-    search.value = vec_len(im->flow_records_ip4) - 1;
+/* A single load, shuffle and store per key, four keys at a time so the
+ * loads of one overlap the shuffles of the others. vppinfra only has
+ * u8x16_shuffle when the whole build targets the ISA, and the plugin is
+ * built for the compiler's baseline: the three primitives below wrap the
+ * intrinsics with the ISA as a target attribute instead, and
+ * ipfix_flow_keys_init picks the shuffle at runtime. NEON is part of the
+ * AArch64 baseline, no need to ask there. */
+#if defined (__x86_64__)
+#define IPFIX_KEY_SHUFFLE __attribute__ ((target ("ssse3")))
+typedef __m128i ipfix_key_vec_t;
+
+static_always_inline IPFIX_KEY_SHUFFLE ipfix_key_vec_t
+ipfix_key_vec_load(const void *p) {
+  return _mm_loadu_si128((const __m128i *) p);
+}
 
-    insert_packet_flow_hash_ip4(&search);
-  } else {
-    // update record
-    u32 record_idx = result.value;
-    ipfix_ip4_flow_value_t *record = vec_elt_at_index(im->flow_records_ip4, record_idx);
-    record->flow_end = clib_byte_swap_u64(ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
-    record->packet_delta_count = \
-      clib_byte_swap_u64(clib_byte_swap_u64(record->packet_delta_count) + 1);
-    record->octet_delta_count = record->octet_delta_count +\
-      ((u64) packet->length << 48);
-  }
+static_always_inline IPFIX_KEY_SHUFFLE ipfix_key_vec_t
+ipfix_key_vec_shuffle(ipfix_key_vec_t v, ipfix_key_vec_t mask) {
+  return _mm_shuffle_epi8(v, mask);
 }
 
-static void process_packet_ip6(ip6_header_t *packet) {
-  ipfix_main_t * im = &ipfix_main;
-  clib_bihash_kv_48_8_t search, result;
-  int status;
+static_always_inline IPFIX_KEY_SHUFFLE void
+ipfix_key_vec_store(void *p, ipfix_key_vec_t v) {
+  _mm_storeu_si128((__m128i *) p, v);
+}
+#elif defined (__aarch64__)
+#define IPFIX_KEY_SHUFFLE
+typedef uint8x16_t ipfix_key_vec_t;
 
-  memset(&search, 0, sizeof(clib_bihash_kv_48_8_t));
-  memset(&result, 0, sizeof(clib_bihash_kv_48_8_t));
+static_always_inline ipfix_key_vec_t ipfix_key_vec_load(const void *p) {
+  return vld1q_u8((const u8 *) p);
+}
 
-  create_flow_key_ip6((ipfix_ip6_flow_key_t*) &search.key, packet);
-  status = clib_bihash_search_48_8(&im->flow_hash_ip6, &search, &result);
+static_always_inline ipfix_key_vec_t
+ipfix_key_vec_shuffle(ipfix_key_vec_t v, ipfix_key_vec_t mask) {
+  return vqtbl1q_u8(v, mask);
+}
 
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
+static_always_inline void ipfix_key_vec_store(void *p, ipfix_key_vec_t v) {
+  vst1q_u8((u8 *) p, v);
+}
+#endif
+
+#ifdef IPFIX_KEY_SHUFFLE
+/* The shuffle for a packet, 1 with the ports */
+#define ipfix_key_has_ports(ip) \
+  (((ip)->protocol == TCP_PROTOCOL) | ((ip)->protocol == UDP_PROTOCOL))
+
+static IPFIX_KEY_SHUFFLE void
+ipfix_flow_keys_ip4_shuffle(vlib_main_t * vm, u32 *buffers,
+                            clib_bihash_kv_16_8_t *kv, u32 n_packets) {
+  ipfix_key_vec_t shuffle[2] = {
+    ipfix_key_vec_load(ipfix_ip4_key_shuffle[0]),
+    ipfix_key_vec_load(ipfix_ip4_key_shuffle[1]),
+  };
+  u32 i;
+
+  for (i = 0; i + 4 <= n_packets; i += 4) {
+    ip4_header_t *ip0, *ip1, *ip2, *ip3;
+    ipfix_key_vec_t key0, key1, key2, key3;
+
+    ip0 = ipfix_flow_keys_packet(vm, buffers, i, n_packets);
+    ip1 = ipfix_flow_keys_packet(vm, buffers, i + 1, n_packets);
+    ip2 = ipfix_flow_keys_packet(vm, buffers, i + 2, n_packets);
+    ip3 = ipfix_flow_keys_packet(vm, buffers, i + 3, n_packets);
+
+    key0 = ipfix_key_vec_load((u8 *) ip0 + 8);
+    key1 = ipfix_key_vec_load((u8 *) ip1 + 8);
+    key2 = ipfix_key_vec_load((u8 *) ip2 + 8);
+    key3 = ipfix_key_vec_load((u8 *) ip3 + 8);
+
+    key0 = ipfix_key_vec_shuffle(key0, shuffle[ipfix_key_has_ports(ip0)]);
+    key1 = ipfix_key_vec_shuffle(key1, shuffle[ipfix_key_has_ports(ip1)]);
+    key2 = ipfix_key_vec_shuffle(key2, shuffle[ipfix_key_has_ports(ip2)]);
+    key3 = ipfix_key_vec_shuffle(key3, shuffle[ipfix_key_has_ports(ip3)]);
+
+    ipfix_key_vec_store(kv[i].key, key0);
+    ipfix_key_vec_store(kv[i + 1].key, key1);
+    ipfix_key_vec_store(kv[i + 2].key, key2);
+    ipfix_key_vec_store(kv[i + 3].key, key3);
+  }
 
-  if (status < 0) {
-    ipfix_ip6_flow_value_t record;
+  for (; i < n_packets; i++) {
+    ip4_header_t *ip0 = ipfix_flow_keys_packet(vm, buffers, i, n_packets);
+    ipfix_key_vec_t key0 = ipfix_key_vec_load((u8 *) ip0 + 8);
 
-    memcpy(&record.flow_key, &search.key, sizeof(ipfix_ip6_flow_key_t));
-    record.flow_start = clib_byte_swap_u64(ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
-    record.flow_end = record.flow_start;
-    record.packet_delta_count = clib_byte_swap_u64(1);
-    record.octet_delta_count = (u64) packet->payload_length << 48;
+    key0 = ipfix_key_vec_shuffle(key0, shuffle[ipfix_key_has_ports(ip0)]);
+    ipfix_key_vec_store(kv[i].key, key0);
+  }
+}
+#endif
 
-    vec_add1(im->flow_records_ip6, record);
-    search.value = vec_len(im->flow_records_ip6) - 1;
+static ipfix_flow_keys_ip4_fn_t *ipfix_flow_keys_ip4 =
+  ipfix_flow_keys_ip4_scalar;
 
-    insert_packet_flow_hash_ip6(&search);
-  } else {
-    u32 record_idx = result.value;
-    ipfix_ip6_flow_value_t *record = vec_elt_at_index(im->flow_records_ip6, record_idx);
-    record->flow_end = clib_byte_swap_u64(ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
-    record->packet_delta_count = \
-      clib_byte_swap_u64(clib_byte_swap_u64(record->packet_delta_count) + 1);
-    record->octet_delta_count = record->octet_delta_count +\
-      ((u64) packet->payload_length << 48);
+static clib_error_t * ipfix_flow_keys_init(vlib_main_t * vm) {
+#if defined (__x86_64__)
+  if (clib_cpu_supports_ssse3()) {
+    ipfix_flow_keys_ip4 = ipfix_flow_keys_ip4_shuffle;
   }
+#elif defined (__aarch64__)
+  ipfix_flow_keys_ip4 = ipfix_flow_keys_ip4_shuffle;
+#endif
+  return 0;
 }
 
-always_inline uword
-ipfix_meter_fn_inline (vlib_main_t * vm,
-                       vlib_node_runtime_t * node,
-                       vlib_frame_t * frame,
-                       u8 is_ipv6)
-{
-  u32 n_left_from, * from, * to_next;
-  ipfix_next_t next_index;
-  ipfix_main_t * im = &ipfix_main;
+VLIB_INIT_FUNCTION (ipfix_flow_keys_init);
 
-  from = vlib_frame_vector_args (frame);
-  n_left_from = frame->n_vectors;
-  next_index = node->cached_next_index;
+/* Writes the whole key, a word at a time, so the kv needs no clearing */
+static_always_inline void ipfix_fill_flow_key_ip6(ipfix_ip6_flow_key_t *flow_key,
+                                                  ip6_header_t *packet,
+                                                  u8 protocol, u32 ports) {
+  flow_key->as_u64[0] = packet->src_address.as_u64[0];
+  flow_key->as_u64[1] = packet->src_address.as_u64[1];
+  flow_key->as_u64[2] = packet->dst_address.as_u64[0];
+  flow_key->as_u64[3] = packet->dst_address.as_u64[1];
 
-  while (n_left_from > 0)
-    {
-      u32 n_left_to_next;
+  flow_key->as_u64[4] = 0;
+  clib_mem_unaligned(&flow_key->src_port, u32) = ports;
+  flow_key->protocol = protocol;
+}
 
-      vlib_get_next_frame (vm, node, next_index,
-                           to_next, n_left_to_next);
+/* Only for packets without extension headers, see ipfix_ip6_is_slow */
+static_always_inline void create_flow_key_ip6(ipfix_ip6_flow_key_t *flow_key,
+                                              ip6_header_t *packet) {
+  u32 ports = 0;
 
-      while (n_left_from >= 4 && n_left_to_next >= 2)
-        {
-          u32 next0 = IPFIX_NEXT_INTERFACE_OUTPUT;
-          u32 next1 = IPFIX_NEXT_INTERFACE_OUTPUT;
-          u32 sw_if_index0, sw_if_index1;
-          ip4_header_t *ip4_0, *ip4_1;
-          ip6_header_t *ip6_0, *ip6_1;
-          u32 bi0, bi1;
-          vlib_buffer_t * b0, * b1;
+  /* UDP and TCP headers both start with the two ports */
+  if (packet->protocol == UDP_PROTOCOL || packet->protocol == TCP_PROTOCOL) {
+    ports = clib_mem_unaligned(ip6_next_header(packet), u32);
+  }
 
-          /* Prefetch next iteration. */
-          {
-            vlib_buffer_t * p2, * p3;
+  ipfix_fill_flow_key_ip6(flow_key, packet, packet->protocol, ports);
+}
 
-            p2 = vlib_get_buffer (vm, from[2]);
-            p3 = vlib_get_buffer (vm, from[3]);
+/* Options and fragments need more than the fixed header to find the
+ * ports, the meter nodes pass those packets to their slow path node */
+static_always_inline u8 ipfix_ip4_is_slow(ip4_header_t *packet) {
+  return (packet->ip_version_and_header_length != 0x45)
+    | (ip4_is_fragment(packet) != 0);
+}
 
-            vlib_prefetch_buffer_header (p2, LOAD);
-            vlib_prefetch_buffer_header (p3, LOAD);
+static_always_inline u8 ipfix_ip6_is_slow(ip6_header_t *packet) {
+  return ip6_ext_hdr(packet->protocol);
+}
 
-            CLIB_PREFETCH (p2->data, CLIB_CACHE_LINE_BYTES, STORE);
-            CLIB_PREFETCH (p3->data, CLIB_CACHE_LINE_BYTES, STORE);
-          }
+/* Fragments after the first carry no ports, the first one leaves them in
+ * a small direct mapped cache, keyed by what identifies the packet. */
+static u32 ipfix_frag_slot(u64 *id) {
+  return clib_xxhash(id[0] ^ id[1] ^ id[2] ^ id[3] ^ id[4])
+    & (IPFIX_FRAG_CACHE_SIZE - 1);
+}
 
-          /* speculatively enqueue b0 and b1 to the current next frame */
-          to_next[0] = bi0 = from[0];
-          to_next[1] = bi1 = from[1];
-          from += 2;
-          to_next += 2;
-          n_left_from -= 2;
-          n_left_to_next -= 2;
+static void ipfix_frag_remember(ipfix_per_thread_data_t *ptd, u64 *id,
+                                u32 ports, u64 now) {
+  ipfix_frag_entry_t *entry = ptd->frag_cache + ipfix_frag_slot(id);
 
-          b0 = vlib_get_buffer (vm, bi0);
-          b1 = vlib_get_buffer (vm, bi1);
+  clib_memcpy(entry->id, id, sizeof(entry->id));
+  entry->ports = ports;
+  entry->seen = now;
+}
 
-          sw_if_index0 = vnet_buffer(b0)->sw_if_index[VLIB_RX];
-          sw_if_index1 = vnet_buffer(b1)->sw_if_index[VLIB_RX];
-
-          if (is_ipv6) {
-            ip6_0 = vlib_buffer_get_current (b0);
-            ip6_1 = vlib_buffer_get_current (b1);
-            process_packet_ip6(ip6_0);
-            process_packet_ip6(ip6_1);
-          } else {
-            ip4_0 = vlib_buffer_get_current (b0);
-            ip4_1 = vlib_buffer_get_current (b1);
-            process_packet_ip4(ip4_0);
-            process_packet_ip4(ip4_1);
-          }
+/* Returns 0 if the first fragment was not seen, or too long ago */
+static int ipfix_frag_lookup(ipfix_per_thread_data_t *ptd, u64 *id,
+                             u64 now, u32 *ports) {
+  ipfix_frag_entry_t *entry = ptd->frag_cache + ipfix_frag_slot(id);
 
-          if (PREDICT_FALSE((node->flags & VLIB_NODE_FLAG_TRACE)))
-            {
-              if (b0->flags & VLIB_BUFFER_IS_TRACED)
-                {
-                    ipfix_trace_t *t =
-                      vlib_add_trace (vm, node, b0, sizeof (*t));
-                    t->sw_if_index = sw_if_index0;
-                    t->next_index = next0;
-                    t->flow_hash = im->flow_hash_ip4;
-                    if (t->flow_records) {
-                      vec_free(t->flow_records);
-                    }
-                    t->flow_records = vec_dup(im->flow_records_ip4);
-                  }
-                if (b1->flags & VLIB_BUFFER_IS_TRACED)
-                  {
-                    ipfix_trace_t *t =
-                      vlib_add_trace (vm, node, b1, sizeof (*t));
-                    t->sw_if_index = sw_if_index1;
-                    t->next_index = next1;
-                    t->flow_hash = im->flow_hash_ip4;
-                    if (t->flow_records) {
-                      vec_free(t->flow_records);
-                    }
-                    t->flow_records = vec_dup(im->flow_records_ip4);
-                  }
-              }
+  if (memcmp(entry->id, id, sizeof(entry->id))
+      || (u32) ((u32) now - entry->seen) > IPFIX_FRAG_LIFETIME) {
+    return 0;
+  }
+  *ports = entry->ports;
+  return 1;
+}
 
-            /* verify speculative enqueues, maybe switch current next frame */
-            vlib_validate_buffer_enqueue_x2 (vm, node, next_index,
-                                             to_next, n_left_to_next,
-                                             bi0, bi1, next0, next1);
-        }
+/* Any IPv4 packet, including options and fragments.
+ * Returns 0 if the packet is a fragment whose ports are unknown. */
+static int create_flow_key_ip4_slow(ipfix_per_thread_data_t *ptd,
+                                    ipfix_ip4_flow_key_t *flow_key,
+                                    ip4_header_t *packet, u64 now) {
+  u64 id[5] = { 0 };
+  u32 ports = 0;
+  int found = 1;
+
+  create_flow_key_ip4_scalar(flow_key, packet);
+
+  if (!ip4_is_fragment(packet)
+      || (packet->protocol != TCP_PROTOCOL
+          && packet->protocol != UDP_PROTOCOL)) {
+    return 1;
+  }
 
-      while (n_left_from > 0 && n_left_to_next > 0)
-        {
-          u32 bi0;
-          vlib_buffer_t * b0;
-          u32 next0 = IPFIX_NEXT_INTERFACE_OUTPUT;
-          u32 sw_if_index0;
-          ip4_header_t *ip4_0;
-          ip6_header_t *ip6_0;
+  id[0] = clib_mem_unaligned(&packet->src_address, u64);
+  id[1] = packet->fragment_id | (packet->protocol << 16) | (4 << 24);
 
-          /* speculatively enqueue b0 to the current next frame */
-          bi0 = from[0];
-          to_next[0] = bi0;
-          from += 1;
-          to_next += 1;
-          n_left_from -= 1;
-          n_left_to_next -= 1;
+  if (ip4_is_first_fragment(packet)) {
+    ipfix_frag_remember(ptd, id, clib_mem_unaligned(&flow_key->src_port, u32),
+                        now);
+  } else {
+    found = ipfix_frag_lookup(ptd, id, now, &ports);
+    clib_mem_unaligned(&flow_key->src_port, u32) = ports;
+  }
 
-          b0 = vlib_get_buffer (vm, bi0);
-          sw_if_index0 = vnet_buffer(b0)->sw_if_index[VLIB_RX];
-
-          if (is_ipv6) {
-            ip6_0 = vlib_buffer_get_current (b0);
-            process_packet_ip6(ip6_0);
-          } else {
-            ip4_0 = vlib_buffer_get_current (b0);
-            process_packet_ip4(ip4_0);
-          }
+  return found;
+}
 
-          if (PREDICT_FALSE((node->flags & VLIB_NODE_FLAG_TRACE)
-                            && (b0->flags & VLIB_BUFFER_IS_TRACED))) {
-            ipfix_trace_t *t =
-               vlib_add_trace (vm, node, b0, sizeof (*t));
-            t->sw_if_index = sw_if_index0;
-            t->next_index = next0;
-            t->flow_hash = im->flow_hash_ip4;
-            if (t->flow_records) {
-              vec_free(t->flow_records);
-            }
-            t->flow_records = vec_dup(im->flow_records_ip4);
-          }
+/* Any IPv6 packet: walks the extension headers, within the buffer, to
+ * the upper layer protocol.
+ * Returns 0 if the packet is a fragment whose ports are unknown. */
+static int create_flow_key_ip6_slow(ipfix_per_thread_data_t *ptd,
+                                    ipfix_ip6_flow_key_t *flow_key,
+                                    vlib_buffer_t *b, ip6_header_t *packet,
+                                    u64 now) {
+  u8 *next = (u8 *)(packet + 1);
+  u8 *end = (u8 *) vlib_buffer_get_current(b) + b->current_length;
+  ip6_frag_hdr_t *frag = 0;
+  u8 protocol = packet->protocol;
+  u64 id[5];
+  u32 ports = 0, n;
+  int found = 1;
+
+  for (n = 0; n < IPFIX_IP6_MAX_EXT_HEADERS && ip6_ext_hdr(protocol)
+         && protocol != IP_PROTOCOL_IP6_NONXT && next + 8 <= end; n++) {
+    ip6_ext_header_t *ext = (ip6_ext_header_t *) next;
+
+    if (protocol == IP_PROTOCOL_IPV6_FRAGMENTATION) {
+      frag = (ip6_frag_hdr_t *) next;
+      next += sizeof(ip6_frag_hdr_t);
+    } else if (protocol == IP_PROTOCOL_IPSEC_AH) {
+      /* AH counts its length in 4 octet units */
+      next += (ext->n_data_u64s + 2) << 2;
+    } else {
+      next += ip6_ext_header_len(ext);
+    }
+    protocol = ext->next_hdr;
+  }
 
-          /* verify speculative enqueue, maybe switch current next frame */
-          vlib_validate_buffer_enqueue_x1 (vm, node, next_index,
-                                           to_next, n_left_to_next,
-                                           bi0, next0);
-        }
+  if ((protocol == TCP_PROTOCOL || protocol == UDP_PROTOCOL)
+      && (!frag || ip6_frag_hdr_offset(frag) == 0) && next + 4 <= end) {
+    ports = clib_mem_unaligned(next, u32);
+  }
 
-      vlib_put_next_frame (vm, node, next_index, n_left_to_next);
+  if (frag && (protocol == TCP_PROTOCOL || protocol == UDP_PROTOCOL)) {
+    id[0] = packet->src_address.as_u64[0];
+    id[1] = packet->src_address.as_u64[1];
+    id[2] = packet->dst_address.as_u64[0];
+    id[3] = packet->dst_address.as_u64[1];
+    id[4] = frag->identification | ((u64) protocol << 32) | (6ULL << 40);
+
+    if (ip6_frag_hdr_offset(frag) == 0) {
+      ipfix_frag_remember(ptd, id, ports, now);
+    } else {
+      found = ipfix_frag_lookup(ptd, id, now, &ports);
     }
+  }
 
-  return frame->n_vectors;
+  ipfix_fill_flow_key_ip6(flow_key, packet, protocol, ports);
+  return found;
 }
 
-static void ipfix_free_v10_packet(netflow_v10_data_packet_t *packet)
-{
-  netflow_v10_data_set_t *set;
-  vec_foreach(set, packet->sets) {
-    clib_mem_free(set->data);
-  };
-  vec_free(packet->sets);
+/* Convert a timeout in milliseconds to a timer wheel interval */
+static u32 ipfix_timer_ticks(u64 timeout) {
+  u64 ticks = (timeout + 999) / 1000;
+
+  return clib_max(1, clib_min(ticks, IPFIX_TIMER_MAX_TICKS));
 }
 
-/* the first argument is either an ipv4 or ipv6 flow record */
-static void ipfix_build_v10_packet(void *record,
-                                   netflow_v10_data_packet_t *packet,
-                                   u8 is_ipv6)
-{
-  u64 byte_length = sizeof(netflow_v10_header_t);
+/* Arm the expiry timer of a record for its next deadline: whichever of the
+ * idle and active timeouts comes first. */
+static u32 ipfix_arm_timer(ipfix_per_thread_data_t *ptd, u32 record_idx,
+                           u32 timer_id, u64 start, u64 end,
+                           u64 current_time) {
   ipfix_main_t * im = &ipfix_main;
+  u64 deadline = clib_min(end + im->idle_flow_timeout,
+                          start + im->active_flow_timeout);
+  u64 timeout = deadline > current_time ? deadline - current_time : 0;
 
-  if (is_ipv6) {
-    packet->template = im->template_ip6;
-  } else {
-    packet->template = im->template_ip4;
-  }
-  
-  struct timespec current_time_clock;
-  clock_gettime(CLOCK_REALTIME, &current_time_clock);
-
-
-  packet->sets = 0;
-  packet->header.version = ntohs(10);
-  packet->header.timestamp = ntohs(current_time_clock.tv_sec);
-  packet->header.observation_domain = clib_byte_swap_u32(im->observation_domain);
-  /* FIXME: the sequence number is incremented by 1 each time because
-   * for now each packet only has a single record, but in general we
-   * will have multiple records
-   */
-  im->sequence_number += 1;
-  packet->header.sequence_number = clib_byte_swap_u32(im->sequence_number);
-  /* set length field in header at end */
-
-  netflow_v10_template_set_t *set;
-  netflow_v10_field_specifier_t *field;
-  vec_foreach(set, packet->template->sets) {
-    u64 data_size = 0;
-    u64 set_length;
-    vec_foreach(field, set->fields) {
-      data_size = data_size + field->size;
-    }
-    set_length = data_size + sizeof(netflow_v10_set_header_t);
-    byte_length += set_length;
+  return tw_timer_start_2t_1w_2048sl(&ptd->timer_wheel, record_idx,
+                                     timer_id, ipfix_timer_ticks(timeout));
+}
 
-    netflow_v10_data_set_t active_set;
-    active_set.header.id = clib_byte_swap_u16(set->id);
-    active_set.header.length = clib_byte_swap_u16(set_length);
-    active_set.data = clib_mem_alloc(data_size);
-    void *ptr = active_set.data;
-    vec_foreach(field, set->fields) {
-      memcpy(ptr, (void *)((size_t)record + field->record_offset), field->size);
+/* Aggregated flows are keyed on the masked key only */
+static_always_inline void ipfix_mask_key_ip4(clib_bihash_kv_16_8_t *kv) {
+  ipfix_main_t * im = &ipfix_main;
 
-      // Advance the pointer to the next field.
-      ptr = (void *)((size_t)ptr + field->size);
-    };
+  kv->key[0] &= im->key_mask_ip4[0];
+  kv->key[1] &= im->key_mask_ip4[1];
+}
 
-    vec_add1(packet->sets, active_set);
-  };
+static_always_inline void ipfix_mask_key_ip6(clib_bihash_kv_40_8_t *kv) {
+  ipfix_main_t * im = &ipfix_main;
 
-  packet->header.byte_length = ntohs(byte_length);
+  kv->key[0] &= im->key_mask_ip6[0];
+  kv->key[1] &= im->key_mask_ip6[1];
+  kv->key[2] &= im->key_mask_ip6[2];
+  kv->key[3] &= im->key_mask_ip6[3];
+  kv->key[4] &= im->key_mask_ip6[4];
 }
 
-/* Write a template set to the given buffer (which must have enough
- * space allocated) for an IPFIX packet
- *
- * Returns the number of bytes written to buffer
- */
-static u64 ipfix_write_template_set(u16 *buffer,
-                                    netflow_v10_template_t *template) {
-  u64 octets;
-  u64 set_idx;
-  u16 *template_header, *ptr;
-  netflow_v10_template_set_t *template_set;
-  netflow_v10_field_specifier_t *field_spec;
-
-  /* advance pointer past header, write header at end of function */
-  template_header = buffer;
-  ptr = template_header + 2;
-  octets = 4;
+/* Biflows are keyed the same both ways: order the key so that the lower
+ * address, or with equal addresses the lower port, is its src.
+ * Returns 1 if the key was swapped around. */
+static_always_inline u8 ipfix_order_key_ip4(ipfix_ip4_flow_key_t *flow_key) {
+  ip4_address_t addr;
+  u16 port;
+
+  if (PREDICT_TRUE(flow_key->src.as_u32 < flow_key->dst.as_u32
+                   || (flow_key->src.as_u32 == flow_key->dst.as_u32
+                       && flow_key->src_port <= flow_key->dst_port))) {
+    return 0;
+  }
 
-  vec_foreach_index(set_idx, template->sets) {
-    template_set = vec_elt_at_index(template->sets, set_idx);
+  addr = flow_key->src;
+  flow_key->src = flow_key->dst;
+  flow_key->dst = addr;
+  port = flow_key->src_port;
+  flow_key->src_port = flow_key->dst_port;
+  flow_key->dst_port = port;
+  return 1;
+}
 
-    *ptr = clib_byte_swap_u16(template_set->id);
-    *(ptr + 1) = clib_byte_swap_u16(vec_len(template_set->fields));
-    ptr += 2;
-    octets += 4;
+static_always_inline u8 ipfix_order_key_ip6(ipfix_ip6_flow_key_t *flow_key) {
+  ip6_address_t addr;
+  u16 port;
+  int cmp = memcmp(&flow_key->src, &flow_key->dst, sizeof(ip6_address_t));
 
-    vec_foreach(field_spec, template_set->fields) {
-      *ptr = clib_byte_swap_u16(field_spec->identifier);
-      *(ptr + 1) = clib_byte_swap_u16(field_spec->size);
-      ptr += 2;
-      octets += 4;
-    };
+  if (PREDICT_TRUE(cmp < 0 || (cmp == 0
+                               && flow_key->src_port <= flow_key->dst_port))) {
+    return 0;
   }
 
-  /* write set header */
-  *template_header = clib_byte_swap_u16(2);
-  *(template_header + 1) = clib_byte_swap_u16(octets);
-
-  return octets;
+  addr = flow_key->src;
+  flow_key->src = flow_key->dst;
+  flow_key->dst = addr;
+  port = flow_key->src_port;
+  flow_key->src_port = flow_key->dst_port;
+  flow_key->dst_port = port;
+  return 1;
 }
 
-/* Write all relevant templates into an IPFIX packet, the given buffer must
- * have enough space allocated. Returns the length of the payload. */
-static u64 ipfix_write_template_packet(u8* buffer) {
-  ipfix_main_t * im = &ipfix_main;
-  u64 octets = 0;
-  netflow_v10_header_t *ipfix_header = (netflow_v10_header_t*) buffer;
-  u8* template_ptr = buffer + sizeof(netflow_v10_header_t);
+/* The counters a packet goes to, from the bihash value of its flow and
+ * whether its key was swapped around: a packet whose key was ordered the
+ * other way from the initiator's comes from the responder. */
+static_always_inline ipfix_flow_counters_t *
+ipfix_packet_counters_ip4(ipfix_per_thread_data_t *ptd, u64 value,
+                          u8 reversed) {
+  u32 idx = ipfix_value_index(value);
+
+  if (PREDICT_FALSE(ipfix_main.biflow
+                    && reversed != ((value & IPFIX_VALUE_REVERSED) != 0))) {
+    return vec_elt_at_index(ptd->reverse_counters_ip4, idx);
+  }
+  return vec_elt_at_index(ptd->flow_counters_ip4, idx);
+}
 
-  struct timespec current_time_clock;
-  clock_gettime(CLOCK_REALTIME, &current_time_clock);
+static_always_inline ipfix_flow_counters_t *
+ipfix_packet_counters_ip6(ipfix_per_thread_data_t *ptd, u64 value,
+                          u8 reversed) {
+  u32 idx = ipfix_value_index(value);
 
-  octets += ipfix_write_template_set((u16*)template_ptr, im->template_ip4);
-  octets += ipfix_write_template_set((u16*)(template_ptr + octets), im->template_ip6);
+  if (PREDICT_FALSE(ipfix_main.biflow
+                    && reversed != ((value & IPFIX_VALUE_REVERSED) != 0))) {
+    return vec_elt_at_index(ptd->reverse_counters_ip6, idx);
+  }
+  return vec_elt_at_index(ptd->flow_counters_ip6, idx);
+}
 
-  /* write IPFIX header */
-  octets += sizeof(netflow_v10_header_t);
-  ipfix_header->version = clib_byte_swap_u16(10);
-  ipfix_header->byte_length = clib_byte_swap_u16(octets);
-  ipfix_header->timestamp = clib_byte_swap_u32(current_time_clock.tv_sec);
-  ipfix_header->sequence_number = clib_byte_swap_u32(im->sequence_number);
-  ipfix_header->observation_domain = clib_byte_swap_u32(im->observation_domain);
+/* The flow cache slot of a hash */
+#define ipfix_flow_cache_slot(hash) ((hash) & (IPFIX_FLOW_CACHE_SIZE - 1))
 
-  return octets;
+static_always_inline int
+ipfix_flow_key_equal_ip4(clib_bihash_kv_16_8_t *entry,
+                         clib_bihash_kv_16_8_t *kv) {
+  return ((entry->key[0] ^ kv->key[0]) | (entry->key[1] ^ kv->key[1])) == 0;
 }
 
-/* Writes `packet` to `buffer`. The buffer MUST have enough space allocated to fit the entire
- * packet.
- *
- * Returns number of bytes written to buffer.
- */
-static u64 ipfix_write_v10_data_packet(void *buffer, netflow_v10_data_packet_t *packet)
-{
-  netflow_v10_data_set_t *data_set;
-  u64 written = 0;
-  void *ptr = buffer;
-
-  memcpy(ptr, &packet->header, sizeof(netflow_v10_header_t));
-  ptr = (void*)((size_t)ptr + sizeof(netflow_v10_header_t));
-  written += (u64)sizeof(netflow_v10_header_t);
-
-  vec_foreach(data_set, packet->sets) {
-    // Calculate the length of the set.
-    size_t header_length = sizeof(netflow_v10_set_header_t);
-    size_t data_length = clib_byte_swap_u16(data_set->header.length)\
-      - header_length;
-
-    // Should be able to just memcopy the entire set, data 'n all.
-    memcpy(ptr, &data_set->header, header_length);
-    memcpy(ptr + header_length, data_set->data, data_length);
-    written = written + (u64)header_length + (u64)data_length;
-
-    // Advance the pointer past the set.
-    ptr = (void *)((size_t)ptr + header_length + data_length);
-  };
-
-  return written;
+static_always_inline int
+ipfix_flow_key_equal_ip6(clib_bihash_kv_40_8_t *entry,
+                         clib_bihash_kv_40_8_t *kv) {
+  return ((entry->key[0] ^ kv->key[0]) | (entry->key[1] ^ kv->key[1])
+          | (entry->key[2] ^ kv->key[2]) | (entry->key[3] ^ kv->key[3])
+          | (entry->key[4] ^ kv->key[4])) == 0;
 }
 
-/* Send an IPFIX packet based on the given data records or send a template packet
- * if is_template is 1
- * FIXME: this interface is kind of awkward
- */
-static void ipfix_send_packet(vlib_main_t * vm, u8 is_template, netflow_v10_data_packet_t *packet)
-{
+/* The bihash value of the flow a packet was marked for by the NIC, or
+ * ~0 if it was not marked by one of our rules */
+static_always_inline u64 ipfix_offload_value(vlib_buffer_t *b, u8 is_ipv6) {
   ipfix_main_t * im = &ipfix_main;
-  vlib_frame_t * nf;
-  vlib_node_t * next_node;
-  u32 * to_next;
-  vlib_buffer_t * b0;
-  ip4_header_t * ip0;
-  udp_header_t * udp0;
-  u32 * buffers = NULL;
-  int num_buffers;
-  void * payload;
-  int payload_length;
+  u32 index = b->flow_id - IPFIX_OFFLOAD_MARK_BASE;
+  ipfix_offload_t *offload;
 
-  /* FIXME: why would the next node be ip4-lookup? */
-  next_node = vlib_get_node_by_name(vm, (u8 *) "ip4-lookup");
-  nf = vlib_get_frame_to_node(vm, next_node->index);
-  nf->n_vectors = 1;
-  to_next = vlib_frame_vector_args(nf);
-
-  /* FIXME: how much buffer does this allocate? */
-  /* allocate a buffer, get the index for it into buffers */
-  vec_validate(buffers, 0);
-  num_buffers = vlib_buffer_alloc(vm, buffers, vec_len(buffers));
+  if (PREDICT_TRUE(b->flow_id < IPFIX_OFFLOAD_MARK_BASE)
+      || index >= vec_len(im->offloads)
+      || pool_is_free_index(im->offloads, index)) {
+    return ~0ULL;
+  }
 
-  if (num_buffers != 1) {
-    clib_warning("Wrong number of buffers allocated %d", num_buffers);
+  /* flow rules go with an rx queue, which stays with a thread */
+  offload = pool_elt_at_index(im->offloads, index);
+  if (offload->is_ipv6 != is_ipv6
+      || offload->thread_index != vlib_get_thread_index()) {
+    return ~0ULL;
   }
+  return offload->record_value;
+}
 
-  /* get the actual buffer pointer from our buffer index */
-  b0 = vlib_get_buffer(vm, buffers[0]);
+/* Remember a record that just crossed the offload threshold */
+static void ipfix_offload_candidate(vlib_main_t * vm,
+                                    ipfix_per_thread_data_t *ptd,
+                                    u32 bi, u64 value, u8 is_ipv6) {
+  vlib_buffer_t *b0 = vlib_get_buffer (vm, bi);
+  ipfix_offload_candidate_t *candidate;
 
-  b0->current_data = 0;
-  b0->flags |= VLIB_BUFFER_TOTAL_LENGTH_VALID;
+  if (vec_len(ptd->offload_candidates) >= ipfix_main.max_offloads) {
+    return;
+  }
+  vec_add2(ptd->offload_candidates, candidate, 1);
+  candidate->record_idx = ipfix_value_index(value);
+  candidate->sw_if_index = vnet_buffer(b0)->sw_if_index[VLIB_RX];
+  candidate->is_ipv6 = is_ipv6;
+}
 
-  /* VPP generates this buffer so we have to set this flag apparently?
-   * https://www.mail-archive.com/vpp-dev@lists.fd.io/msg02656.html */
-  b0->flags |= VNET_BUFFER_F_LOCALLY_ORIGINATED;
-
-  ip0 = (ip4_header_t*) b0->data;
-  ip0->ip_version_and_header_length = 0x45;
-  ip0->tos = 0;
-  ip0->fragment_id = 0;
-  ip0->flags_and_fragment_offset = 0;
-  ip0->ttl = 64;
-  ip0->protocol = 17;
-
-  clib_memcpy(&ip0->src_address.data, &im->exporter_ip.data, sizeof(ip4_address_t));
-  clib_memcpy(&ip0->dst_address.data, &im->collector_ip.data, sizeof(ip4_address_t));
-
-  udp0 = (udp_header_t*) (ip0 + 1);
-  udp0->src_port = clib_byte_swap_u16(im->exporter_port);
-  udp0->dst_port = clib_byte_swap_u16(im->collector_port);
-  udp0->checksum = 0;
-
-  payload = (void*) (udp0 + 1);
-  if (is_template) {
-    payload_length = ipfix_write_template_packet(payload);
-  } else {
-    payload_length = ipfix_write_v10_data_packet(payload, packet);
+/* Make the record a candidate if the last `n_packets`, counted in
+ * `counters` already, took it to the offload threshold. A record created
+ * by the packet is one with a single packet. */
+static_always_inline void
+ipfix_offload_check(vlib_main_t * vm, ipfix_per_thread_data_t *ptd,
+                    ipfix_flow_counters_t *counters, u32 n_packets,
+                    u32 bi, u64 value, u8 is_ipv6) {
+  u32 threshold = ipfix_main.offload_threshold;
+
+  /* 0 turns offloading off */
+  if (PREDICT_FALSE(threshold != 0
+                    && counters->packet_delta_count >= threshold
+                    && counters->packet_delta_count - n_packets
+                    < threshold)) {
+    ipfix_offload_candidate(vm, ptd, bi, value, is_ipv6);
+  }
+}
+
+/* Add a new record for the flow in `kv`, store its pool index in the
+ * bihash and arm its expiry timer. `reversed` tells a biflow whose first
+ * packet had its key swapped around, its sender is the initiator.
+ *
+ * Returns 0, with no record added, if the bihash add failed. */
+static int create_record_ip4(ipfix_per_thread_data_t *ptd,
+                              clib_bihash_kv_16_8_t *kv, u32 length,
+                              u64 now, u8 reversed) {
+  ipfix_ip4_flow_record_t *record;
+  ipfix_flow_counters_t *counters;
+  u32 idx;
+
+  pool_get(ptd->flow_records_ip4, record);
+  memcpy(&record->flow_key, &kv->key, sizeof(ipfix_ip4_flow_key_t));
+  record->flow_start = now;
+  record->offload_index = ~0;
+  record->initiator_reversed = reversed;
+
+  /* pool indices are stable across deletes, safe to keep in the hash */
+  idx = record - ptd->flow_records_ip4;
+  kv->value = idx | (reversed ? IPFIX_VALUE_REVERSED : 0);
+  record->timer_handle =
+    ipfix_arm_timer(ptd, idx, IPFIX_TIMER_IP4, now, now, now);
+
+  vec_validate_aligned(ptd->flow_counters_ip4, idx, CLIB_CACHE_LINE_BYTES);
+  counters = vec_elt_at_index(ptd->flow_counters_ip4, idx);
+  counters->flow_end = now;
+  counters->packet_delta_count = 1;
+  counters->octet_delta_count = length;
+
+  if (PREDICT_FALSE(ipfix_main.biflow)) {
+    vec_validate_aligned(ptd->reverse_counters_ip4, idx,
+                         CLIB_CACHE_LINE_BYTES);
+    counters = vec_elt_at_index(ptd->reverse_counters_ip4, idx);
+    counters->flow_end = now;
+    counters->packet_delta_count = 0;
+    counters->octet_delta_count = 0;
   }
 
-  /* set all lengths at once */
-  b0->current_length = sizeof(ip4_header_t) + sizeof(udp_header_t) + payload_length;
-  ip0->length = clib_byte_swap_u16(20 + 8 + payload_length);
-  udp0->length = clib_byte_swap_u16(8 + payload_length);
+  if (PREDICT_FALSE(insert_packet_flow_hash_ip4(ptd, kv) != 0)) {
+    tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record->timer_handle);
+    pool_put(ptd->flow_records_ip4, record);
+    ipfix_count(ptd, IPFIX_COUNTER_HASH_ADD_FAILED, 1);
+    return 0;
+  }
+  ipfix_count(ptd, IPFIX_COUNTER_FLOWS_CREATED, 1);
+  return 1;
+}
 
-  /* finally checksum at very end */
-  ip0->checksum = ip4_header_checksum(ip0);
+static int create_record_ip6(ipfix_per_thread_data_t *ptd,
+                              clib_bihash_kv_40_8_t *kv, u32 length,
+                              u64 now, u8 reversed) {
+  ipfix_ip6_flow_record_t *record;
+  ipfix_flow_counters_t *counters;
+  u32 idx;
+
+  pool_get(ptd->flow_records_ip6, record);
+  memcpy(&record->flow_key, &kv->key, sizeof(ipfix_ip6_flow_key_t));
+  record->flow_start = now;
+  record->offload_index = ~0;
+  record->initiator_reversed = reversed;
+
+  idx = record - ptd->flow_records_ip6;
+  kv->value = idx | (reversed ? IPFIX_VALUE_REVERSED : 0);
+  record->timer_handle =
+    ipfix_arm_timer(ptd, idx, IPFIX_TIMER_IP6, now, now, now);
+
+  vec_validate_aligned(ptd->flow_counters_ip6, idx, CLIB_CACHE_LINE_BYTES);
+  counters = vec_elt_at_index(ptd->flow_counters_ip6, idx);
+  counters->flow_end = now;
+  counters->packet_delta_count = 1;
+  counters->octet_delta_count = length;
+
+  if (PREDICT_FALSE(ipfix_main.biflow)) {
+    vec_validate_aligned(ptd->reverse_counters_ip6, idx,
+                         CLIB_CACHE_LINE_BYTES);
+    counters = vec_elt_at_index(ptd->reverse_counters_ip6, idx);
+    counters->flow_end = now;
+    counters->packet_delta_count = 0;
+    counters->octet_delta_count = 0;
+  }
 
-  /* set to_next index to the buffer index we allocated */
-  *to_next = buffers[0];
-  to_next++;
+  if (PREDICT_FALSE(insert_packet_flow_hash_ip6(ptd, kv) != 0)) {
+    tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record->timer_handle);
+    pool_put(ptd->flow_records_ip6, record);
+    ipfix_count(ptd, IPFIX_COUNTER_HASH_ADD_FAILED, 1);
+    return 0;
+  }
+  ipfix_count(ptd, IPFIX_COUNTER_FLOWS_CREATED, 1);
+  return 1;
+}
 
-  vlib_put_frame_to_node(vm, next_node->index, nf);
+/* The only record memory a packet of a known flow touches */
+static void update_record(ipfix_flow_counters_t *counters, u32 n_packets,
+                          u64 octets, u64 now) {
+  counters->flow_end = now;
+  counters->packet_delta_count += n_packets;
+  counters->octet_delta_count += octets;
 }
 
-static void ipfix_expire_records(u64 current_time) {
-  ipfix_ip4_flow_value_t *record_ip4;
-  ipfix_ip6_flow_value_t *record_ip6;
-  u64 record_idx;
-  u64 start, end;
-  clib_bihash_kv_16_8_t keyvalue_ip4;
-  clib_bihash_kv_48_8_t keyvalue_ip6;
+/* Queue the record for export to `records`, with its timestamps moved from
+ * vlib time to wall clock time */
+static void ipfix_export_record_ip4(ipfix_per_thread_data_t *ptd,
+                                    u32 record_idx,
+                                    ipfix_ip4_flow_value_t **records) {
   ipfix_main_t * im = &ipfix_main;
+  ipfix_ip4_flow_value_t *expired;
 
-  vec_foreach_index(record_idx, im->flow_records_ip4) {
-    record_ip4 = vec_elt_at_index(im->flow_records_ip4, record_idx);
-    start = clib_byte_swap_u64(record_ip4->flow_start);
-    end = clib_byte_swap_u64(record_ip4->flow_end);
+  vec_add2(*records, expired, 1);
+  ipfix_flow_value_ip4(ptd, record_idx, expired);
+  expired->flow_start += im->wall_clock_offset;
+  expired->flow_end += im->wall_clock_offset;
+}
 
-    if ((end + im->idle_flow_timeout) < current_time) {
-      vec_add1(im->expired_records_ip4, *record_ip4);
-      vec_del1(im->flow_records_ip4, record_idx);
+static void ipfix_export_record_ip6(ipfix_per_thread_data_t *ptd,
+                                    u32 record_idx,
+                                    ipfix_ip6_flow_value_t **records) {
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_ip6_flow_value_t *expired;
 
-      memset(&keyvalue_ip4, 0, sizeof(clib_bihash_kv_16_8_t));
-      memcpy(&keyvalue_ip4.key, &record_ip4->flow_key, sizeof(ipfix_ip4_flow_key_t));
+  vec_add2(*records, expired, 1);
+  ipfix_flow_value_ip6(ptd, record_idx, expired);
+  expired->flow_start += im->wall_clock_offset;
+  expired->flow_end += im->wall_clock_offset;
+}
 
-      if (clib_bihash_add_del_16_8(&im->flow_hash_ip4, &keyvalue_ip4, 0) != 0) {
-        clib_warning("Warning: Could not remove flow form hash.");
-      };
-    } else if ((start + im->active_flow_timeout) < current_time) {
-      vec_add1(im->expired_records_ip4, *record_ip4);
+/* Take a record out of the flow table, its timer must not be running */
+static void ipfix_delete_record_ip4(ipfix_per_thread_data_t *ptd,
+                                    ipfix_ip4_flow_record_t *record) {
+  clib_bihash_kv_16_8_t keyvalue, *cached;
 
-      record_ip4->flow_start = clib_byte_swap_u64(current_time);
-      record_ip4->flow_end = record_ip4->flow_start;
-      record_ip4->packet_delta_count = 0;
-      record_ip4->octet_delta_count = 0;
-    }
+  memset(&keyvalue, 0, sizeof(clib_bihash_kv_16_8_t));
+  memcpy(&keyvalue.key, &record->flow_key, sizeof(ipfix_ip4_flow_key_t));
+
+  if (clib_bihash_add_del_16_8(&ptd->flow_hash_ip4, &keyvalue, 0) != 0) {
+    clib_warning("Warning: Could not remove flow form hash.");
   };
 
-  vec_foreach_index(record_idx, im->flow_records_ip6) {
-    record_ip6 = vec_elt_at_index(im->flow_records_ip6, record_idx);
-    start = clib_byte_swap_u64(record_ip6->flow_start);
-    end = clib_byte_swap_u64(record_ip6->flow_end);
+  /* no packet may find the freed index in the flow cache */
+  cached = ptd->flow_cache_ip4
+    + ipfix_flow_cache_slot(clib_bihash_hash_16_8(&keyvalue));
+  if (ipfix_flow_key_equal_ip4(cached, &keyvalue)) {
+    memset(cached, 0xff, sizeof(*cached));
+  }
+
+  /* the flow rule goes on the next ipfix_sync_offloads */
+  if (PREDICT_FALSE(record->offload_index != ~0)) {
+    pool_elt_at_index(ipfix_main.offloads,
+                      record->offload_index)->record_value = ~0ULL;
+  }
 
-    if ((end + im->idle_flow_timeout) < current_time) {
-      vec_add1(im->expired_records_ip6, *record_ip6);
-      vec_del1(im->flow_records_ip6, record_idx);
+  pool_put(ptd->flow_records_ip4, record);
+}
 
-      memset(&keyvalue_ip6, 0, sizeof(clib_bihash_kv_48_8_t));
-      memcpy(&keyvalue_ip6.key, &record_ip6->flow_key, sizeof(ipfix_ip6_flow_key_t));
+static void ipfix_delete_record_ip6(ipfix_per_thread_data_t *ptd,
+                                    ipfix_ip6_flow_record_t *record) {
+  clib_bihash_kv_40_8_t keyvalue, *cached;
 
-      if (clib_bihash_add_del_48_8(&im->flow_hash_ip6, &keyvalue_ip6, 0) != 0) {
-        clib_warning("Warning: Could not remove flow form hash.");
-      };
-    } else if ((start + im->active_flow_timeout) < current_time) {
-      vec_add1(im->expired_records_ip6, *record_ip6);
+  memset(&keyvalue, 0, sizeof(clib_bihash_kv_40_8_t));
+  memcpy(&keyvalue.key, &record->flow_key, sizeof(ipfix_ip6_flow_key_t));
 
-      record_ip6->flow_start = clib_byte_swap_u64(current_time);
-      record_ip6->flow_end = record_ip6->flow_start;
-      record_ip6->packet_delta_count = 0;
-      record_ip6->octet_delta_count = 0;
-    }
+  if (clib_bihash_add_del_40_8(&ptd->flow_hash_ip6, &keyvalue, 0) != 0) {
+    clib_warning("Warning: Could not remove flow form hash.");
   };
+
+  /* no packet may find the freed index in the flow cache */
+  cached = ptd->flow_cache_ip6
+    + ipfix_flow_cache_slot(clib_bihash_hash_40_8(&keyvalue));
+  if (ipfix_flow_key_equal_ip6(cached, &keyvalue)) {
+    memset(cached, 0xff, sizeof(*cached));
+  }
+
+  /* the flow rule goes on the next ipfix_sync_offloads */
+  if (PREDICT_FALSE(record->offload_index != ~0)) {
+    pool_elt_at_index(ipfix_main.offloads,
+                      record->offload_index)->record_value = ~0ULL;
+  }
+
+  pool_put(ptd->flow_records_ip6, record);
+}
+
+/* Live flows of both address families on this thread */
+static_always_inline u32 ipfix_n_flows(ipfix_per_thread_data_t *ptd) {
+  return pool_elts(ptd->flow_records_ip4) + pool_elts(ptd->flow_records_ip6);
+}
+
+/* The counters of a record put back from a snapshot, `start` and `end`
+ * in the meter's time base */
+static void ipfix_restore_counters(ipfix_flow_counters_t *counters,
+                                   ipfix_flow_counters_t *reverse,
+                                   ipfix_flow_snapshot_t *flow,
+                                   u64 start, u64 end) {
+  counters->flow_end = end;
+  counters->packet_delta_count = flow->packet_delta_count;
+  counters->octet_delta_count = flow->octet_delta_count;
+  if (reverse) {
+    reverse->flow_end = start;
+    reverse->packet_delta_count = flow->reverse_packet_delta_count;
+    reverse->octet_delta_count = flow->reverse_octet_delta_count;
+  }
+}
+
+/* Put a flow back from a snapshot, with `now` in the meter's time base.
+ * Returns 0 if the table already has it, is full, or the add failed. */
+int ipfix_restore_record_ip4(ipfix_per_thread_data_t *ptd,
+                             ipfix_ip4_flow_snapshot_t *flow, u64 now) {
+  ipfix_main_t * im = &ipfix_main;
+  clib_bihash_kv_16_8_t kv, result;
+  ipfix_ip4_flow_record_t *record;
+  u64 start = flow->flow.flow_start - im->wall_clock_offset;
+  u64 end = flow->flow.flow_end - im->wall_clock_offset;
+  u32 idx;
+
+  memset(&kv, 0, sizeof(kv));
+  memcpy(&kv.key, &flow->flow_key, sizeof(ipfix_ip4_flow_key_t));
+  if (ipfix_n_flows(ptd) >= im->max_flows
+      || clib_bihash_search_16_8(&ptd->flow_hash_ip4, &kv, &result) == 0) {
+    return 0;
+  }
+  if (!create_record_ip4(ptd, &kv, 0, start,
+                         flow->flow.initiator_reversed)) {
+    return 0;
+  }
+
+  idx = ipfix_value_index(kv.value);
+  ipfix_restore_counters(vec_elt_at_index(ptd->flow_counters_ip4, idx),
+                         ipfix_flow_reverse_ip4(ptd, idx), &flow->flow,
+                         start, end);
+
+  /* armed as a new flow, the deadlines are those of the old one */
+  record = pool_elt_at_index(ptd->flow_records_ip4, idx);
+  tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record->timer_handle);
+  record->timer_handle =
+    ipfix_arm_timer(ptd, idx, IPFIX_TIMER_IP4, start, end, now);
+  return 1;
+}
+
+int ipfix_restore_record_ip6(ipfix_per_thread_data_t *ptd,
+                             ipfix_ip6_flow_snapshot_t *flow, u64 now) {
+  ipfix_main_t * im = &ipfix_main;
+  clib_bihash_kv_40_8_t kv, result;
+  ipfix_ip6_flow_record_t *record;
+  u64 start = flow->flow.flow_start - im->wall_clock_offset;
+  u64 end = flow->flow.flow_end - im->wall_clock_offset;
+  u32 idx;
+
+  memset(&kv, 0, sizeof(kv));
+  memcpy(&kv.key, &flow->flow_key, sizeof(ipfix_ip6_flow_key_t));
+  if (ipfix_n_flows(ptd) >= im->max_flows
+      || clib_bihash_search_40_8(&ptd->flow_hash_ip6, &kv, &result) == 0) {
+    return 0;
+  }
+  if (!create_record_ip6(ptd, &kv, 0, start,
+                         flow->flow.initiator_reversed)) {
+    return 0;
+  }
+
+  idx = ipfix_value_index(kv.value);
+  ipfix_restore_counters(vec_elt_at_index(ptd->flow_counters_ip6, idx),
+                         ipfix_flow_reverse_ip6(ptd, idx), &flow->flow,
+                         start, end);
+
+  record = pool_elt_at_index(ptd->flow_records_ip6, idx);
+  tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record->timer_handle);
+  record->timer_handle =
+    ipfix_arm_timer(ptd, idx, IPFIX_TIMER_IP6, start, end, now);
+  return 1;
+}
+
+/* How many records are looked at to pick one to evict */
+#define IPFIX_EVICTION_SAMPLES 5
+
+/* Evict the least recently seen of a few records drawn at random, close
+ * enough to LRU without keeping a list up to date on every packet.
+ * Returns 0 if there was nothing to evict. */
+static int ipfix_evict_record_ip4(ipfix_per_thread_data_t *ptd) {
+  ipfix_ip4_flow_record_t *record;
+  u32 n_slots = vec_len(ptd->flow_records_ip4);
+  u32 idx, victim = ~0, n_samples = 0, tries;
+  u64 end, oldest = ~0ULL;
+
+  for (tries = 0; n_slots && n_samples < IPFIX_EVICTION_SAMPLES
+         && tries < 4 * IPFIX_EVICTION_SAMPLES; tries++) {
+    idx = random_u32(&ptd->random_seed) % n_slots;
+    if (pool_is_free_index(ptd->flow_records_ip4, idx)) {
+      continue;
+    }
+    n_samples++;
+    end = ipfix_flow_last_seen(ptd->flow_records_ip4[idx].flow_start,
+                               &ptd->flow_counters_ip4[idx],
+                               ipfix_flow_reverse_ip4(ptd, idx));
+    if (end < oldest) {
+      oldest = end;
+      victim = idx;
+    }
+  }
+
+  if (victim == ~0) {
+    return 0;
+  }
+
+  record = pool_elt_at_index(ptd->flow_records_ip4, victim);
+  tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record->timer_handle);
+  ipfix_export_record_ip4(ptd, victim, &ptd->evicted_records_ip4);
+  ipfix_delete_record_ip4(ptd, record);
+  ipfix_count(ptd, IPFIX_COUNTER_FLOWS_EVICTED, 1);
+  return 1;
+}
+
+static int ipfix_evict_record_ip6(ipfix_per_thread_data_t *ptd) {
+  ipfix_ip6_flow_record_t *record;
+  u32 n_slots = vec_len(ptd->flow_records_ip6);
+  u32 idx, victim = ~0, n_samples = 0, tries;
+  u64 end, oldest = ~0ULL;
+
+  for (tries = 0; n_slots && n_samples < IPFIX_EVICTION_SAMPLES
+         && tries < 4 * IPFIX_EVICTION_SAMPLES; tries++) {
+    idx = random_u32(&ptd->random_seed) % n_slots;
+    if (pool_is_free_index(ptd->flow_records_ip6, idx)) {
+      continue;
+    }
+    n_samples++;
+    end = ipfix_flow_last_seen(ptd->flow_records_ip6[idx].flow_start,
+                               &ptd->flow_counters_ip6[idx],
+                               ipfix_flow_reverse_ip6(ptd, idx));
+    if (end < oldest) {
+      oldest = end;
+      victim = idx;
+    }
+  }
+
+  if (victim == ~0) {
+    return 0;
+  }
+
+  record = pool_elt_at_index(ptd->flow_records_ip6, victim);
+  tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record->timer_handle);
+  ipfix_export_record_ip6(ptd, victim, &ptd->evicted_records_ip6);
+  ipfix_delete_record_ip6(ptd, record);
+  ipfix_count(ptd, IPFIX_COUNTER_FLOWS_EVICTED, 1);
+  return 1;
+}
+
+/* Make room for one more flow of the given family, evicting from that
+ * family first. The evicted records are exported like expired ones, but
+ * once too many wait for the process node the new flow is not metered
+ * instead, so a flood cannot grow memory that way either.
+ *
+ * Returns 1 if there is room. */
+static int ipfix_make_room(ipfix_per_thread_data_t *ptd, u8 is_ipv6) {
+  if (vec_len(ptd->evicted_records_ip4) + vec_len(ptd->evicted_records_ip6)
+      >= IPFIX_MAX_EVICTED_RECORDS) {
+    return 0;
+  }
+
+  if (is_ipv6) {
+    return ipfix_evict_record_ip6(ptd) || ipfix_evict_record_ip4(ptd);
+  }
+  return ipfix_evict_record_ip4(ptd) || ipfix_evict_record_ip6(ptd);
+}
+
+/* octetDeltaCount counts the IP header too, unlike the IPv6 payload length */
+static_always_inline u32 ip6_octets(ip6_header_t *ip) {
+  return clib_net_to_host_u16(ip->payload_length) + sizeof(ip6_header_t);
+}
+
+/* How many packets ahead the bucket data is prefetched while searching */
+#define IPFIX_SEARCH_PREFETCH 4
+
+static_always_inline ipfix_flow_counters_t *
+ipfix_packet_counters(ipfix_per_thread_data_t *ptd, u64 value, u8 reversed,
+                      u8 is_ipv6) {
+  if (is_ipv6) {
+    return ipfix_packet_counters_ip6(ptd, value, reversed);
+  }
+  return ipfix_packet_counters_ip4(ptd, value, reversed);
+}
+
+/* What the meter passes learn about the packets of a frame, the keys are
+ * those of the family the frame is of */
+typedef struct {
+  union {
+    clib_bihash_kv_16_8_t kv_ip4[VLIB_FRAME_SIZE];
+    clib_bihash_kv_40_8_t kv_ip6[VLIB_FRAME_SIZE];
+  };
+  u64 hash[VLIB_FRAME_SIZE];
+  u64 record_value[VLIB_FRAME_SIZE];
+  u64 offload[VLIB_FRAME_SIZE];
+  u8 reversed[VLIB_FRAME_SIZE];
+  u32 length[VLIB_FRAME_SIZE];
+} ipfix_meter_frame_t;
+
+/* Pass 1 of a packet, see ipfix_meter_inline. The IPv4 key is already
+ * built, the IPv6 one is built here. */
+static_always_inline void
+ipfix_meter_prepare(ipfix_per_thread_data_t *ptd, vlib_buffer_t *b0,
+                    ipfix_meter_frame_t *f, u32 i, u8 *is_slow,
+                    u8 is_ipv6) {
+  ipfix_main_t * im = &ipfix_main;
+
+  if (is_ipv6) {
+    ip6_header_t *ip0 = vlib_buffer_get_current (b0);
+    clib_bihash_kv_40_8_t *kv = &f->kv_ip6[i];
+
+    create_flow_key_ip6((ipfix_ip6_flow_key_t*) &kv->key, ip0);
+    is_slow[i] = ipfix_ip6_is_slow(ip0);
+    f->length[i] = ip6_octets(ip0);
+    if (PREDICT_FALSE(im->aggregate_ip6)) {
+      ipfix_mask_key_ip6(kv);
+    }
+    f->reversed[i] = im->biflow
+      && ipfix_order_key_ip6((ipfix_ip6_flow_key_t*) &kv->key);
+    f->hash[i] = clib_bihash_hash_40_8(kv);
+    clib_bihash_prefetch_bucket_40_8(&ptd->flow_hash_ip6, f->hash[i]);
+    CLIB_PREFETCH (ptd->flow_cache_ip6 + ipfix_flow_cache_slot(f->hash[i]),
+                   sizeof(clib_bihash_kv_40_8_t), LOAD);
+  } else {
+    ip4_header_t *ip0 = vlib_buffer_get_current (b0);
+    clib_bihash_kv_16_8_t *kv = &f->kv_ip4[i];
+
+    is_slow[i] = ipfix_ip4_is_slow(ip0);
+    f->length[i] = clib_net_to_host_u16(ip0->length);
+    if (PREDICT_FALSE(im->aggregate_ip4)) {
+      ipfix_mask_key_ip4(kv);
+    }
+    f->reversed[i] = im->biflow
+      && ipfix_order_key_ip4((ipfix_ip4_flow_key_t*) &kv->key);
+    f->hash[i] = clib_bihash_hash_16_8(kv);
+    clib_bihash_prefetch_bucket_16_8(&ptd->flow_hash_ip4, f->hash[i]);
+    CLIB_PREFETCH (ptd->flow_cache_ip4 + ipfix_flow_cache_slot(f->hash[i]),
+                   sizeof(clib_bihash_kv_16_8_t), LOAD);
+  }
+  f->offload[i] = ipfix_offload_value(b0, is_ipv6);
+}
+
+static_always_inline void
+ipfix_meter_prefetch_data(ipfix_per_thread_data_t *ptd, u64 hash,
+                          u8 is_ipv6) {
+  if (is_ipv6) {
+    clib_bihash_prefetch_data_40_8(&ptd->flow_hash_ip6, hash);
+  } else {
+    clib_bihash_prefetch_data_16_8(&ptd->flow_hash_ip4, hash);
+  }
+}
+
+/* Whether packets `i` and `j` of the frame have the same key */
+static_always_inline int
+ipfix_meter_same_flow(ipfix_meter_frame_t *f, u32 i, u32 j, u8 is_ipv6) {
+  if (is_ipv6) {
+    return ipfix_flow_key_equal_ip6(&f->kv_ip6[i], &f->kv_ip6[j]);
+  }
+  return ipfix_flow_key_equal_ip4(&f->kv_ip4[i], &f->kv_ip4[j]);
+}
+
+/* Returns 1 with the bihash value of the flow of packet `i` in `value` if
+ * the flow cache has it */
+static_always_inline int
+ipfix_meter_cache_search(ipfix_per_thread_data_t *ptd,
+                         ipfix_meter_frame_t *f, u32 i, u64 *value,
+                         u8 is_ipv6) {
+  u32 slot = ipfix_flow_cache_slot(f->hash[i]);
+
+  if (is_ipv6) {
+    clib_bihash_kv_40_8_t *cached = ptd->flow_cache_ip6 + slot;
+
+    if (!ipfix_flow_key_equal_ip6(cached, &f->kv_ip6[i])) {
+      return 0;
+    }
+    *value = cached->value;
+  } else {
+    clib_bihash_kv_16_8_t *cached = ptd->flow_cache_ip4 + slot;
+
+    if (!ipfix_flow_key_equal_ip4(cached, &f->kv_ip4[i])) {
+      return 0;
+    }
+    *value = cached->value;
+  }
+  return 1;
+}
+
+static_always_inline void
+ipfix_meter_cache_add(ipfix_per_thread_data_t *ptd, ipfix_meter_frame_t *f,
+                      u32 i, u64 value, u8 is_ipv6) {
+  u32 slot = ipfix_flow_cache_slot(f->hash[i]);
+
+  if (is_ipv6) {
+    ptd->flow_cache_ip6[slot] = f->kv_ip6[i];
+    ptd->flow_cache_ip6[slot].value = value;
+  } else {
+    ptd->flow_cache_ip4[slot] = f->kv_ip4[i];
+    ptd->flow_cache_ip4[slot].value = value;
+  }
+}
+
+/* Search the bihash for the flow of packet `i`, returns 0 with its value
+ * in `value` if found, -1 if not, as clib_bihash_search */
+static_always_inline int
+ipfix_meter_search(ipfix_per_thread_data_t *ptd, ipfix_meter_frame_t *f,
+                   u32 i, u64 *value, u8 is_ipv6) {
+  if (is_ipv6) {
+    clib_bihash_kv_40_8_t result;
+
+    if (clib_bihash_search_inline_2_with_hash_40_8(&ptd->flow_hash_ip6,
+                                                   f->hash[i],
+                                                   &f->kv_ip6[i],
+                                                   &result) < 0) {
+      return -1;
+    }
+    *value = result.value;
+  } else {
+    clib_bihash_kv_16_8_t result;
+
+    if (clib_bihash_search_inline_2_with_hash_16_8(&ptd->flow_hash_ip4,
+                                                   f->hash[i],
+                                                   &f->kv_ip4[i],
+                                                   &result) < 0) {
+      return -1;
+    }
+    *value = result.value;
+  }
+  return 0;
+}
+
+/* Add the record of packet `i`, see create_record_ip4, and check it
+ * against the offload threshold. Its bihash value goes to `value`. */
+static_always_inline int
+ipfix_meter_create(vlib_main_t * vm, ipfix_per_thread_data_t *ptd,
+                   ipfix_meter_frame_t *f, u32 *buffers, u32 i, u64 now,
+                   u64 *value, u8 is_ipv6) {
+  if (is_ipv6) {
+    if (!create_record_ip6(ptd, &f->kv_ip6[i], f->length[i], now,
+                           f->reversed[i])) {
+      return 0;
+    }
+    *value = f->kv_ip6[i].value;
+  } else {
+    if (!create_record_ip4(ptd, &f->kv_ip4[i], f->length[i], now,
+                           f->reversed[i])) {
+      return 0;
+    }
+    *value = f->kv_ip4[i].value;
+  }
+
+  ipfix_offload_check(vm, ptd,
+                      ipfix_packet_counters(ptd, *value, f->reversed[i],
+                                            is_ipv6),
+                      1, buffers[i], *value, is_ipv6);
+  return 1;
+}
+
+/* Meter a frame of packets of one family in passes so that the bihash
+ * and record memory is already on its way when it is needed:
+ *   1. build the keys, for IPv4 those of the whole frame first, see
+ *      ipfix_flow_keys_ip4, mask them for aggregation and order them for
+ *      biflows, then hash them four packets at a time and prefetch their
+ *      buckets and flow cache slots; tell which packets need the slow
+ *      path node,
+ *   2. search, prefetching the bucket data a few packets ahead, unless
+ *      the NIC marked the packet with its record or the flow cache has
+ *      it; create the missing records and prefetch the counters of the
+ *      existing ones,
+ *   3. update the counters of the existing records, once per run of
+ *      packets of the same flow, noting those that reach the offload
+ *      threshold,
+ *   4. with the flow table full, make room for the new flows. This waits
+ *      for pass 3 so that no record found in pass 2 is evicted before its
+ *      counters are updated.
+ */
+static_always_inline void
+ipfix_meter_inline(vlib_main_t * vm, vlib_node_runtime_t * node,
+                   ipfix_per_thread_data_t *ptd, u32 *buffers,
+                   u32 n_packets, u64 now, u8 *is_slow, u8 is_ipv6) {
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_meter_frame_t f;
+  u32 pending[VLIB_FRAME_SIZE];
+  u32 i, j, n_pending = 0, n_evicted = 0, n_not_metered = 0;
+  u32 n_hash_failed = 0;
+  u64 value;
+
+  /* the IPv4 keys first, the whole frame in one call, which also brings
+   * the packets in for the rest of the pass */
+  if (!is_ipv6) {
+    ipfix_flow_keys_ip4(vm, buffers, f.kv_ip4, n_packets);
+  }
+
+  for (i = 0; i + 4 <= n_packets; i += 4) {
+    vlib_buffer_t *b0, *b1, *b2, *b3;
+
+    /* Prefetch next iteration. */
+    if (is_ipv6 && i + 8 <= n_packets) {
+      vlib_buffer_t *p4, *p5, *p6, *p7;
+
+      p4 = vlib_get_buffer (vm, buffers[i + 4]);
+      p5 = vlib_get_buffer (vm, buffers[i + 5]);
+      p6 = vlib_get_buffer (vm, buffers[i + 6]);
+      p7 = vlib_get_buffer (vm, buffers[i + 7]);
+
+      vlib_prefetch_buffer_header (p4, LOAD);
+      vlib_prefetch_buffer_header (p5, LOAD);
+      vlib_prefetch_buffer_header (p6, LOAD);
+      vlib_prefetch_buffer_header (p7, LOAD);
+
+      CLIB_PREFETCH (p4->data, CLIB_CACHE_LINE_BYTES, LOAD);
+      CLIB_PREFETCH (p5->data, CLIB_CACHE_LINE_BYTES, LOAD);
+      CLIB_PREFETCH (p6->data, CLIB_CACHE_LINE_BYTES, LOAD);
+      CLIB_PREFETCH (p7->data, CLIB_CACHE_LINE_BYTES, LOAD);
+    }
+
+    b0 = vlib_get_buffer (vm, buffers[i]);
+    b1 = vlib_get_buffer (vm, buffers[i + 1]);
+    b2 = vlib_get_buffer (vm, buffers[i + 2]);
+    b3 = vlib_get_buffer (vm, buffers[i + 3]);
+
+    ipfix_meter_prepare(ptd, b0, &f, i, is_slow, is_ipv6);
+    ipfix_meter_prepare(ptd, b1, &f, i + 1, is_slow, is_ipv6);
+    ipfix_meter_prepare(ptd, b2, &f, i + 2, is_slow, is_ipv6);
+    ipfix_meter_prepare(ptd, b3, &f, i + 3, is_slow, is_ipv6);
+  }
+
+  for (; i < n_packets; i++) {
+    ipfix_meter_prepare(ptd, vlib_get_buffer (vm, buffers[i]), &f, i,
+                        is_slow, is_ipv6);
+  }
+
+  for (i = 0; i < n_packets; i++) {
+    if (PREDICT_FALSE(is_slow[i])) {
+      f.record_value[i] = ~0ULL;
+      continue;
+    }
+
+    if (i + IPFIX_SEARCH_PREFETCH < n_packets) {
+      ipfix_meter_prefetch_data(ptd, f.hash[i + IPFIX_SEARCH_PREFETCH],
+                                is_ipv6);
+    }
+
+    /* trains of one flow only look it up once */
+    if (i > 0 && f.record_value[i - 1] != ~0ULL
+        && f.reversed[i] == f.reversed[i - 1]
+        && ipfix_meter_same_flow(&f, i - 1, i, is_ipv6)) {
+      f.record_value[i] = f.record_value[i - 1];
+      continue;
+    }
+
+    /* marked by the NIC, the record is known without a search, and the
+     * flow of a recent packet is known without one too */
+    if (PREDICT_FALSE(f.offload[i] != ~0ULL)) {
+      value = f.offload[i];
+    } else if (!ipfix_meter_cache_search(ptd, &f, i, &value, is_ipv6)) {
+      if (ipfix_meter_search(ptd, &f, i, &value, is_ipv6) < 0) {
+        f.record_value[i] = ~0ULL;
+        if (PREDICT_FALSE(ipfix_n_flows(ptd) >= im->max_flows)) {
+          pending[n_pending++] = i;
+          continue;
+        }
+        /* later packets of the same flow find it in the hash */
+        if (ipfix_meter_create(vm, ptd, &f, buffers, i, now, &value,
+                               is_ipv6)) {
+          ipfix_meter_cache_add(ptd, &f, i, value, is_ipv6);
+        } else {
+          n_hash_failed++;
+        }
+        continue;
+      }
+      ipfix_meter_cache_add(ptd, &f, i, value, is_ipv6);
+    }
+
+    f.record_value[i] = value;
+    CLIB_PREFETCH (ipfix_packet_counters(ptd, value, f.reversed[i], is_ipv6),
+                   sizeof(ipfix_flow_counters_t), STORE);
+  }
+
+  /* counters are looked up again, creating records may have moved them;
+   * a run of packets of the same flow and direction is one update */
+  for (i = 0; i < n_packets; i = j) {
+    ipfix_flow_counters_t *counters;
+    u64 octets = f.length[i];
+
+    for (j = i + 1; j < n_packets && f.record_value[j] == f.record_value[i]
+           && f.reversed[j] == f.reversed[i]; j++) {
+      octets += f.length[j];
+    }
+    if (f.record_value[i] == ~0ULL) {
+      continue;
+    }
+
+    counters = ipfix_packet_counters(ptd, f.record_value[i], f.reversed[i],
+                                     is_ipv6);
+    update_record(counters, j - i, octets, now);
+    ipfix_offload_check(vm, ptd, counters, j - i, buffers[i],
+                        f.record_value[i], is_ipv6);
+  }
+
+  for (j = 0; j < n_pending; j++) {
+    ipfix_flow_counters_t *counters;
+
+    i = pending[j];
+
+    /* an earlier pending packet may have created the flow */
+    if (ipfix_meter_search(ptd, &f, i, &value, is_ipv6) == 0) {
+      counters = ipfix_packet_counters(ptd, value, f.reversed[i], is_ipv6);
+      update_record(counters, 1, f.length[i], now);
+      ipfix_offload_check(vm, ptd, counters, 1, buffers[i], value, is_ipv6);
+    } else if (ipfix_make_room(ptd, is_ipv6)) {
+      n_evicted++;
+      if (!ipfix_meter_create(vm, ptd, &f, buffers, i, now, &value,
+                              is_ipv6)) {
+        n_hash_failed++;
+      }
+    } else {
+      n_not_metered++;
+    }
+  }
+
+  if (PREDICT_FALSE(n_pending > 0)) {
+    vlib_node_increment_counter(vm, node->node_index, IPFIX_ERROR_EVICTED,
+                                n_evicted);
+    vlib_node_increment_counter(vm, node->node_index,
+                                IPFIX_ERROR_NOT_METERED, n_not_metered);
+  }
+  if (PREDICT_FALSE(n_hash_failed > 0)) {
+    vlib_node_increment_counter(vm, node->node_index,
+                                IPFIX_ERROR_HASH_ADD_FAILED, n_hash_failed);
+  }
+}
+
+static void ipfix_meter_ip4(vlib_main_t * vm, vlib_node_runtime_t * node,
+                            ipfix_per_thread_data_t *ptd,
+                            u32 *buffers, u32 n_packets, u64 now,
+                            u8 *is_slow) {
+  ipfix_meter_inline(vm, node, ptd, buffers, n_packets, now, is_slow, 0);
+}
+
+static void ipfix_meter_ip6(vlib_main_t * vm, vlib_node_runtime_t * node,
+                            ipfix_per_thread_data_t *ptd,
+                            u32 *buffers, u32 n_packets, u64 now,
+                            u8 *is_slow) {
+  ipfix_meter_inline(vm, node, ptd, buffers, n_packets, now, is_slow, 1);
+}
+
+/* Leave out the packets their interface's sampler does not pick, before
+ * any work is done on them. The picked buffers are copied to `sampled`,
+ * their positions in `buffers` to `positions`.
+ *
+ * Returns how many were picked. */
+static u32 ipfix_sample_packets(vlib_main_t * vm,
+                                ipfix_per_thread_data_t *ptd,
+                                u32 *buffers, u32 n_packets, u32 *sampled,
+                                u16 *positions)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 i, n_sampled = 0;
+
+  for (i = 0; i < n_packets; i++) {
+    vlib_buffer_t *b0 = vlib_get_buffer (vm, buffers[i]);
+    u32 sw_if_index0 = vnet_buffer(b0)->sw_if_index[VLIB_RX];
+    ipfix_sampling_t *sampling = vec_elt_at_index(im->sampling, sw_if_index0);
+    ipfix_sampler_t *sampler;
+
+    if (!sampling->interval) {
+      positions[n_sampled] = i;
+      sampled[n_sampled++] = buffers[i];
+      continue;
+    }
+
+    sampler = vec_elt_at_index(ptd->samplers, sw_if_index0);
+    if (sampler->position == 0 && sampling->is_random) {
+      sampler->pick = random_u32(&ptd->random_seed) % sampling->interval;
+    }
+    if (sampler->position == sampler->pick) {
+      positions[n_sampled] = i;
+      sampled[n_sampled++] = buffers[i];
+    }
+    if (++sampler->position == sampling->interval) {
+      sampler->position = 0;
+    }
+  }
+
+  return n_sampled;
+}
+
+/* Meter a flow key on its own, for the slow path nodes */
+static void ipfix_meter_key_ip4(vlib_main_t * vm, vlib_node_runtime_t * node,
+                                ipfix_per_thread_data_t *ptd,
+                                clib_bihash_kv_16_8_t *kv, u32 length,
+                                u64 now, u8 reversed) {
+  ipfix_main_t * im = &ipfix_main;
+  clib_bihash_kv_16_8_t result;
+
+  if (clib_bihash_search_16_8(&ptd->flow_hash_ip4, kv, &result) == 0) {
+    update_record(ipfix_packet_counters_ip4(ptd, result.value, reversed),
+                  1, length, now);
+    return;
+  }
+
+  if (ipfix_n_flows(ptd) >= im->max_flows) {
+    if (!ipfix_make_room(ptd, 0)) {
+      vlib_node_increment_counter(vm, node->node_index,
+                                  IPFIX_ERROR_NOT_METERED, 1);
+      return;
+    }
+    vlib_node_increment_counter(vm, node->node_index, IPFIX_ERROR_EVICTED, 1);
+  }
+
+  if (!create_record_ip4(ptd, kv, length, now, reversed)) {
+    vlib_node_increment_counter(vm, node->node_index,
+                                IPFIX_ERROR_HASH_ADD_FAILED, 1);
+  }
+}
+
+static void ipfix_meter_key_ip6(vlib_main_t * vm, vlib_node_runtime_t * node,
+                                ipfix_per_thread_data_t *ptd,
+                                clib_bihash_kv_40_8_t *kv, u32 length,
+                                u64 now, u8 reversed) {
+  ipfix_main_t * im = &ipfix_main;
+  clib_bihash_kv_40_8_t result;
+
+  if (clib_bihash_search_40_8(&ptd->flow_hash_ip6, kv, &result) == 0) {
+    update_record(ipfix_packet_counters_ip6(ptd, result.value, reversed),
+                  1, length, now);
+    return;
+  }
+
+  if (ipfix_n_flows(ptd) >= im->max_flows) {
+    if (!ipfix_make_room(ptd, 1)) {
+      vlib_node_increment_counter(vm, node->node_index,
+                                  IPFIX_ERROR_NOT_METERED, 1);
+      return;
+    }
+    vlib_node_increment_counter(vm, node->node_index, IPFIX_ERROR_EVICTED, 1);
+  }
+
+  if (!create_record_ip6(ptd, kv, length, now, reversed)) {
+    vlib_node_increment_counter(vm, node->node_index,
+                                IPFIX_ERROR_HASH_ADD_FAILED, 1);
+  }
+}
+
+/* Fill a packet trace with the flow of a metered key, a single lookup */
+static void ipfix_trace_key_ip4(ipfix_per_thread_data_t *ptd,
+                                clib_bihash_kv_16_8_t *kv, ipfix_trace_t *t) {
+  clib_bihash_kv_16_8_t result;
+
+  t->is_ipv6 = 0;
+  if (clib_bihash_search_16_8(&ptd->flow_hash_ip4, kv, &result) == 0) {
+    t->record_index = ipfix_value_index(result.value);
+    ipfix_flow_value_ip4(ptd, t->record_index, &t->flow.ip4);
+    return;
+  }
+  t->record_index = ~0;
+  memset(&t->flow.ip4, 0, sizeof(t->flow.ip4));
+  memcpy(&t->flow.ip4.flow_key, &kv->key, sizeof(ipfix_ip4_flow_key_t));
+}
+
+static void ipfix_trace_key_ip6(ipfix_per_thread_data_t *ptd,
+                                clib_bihash_kv_40_8_t *kv, ipfix_trace_t *t) {
+  clib_bihash_kv_40_8_t result;
+
+  t->is_ipv6 = 1;
+  if (clib_bihash_search_40_8(&ptd->flow_hash_ip6, kv, &result) == 0) {
+    t->record_index = ipfix_value_index(result.value);
+    ipfix_flow_value_ip6(ptd, t->record_index, &t->flow.ip6);
+    return;
+  }
+  t->record_index = ~0;
+  memset(&t->flow.ip6, 0, sizeof(t->flow.ip6));
+  memcpy(&t->flow.ip6.flow_key, &kv->key, sizeof(ipfix_ip6_flow_key_t));
+}
+
+/* Trace a packet of the meter nodes, after the frame was metered. The
+ * key is built again the way the meter did; packets for the slow path
+ * are traced there with their full key instead. */
+static void ipfix_trace_packet(vlib_main_t * vm, vlib_node_runtime_t * node,
+                               ipfix_per_thread_data_t *ptd,
+                               vlib_buffer_t *b0, u32 next0, u8 is_ipv6) {
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_trace_t *t = vlib_add_trace (vm, node, b0, sizeof (*t));
+
+  t->sw_if_index = vnet_buffer(b0)->sw_if_index[VLIB_RX];
+  t->next_index = next0;
+
+  if (is_ipv6) {
+    clib_bihash_kv_40_8_t kv;
+
+    create_flow_key_ip6((ipfix_ip6_flow_key_t*) &kv.key,
+                        vlib_buffer_get_current (b0));
+    if (PREDICT_FALSE(im->aggregate_ip6)) {
+      ipfix_mask_key_ip6(&kv);
+    }
+    if (im->biflow) {
+      ipfix_order_key_ip6((ipfix_ip6_flow_key_t*) &kv.key);
+    }
+    if (next0 == IPFIX_NEXT_SLOW_PATH) {
+      t->is_ipv6 = 1;
+      t->record_index = ~0;
+      memset(&t->flow.ip6, 0, sizeof(t->flow.ip6));
+      memcpy(&t->flow.ip6.flow_key, &kv.key, sizeof(ipfix_ip6_flow_key_t));
+      return;
+    }
+    ipfix_trace_key_ip6(ptd, &kv, t);
+  } else {
+    clib_bihash_kv_16_8_t kv;
+
+    create_flow_key_ip4_scalar((ipfix_ip4_flow_key_t*) &kv.key,
+                               vlib_buffer_get_current (b0));
+    if (PREDICT_FALSE(im->aggregate_ip4)) {
+      ipfix_mask_key_ip4(&kv);
+    }
+    if (im->biflow) {
+      ipfix_order_key_ip4((ipfix_ip4_flow_key_t*) &kv.key);
+    }
+    if (next0 == IPFIX_NEXT_SLOW_PATH) {
+      t->is_ipv6 = 0;
+      t->record_index = ~0;
+      memset(&t->flow.ip4, 0, sizeof(t->flow.ip4));
+      memcpy(&t->flow.ip4.flow_key, &kv.key, sizeof(ipfix_ip4_flow_key_t));
+      return;
+    }
+    ipfix_trace_key_ip4(ptd, &kv, t);
+  }
+}
+
+always_inline uword
+ipfix_meter_fn_inline (vlib_main_t * vm,
+                       vlib_node_runtime_t * node,
+                       vlib_frame_t * frame,
+                       u8 is_ipv6)
+{
+  u32 n_left_from, * from, * to_next;
+  ipfix_next_t next_index;
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_per_thread_data_t * ptd =
+    vec_elt_at_index (im->per_thread_data, vlib_get_thread_index ());
+  u32 sampled[VLIB_FRAME_SIZE];
+  u16 positions[VLIB_FRAME_SIZE];
+  u8 is_slow[VLIB_FRAME_SIZE], slow_path[VLIB_FRAME_SIZE];
+  u8 * slow = slow_path;
+  u32 * metered, n_metered, i;
+  u64 now, cycles;
+
+  cycles = clib_cpu_time_now ();
+  from = vlib_frame_vector_args (frame);
+  n_left_from = frame->n_vectors;
+  next_index = node->cached_next_index;
+
+  /* One timestamp for the whole frame, see ipfix_time_now */
+  now = ipfix_time_now (vm);
+
+  metered = from;
+  n_metered = n_left_from;
+  if (PREDICT_FALSE(im->n_sampling_interfaces > 0)) {
+    n_metered = ipfix_sample_packets(vm, ptd, from, n_left_from, sampled,
+                                     positions);
+    metered = sampled;
+  }
+
+  /* Meter the whole frame first, the packets are then passed on as is */
+  if (is_ipv6) {
+    ipfix_meter_ip6(vm, node, ptd, metered, n_metered, now, is_slow);
+  } else {
+    ipfix_meter_ip4(vm, node, ptd, metered, n_metered, now, is_slow);
+  }
+
+  /* sampling and metering, the rest is passing the frame on */
+  cycles = clib_cpu_time_now () - cycles;
+  vlib_increment_simple_counter(&im->meter_cycles, vm->thread_index,
+                                clib_min(min_log2(cycles | 1),
+                                         IPFIX_CYCLES_BUCKETS - 1), 1);
+  vlib_set_simple_counter(&im->counters[IPFIX_COUNTER_ACTIVE_FLOWS],
+                          vm->thread_index, 0, ipfix_n_flows(ptd));
+
+  /* The slow path node meters the packets left out here, by position in
+   * the frame. Packets the sampler did not pick stay on the fast path. */
+  if (metered == from) {
+    memcpy(slow_path, is_slow, n_metered);
+  } else {
+    memset(slow_path, 0, n_left_from);
+    for (i = 0; i < n_metered; i++) {
+      slow_path[positions[i]] = is_slow[i];
+    }
+  }
+
+  while (n_left_from > 0)
+    {
+      u32 n_left_to_next;
+
+      vlib_get_next_frame (vm, node, next_index,
+                           to_next, n_left_to_next);
+
+      while (n_left_from >= 2 && n_left_to_next >= 2)
+        {
+          u32 next0 = slow[0] ? IPFIX_NEXT_SLOW_PATH
+            : IPFIX_NEXT_INTERFACE_OUTPUT;
+          u32 next1 = slow[1] ? IPFIX_NEXT_SLOW_PATH
+            : IPFIX_NEXT_INTERFACE_OUTPUT;
+          u32 bi0, bi1;
+          vlib_buffer_t * b0, * b1;
+
+          /* speculatively enqueue b0 and b1 to the current next frame */
+          to_next[0] = bi0 = from[0];
+          to_next[1] = bi1 = from[1];
+          from += 2;
+          slow += 2;
+          to_next += 2;
+          n_left_from -= 2;
+          n_left_to_next -= 2;
+
+          b0 = vlib_get_buffer (vm, bi0);
+          b1 = vlib_get_buffer (vm, bi1);
+
+          if (PREDICT_FALSE((node->flags & VLIB_NODE_FLAG_TRACE)))
+            {
+              if (b0->flags & VLIB_BUFFER_IS_TRACED)
+                {
+                  ipfix_trace_packet(vm, node, ptd, b0, next0, is_ipv6);
+                }
+              if (b1->flags & VLIB_BUFFER_IS_TRACED)
+                {
+                  ipfix_trace_packet(vm, node, ptd, b1, next1, is_ipv6);
+                }
+            }
+
+            /* verify speculative enqueues, maybe switch current next frame */
+            vlib_validate_buffer_enqueue_x2 (vm, node, next_index,
+                                             to_next, n_left_to_next,
+                                             bi0, bi1, next0, next1);
+        }
+
+      while (n_left_from > 0 && n_left_to_next > 0)
+        {
+          u32 bi0;
+          vlib_buffer_t * b0;
+          u32 next0 = slow[0] ? IPFIX_NEXT_SLOW_PATH
+            : IPFIX_NEXT_INTERFACE_OUTPUT;
+
+          /* speculatively enqueue b0 to the current next frame */
+          bi0 = from[0];
+          to_next[0] = bi0;
+          from += 1;
+          slow += 1;
+          to_next += 1;
+          n_left_from -= 1;
+          n_left_to_next -= 1;
+
+          b0 = vlib_get_buffer (vm, bi0);
+
+          if (PREDICT_FALSE((node->flags & VLIB_NODE_FLAG_TRACE)
+                            && (b0->flags & VLIB_BUFFER_IS_TRACED))) {
+            ipfix_trace_packet(vm, node, ptd, b0, next0, is_ipv6);
+          }
+
+          /* verify speculative enqueue, maybe switch current next frame */
+          vlib_validate_buffer_enqueue_x1 (vm, node, next_index,
+                                           to_next, n_left_to_next,
+                                           bi0, next0);
+        }
+
+      vlib_put_next_frame (vm, node, next_index, n_left_to_next);
+    }
+
+  return frame->n_vectors;
+}
+
+/* Number of data records of `template` that fit into one IPFIX message
+ * without exceeding the configured path MTU */
+static u32 ipfix_records_per_packet(netflow_v10_template_t *template)
+{
+  ipfix_main_t * im = &ipfix_main;
+  netflow_v10_template_set_t *set;
+  u64 available, record_size = 0;
+  ipfix_collector_t *collector;
+  u32 ip_header_size = sizeof(ip4_header_t);
+
+  /* the same message may go to collectors of both families */
+  vec_foreach(collector, im->collectors) {
+    if (collector->is_ipv6) {
+      ip_header_size = sizeof(ip6_header_t);
+    }
+  }
+
+  available = im->path_mtu - ip_header_size - sizeof(udp_header_t)
+    - sizeof(netflow_v10_header_t);
+
+  vec_foreach(set, template->sets) {
+    available -= sizeof(netflow_v10_set_header_t);
+    record_size += set->record_size;
+  }
+
+  return clib_max(1, available / record_size);
+}
+
+/* Write a template set to the given buffer (which must have enough
+ * space allocated) for an IPFIX packet, an options template set if the
+ * template has scope fields
+ *
+ * Returns the number of bytes written to buffer
+ */
+static u64 ipfix_write_template_set(u16 *buffer,
+                                    netflow_v10_template_t *template) {
+  u64 octets;
+  u64 set_idx;
+  u16 *template_header, *ptr;
+  netflow_v10_template_set_t *template_set;
+  netflow_v10_field_specifier_t *field_spec;
+
+  /* advance pointer past header, write header at end of function */
+  template_header = buffer;
+  ptr = template_header + 2;
+  octets = 4;
+
+  vec_foreach_index(set_idx, template->sets) {
+    template_set = vec_elt_at_index(template->sets, set_idx);
+
+    *ptr = clib_byte_swap_u16(template_set->id);
+    *(ptr + 1) = clib_byte_swap_u16(vec_len(template_set->fields));
+    ptr += 2;
+    octets += 4;
+
+    if (template_set->scope_field_count) {
+      *ptr = clib_byte_swap_u16(template_set->scope_field_count);
+      ptr += 1;
+      octets += 2;
+    }
+
+    vec_foreach(field_spec, template_set->fields) {
+      if (field_spec->enterprise_number) {
+        /* enterprise bit set, the number follows the length */
+        *ptr = clib_byte_swap_u16(field_spec->identifier | 0x8000);
+        *(ptr + 1) = clib_byte_swap_u16(field_spec->size);
+        clib_mem_unaligned(ptr + 2, u32) =
+          clib_host_to_net_u32(field_spec->enterprise_number);
+        ptr += 4;
+        octets += 8;
+        continue;
+      }
+      *ptr = clib_byte_swap_u16(field_spec->identifier);
+      *(ptr + 1) = clib_byte_swap_u16(field_spec->size);
+      ptr += 2;
+      octets += 4;
+    };
+  }
+
+  /* write set header, 2 for templates and 3 for options templates */
+  *template_header = clib_byte_swap_u16(template->sets[0].scope_field_count
+                                        ? 3 : 2);
+  *(template_header + 1) = clib_byte_swap_u16(octets);
+
+  return octets;
+}
+
+/* Write all relevant templates into an IPFIX packet, the given buffer must
+ * have enough space allocated. Returns the length of the payload. */
+static u64 ipfix_write_template_packet(u8* buffer) {
+  ipfix_main_t * im = &ipfix_main;
+  u64 octets = 0;
+  netflow_v10_header_t *ipfix_header = (netflow_v10_header_t*) buffer;
+  u8* template_ptr = buffer + sizeof(netflow_v10_header_t);
+
+  struct timespec current_time_clock;
+  clock_gettime(CLOCK_REALTIME, &current_time_clock);
+
+  octets += ipfix_write_template_set((u16*)template_ptr, im->template_ip4);
+  octets += ipfix_write_template_set((u16*)(template_ptr + octets), im->template_ip6);
+  octets += ipfix_write_template_set((u16*)(template_ptr + octets),
+                                     im->template_sampling[0]);
+  octets += ipfix_write_template_set((u16*)(template_ptr + octets),
+                                     im->template_sampling[1]);
+
+  /* write IPFIX header */
+  octets += sizeof(netflow_v10_header_t);
+  ipfix_header->version = clib_byte_swap_u16(10);
+  ipfix_header->byte_length = clib_byte_swap_u16(octets);
+  ipfix_header->timestamp = clib_byte_swap_u32(current_time_clock.tv_sec);
+  /* per collector, see ipfix_send_to_collector */
+  ipfix_header->sequence_number = 0;
+  ipfix_header->observation_domain = clib_byte_swap_u32(im->observation_domain);
+
+  return octets;
+}
+
+/* Run the compiled encoder of a template set over `n_records` records,
+ * each `record_stride` bytes apart, writing consecutive data records to
+ * `data`. Every step is applied to all the records before the next one,
+ * so the dispatch happens once per step and each inner loop is a plain
+ * strided copy. */
+static void ipfix_encode_records(netflow_v10_template_set_t *set, u8 *data,
+                                 void *records, u32 n_records,
+                                 u32 record_stride)
+{
+  netflow_v10_encode_step_t *step;
+  u32 data_stride = set->record_size;
+  u32 i;
+
+  vec_foreach(step, set->encoder) {
+    u8 *src = (u8 *)records + step->record_offset;
+    u8 *dst = data + step->data_offset;
+
+#define _(op, body)                                     \
+    case op:                                            \
+      for (i = 0; i < n_records; i++) {                 \
+        body;                                           \
+        src += record_stride;                           \
+        dst += data_stride;                             \
+      }                                                 \
+      break;
+
+    switch (step->op) {
+    _(NETFLOW_V10_ENCODE_COPY1, *dst = *src)
+    _(NETFLOW_V10_ENCODE_COPY2,
+      clib_mem_unaligned(dst, u16) = clib_mem_unaligned(src, u16))
+    _(NETFLOW_V10_ENCODE_COPY4,
+      clib_mem_unaligned(dst, u32) = clib_mem_unaligned(src, u32))
+    _(NETFLOW_V10_ENCODE_COPY8,
+      clib_mem_unaligned(dst, u64) = clib_mem_unaligned(src, u64))
+    _(NETFLOW_V10_ENCODE_COPY16,
+      clib_memcpy(dst, src, 16))
+    _(NETFLOW_V10_ENCODE_SWAP16,
+      clib_mem_unaligned(dst, u16) = clib_host_to_net_u16(*(u16 *)src))
+    _(NETFLOW_V10_ENCODE_SWAP32,
+      clib_mem_unaligned(dst, u32) = clib_host_to_net_u32(*(u32 *)src))
+    _(NETFLOW_V10_ENCODE_SWAP64,
+      clib_mem_unaligned(dst, u64) = clib_host_to_net_u64(*(u64 *)src))
+    _(NETFLOW_V10_ENCODE_COPY,
+      clib_memcpy(dst, src, step->size))
+    }
+#undef _
+  }
+}
+
+/* Encode `n_records` consecutive records, each `record_size` bytes apart,
+ * as an IPFIX data message straight into `buffer`, which must have room
+ * for a path MTU sized message.
+ *
+ * Returns the number of bytes written to buffer.
+ */
+static u64 ipfix_write_v10_data_packet(u8 *buffer,
+                                       netflow_v10_template_t *template,
+                                       void *records, u32 n_records,
+                                       u32 record_size)
+{
+  ipfix_main_t * im = &ipfix_main;
+  netflow_v10_header_t *ipfix_header = (netflow_v10_header_t*) buffer;
+  u8 *ptr = buffer + sizeof(netflow_v10_header_t);
+  netflow_v10_template_set_t *set;
+
+  struct timespec current_time_clock;
+  clock_gettime(CLOCK_REALTIME, &current_time_clock);
+
+  vec_foreach(set, template->sets) {
+    netflow_v10_set_header_t *set_header = (netflow_v10_set_header_t*) ptr;
+    ptr += sizeof(netflow_v10_set_header_t);
+
+    ipfix_encode_records(set, ptr, records, n_records, record_size);
+    ptr += set->record_size * n_records;
+
+    set_header->id = clib_byte_swap_u16(set->id);
+    set_header->length = clib_byte_swap_u16(ptr - (u8 *)set_header);
+  };
+
+  ipfix_header->version = clib_byte_swap_u16(10);
+  ipfix_header->byte_length = clib_byte_swap_u16(ptr - buffer);
+  ipfix_header->timestamp = clib_byte_swap_u32(current_time_clock.tv_sec);
+  /* per collector, see ipfix_send_to_collector */
+  ipfix_header->sequence_number = 0;
+  ipfix_header->observation_domain = clib_byte_swap_u32(im->observation_domain);
+
+  return ptr - buffer;
+}
+
+/* Make sure `n` export buffers are at hand, allocating the missing ones
+ * with a single vlib_buffer_alloc call.
+ *
+ * Returns the number of buffers available.
+ */
+static u32 ipfix_reserve_buffers(vlib_main_t * vm, u32 n)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 n_have = vec_len(im->export_buffers);
+  u32 n_alloc;
+
+  if (n_have >= n) {
+    return n_have;
+  }
+
+  vec_validate(im->export_buffers, n - 1);
+  n_alloc = vlib_buffer_alloc(vm, im->export_buffers + n_have, n - n_have);
+  _vec_len(im->export_buffers) = n_have + n_alloc;
+
+  if (n_have + n_alloc < n) {
+    clib_warning("Could only allocate %u of %u export buffers",
+                 n_have + n_alloc, n);
+  }
+
+  return n_have + n_alloc;
+}
+
+/* Take an export buffer. The IPFIX message is written at the returned
+ * payload pointer, the start of the buffer data; the IP/UDP headers go
+ * in front of it, in the pre-data area, once it is known which
+ * collectors it is sent to.
+ *
+ * Returns the payload pointer, or 0 if no buffer could be allocated.
+ */
+static u8 *ipfix_get_buffer(vlib_main_t * vm, u32 *bi)
+{
+  ipfix_main_t * im = &ipfix_main;
+  vlib_buffer_t * b0;
+
+  if (ipfix_reserve_buffers(vm, 1) == 0) {
+    return 0;
+  }
+
+  *bi = vec_pop(im->export_buffers);
+  b0 = vlib_get_buffer(vm, *bi);
+  return b0->data;
+}
+
+/* Hand the export frames to ip4-lookup and ip6-lookup, if anything has
+ * been queued */
+static void ipfix_flush_frame(vlib_main_t * vm)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 is_ipv6;
+
+  for (is_ipv6 = 0; is_ipv6 < 2; is_ipv6++) {
+    if (im->export_frame[is_ipv6]) {
+      vlib_put_frame_to_node(vm, im->lookup_node_index[is_ipv6],
+                             im->export_frame[is_ipv6]);
+      im->export_frame[is_ipv6] = 0;
+    }
+  }
+}
+
+/* Prepend the IP/UDP headers for a collector to the IPFIX message in
+ * buffer `bi`, possibly a clone sharing the message, fill in the
+ * collector's sequence number and queue it in the export frame of its
+ * family, which is sent once full or on ipfix_flush_frame
+ */
+static void ipfix_send_to_collector(vlib_main_t * vm, u32 bi,
+                                    u32 n_data_records,
+                                    ipfix_collector_t *collector)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 * to_next, length;
+  vlib_buffer_t * b0;
+  netflow_v10_header_t * ipfix_header;
+  udp_header_t * udp0;
+  vlib_frame_t * frame;
+
+  /* get the actual buffer pointer from our buffer index */
+  b0 = vlib_get_buffer(vm, bi);
+
+  /* RFC 7011: the sequence number counts the data records sent to the
+   * collector before this message, not the messages */
+  ipfix_header = vlib_buffer_get_current(b0);
+  ipfix_header->sequence_number =
+    clib_host_to_net_u32(collector->sequence_number);
+  collector->sequence_number += n_data_records;
+
+  /* recycled buffers carry stale metadata, route in the default table */
+  vnet_buffer(b0)->sw_if_index[VLIB_RX] = 0;
+  vnet_buffer(b0)->sw_if_index[VLIB_TX] = ~0;
+
+  length = vlib_buffer_length_in_chain(vm, b0) + sizeof(udp_header_t);
+
+  if (collector->is_ipv6) {
+    ip6_header_t * ip0;
+    int bogus;
+
+    vlib_buffer_advance(b0, -(word) (sizeof(ip6_header_t)
+                                     + sizeof(udp_header_t)));
+    ip0 = vlib_buffer_get_current(b0);
+    ip0->ip_version_traffic_class_and_flow_label =
+      clib_host_to_net_u32(0x6 << 28);
+    ip0->payload_length = clib_host_to_net_u16(length);
+    ip0->protocol = IP_PROTOCOL_UDP;
+    ip0->hop_limit = 64;
+    ip0->src_address = im->exporter_ip6;
+    ip0->dst_address = collector->address.ip6;
+
+    udp0 = (udp_header_t*) (ip0 + 1);
+    udp0->src_port = clib_host_to_net_u16(im->exporter_port);
+    udp0->dst_port = clib_host_to_net_u16(collector->port);
+    udp0->length = clib_host_to_net_u16(length);
+    /* mandatory over IPv6 */
+    udp0->checksum = 0;
+    udp0->checksum = ip6_tcp_udp_icmp_compute_checksum(vm, b0, ip0, &bogus);
+    if (udp0->checksum == 0) {
+      udp0->checksum = 0xffff;
+    }
+  } else {
+    ip4_header_t * ip0;
+
+    vlib_buffer_advance(b0, -(word) (sizeof(ip4_header_t)
+                                     + sizeof(udp_header_t)));
+    ip0 = vlib_buffer_get_current(b0);
+    ip0->ip_version_and_header_length = 0x45;
+    ip0->tos = 0;
+    ip0->fragment_id = 0;
+    ip0->flags_and_fragment_offset = 0;
+    ip0->ttl = 64;
+    ip0->protocol = IP_PROTOCOL_UDP;
+    ip0->length = clib_host_to_net_u16(sizeof(ip4_header_t) + length);
+    ip0->src_address = im->exporter_ip;
+    ip0->dst_address = collector->address.ip4;
+    /* finally checksum at very end */
+    ip0->checksum = ip4_header_checksum(ip0);
+
+    udp0 = (udp_header_t*) (ip0 + 1);
+    udp0->src_port = clib_host_to_net_u16(im->exporter_port);
+    udp0->dst_port = clib_host_to_net_u16(collector->port);
+    udp0->length = clib_host_to_net_u16(length);
+    udp0->checksum = 0;
+  }
+
+  frame = im->export_frame[collector->is_ipv6];
+  if (!frame) {
+    frame = vlib_get_frame_to_node(vm,
+                                   im->lookup_node_index[collector->is_ipv6]);
+    im->export_frame[collector->is_ipv6] = frame;
+  }
+
+  to_next = vlib_frame_vector_args(frame);
+  to_next[frame->n_vectors++] = bi;
+  vlib_increment_simple_counter(&im->counters[IPFIX_COUNTER_PACKETS_EXPORTED],
+                                vm->thread_index, 0, 1);
+
+  if (frame->n_vectors == VLIB_FRAME_SIZE) {
+    ipfix_flush_frame(vm);
+  }
+}
+
+/* Send the `payload_length` bytes of IPFIX message in buffer `bi` to
+ * collector `collector_index`, or to every collector with ~0. The copies
+ * are clones that share the message, only their headers are their own,
+ * so it is encoded once whatever the number of collectors.
+ */
+static void ipfix_send_buffer(vlib_main_t * vm, u32 bi, u64 payload_length,
+                              u32 n_data_records, u32 collector_index)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 clones[VLIB_FRAME_SIZE];
+  u32 n_collectors = vec_len(im->collectors);
+  u32 n_clones, i;
+  vlib_buffer_t * b0;
+
+  b0 = vlib_get_buffer(vm, bi);
+  b0->current_data = 0;
+  b0->current_length = payload_length;
+  b0->total_length_not_including_first_buffer = 0;
+
+  /* VPP generates this buffer so we have to set this flag apparently?
+   * https://www.mail-archive.com/vpp-dev@lists.fd.io/msg02656.html */
+  b0->flags = VLIB_BUFFER_TOTAL_LENGTH_VALID | VNET_BUFFER_F_LOCALLY_ORIGINATED;
+
+  if (collector_index != ~0) {
+    ipfix_send_to_collector(vm, bi, n_data_records,
+                            vec_elt_at_index(im->collectors, collector_index));
+    return;
+  }
+
+  if (n_collectors == 0) {
+    vlib_buffer_free(vm, &bi, 1);
+    return;
+  }
+  if (n_collectors == 1) {
+    ipfix_send_to_collector(vm, bi, n_data_records, im->collectors);
+    return;
+  }
+
+  /* each clone gets its own copy of the IPFIX header only */
+  n_clones = vlib_buffer_clone(vm, bi, clones,
+                               clib_min(n_collectors, VLIB_FRAME_SIZE),
+                               sizeof(netflow_v10_header_t));
+  if (n_clones < n_collectors) {
+    clib_warning("Could only clone %u of %u export packets",
+                 n_clones, n_collectors);
+  }
+  for (i = 0; i < n_clones; i++) {
+    ipfix_send_to_collector(vm, clones[i], n_data_records,
+                            vec_elt_at_index(im->collectors, i));
+  }
+}
+
+static void ipfix_send_template_packet(vlib_main_t * vm)
+{
+  u8 *payload;
+  u32 bi;
+
+  payload = ipfix_get_buffer(vm, &bi);
+  if (payload) {
+    ipfix_send_buffer(vm, bi, ipfix_write_template_packet(payload), 0, ~0);
+  }
+}
+
+/* Export a vector of records to collector `collector_index`, or to all
+ * of them with ~0, as few data packets as the path MTU allows, each
+ * encoded straight into the buffer that carries it.
+ *
+ * Returns how many records were sent, fewer if buffers ran out. */
+static u32 ipfix_send_data_packets(vlib_main_t * vm,
+                                   netflow_v10_template_t *template,
+                                   void *records, u32 n_records,
+                                   u32 record_size, u32 collector_index)
+{
+  u32 n_per_packet, n, i, bi;
+  u8 *payload;
+
+  n_per_packet = ipfix_records_per_packet(template);
+
+  /* one allocation for the whole burst */
+  ipfix_reserve_buffers(vm, (n_records + n_per_packet - 1) / n_per_packet);
+
+  for (i = 0; i < n_records; i += n) {
+    n = clib_min(n_per_packet, n_records - i);
+
+    payload = ipfix_get_buffer(vm, &bi);
+    if (!payload) {
+      return i;
+    }
+
+    ipfix_send_buffer(vm, bi,
+                      ipfix_write_v10_data_packet(payload, template,
+                                                  (u8 *)records + i * record_size,
+                                                  n, record_size),
+                      n, collector_index);
+  }
+  return n_records;
+}
+
+/* Export flow records, `key_size` bytes of flow key first in each: to
+ * every collector, or spread by flow key in hash mode so that all of a
+ * flow's records reach the same collector.
+ *
+ * Returns how many records were sent; in hash mode all or nothing, the
+ * buffers for every collector's share are taken before sending any. */
+static u32 ipfix_export_records(vlib_main_t * vm,
+                                netflow_v10_template_t *template,
+                                void *records, u32 n_records,
+                                u32 record_size, u32 key_size)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 n_collectors = vec_len(im->collectors);
+  u32 n_per_packet, n_packets, i, c;
+
+  if (im->collector_mode != IPFIX_COLLECTORS_HASH || n_collectors < 2) {
+    return ipfix_send_data_packets(vm, template, records, n_records,
+                                   record_size, ~0);
+  }
+
+  vec_validate(im->collector_records, n_collectors - 1);
+  for (i = 0; i < n_records; i++) {
+    u8 *record = (u8 *)records + i * record_size;
+
+    c = hash_memory(record, key_size, 0) % n_collectors;
+    vec_add(im->collector_records[c], record, record_size);
+  }
+
+  n_per_packet = ipfix_records_per_packet(template);
+  n_packets = 0;
+  for (c = 0; c < n_collectors; c++) {
+    n_packets += (vec_len(im->collector_records[c]) / record_size
+                  + n_per_packet - 1) / n_per_packet;
+  }
+
+  if (ipfix_reserve_buffers(vm, n_packets) >= n_packets) {
+    for (c = 0; c < n_collectors; c++) {
+      ipfix_send_data_packets(vm, template, im->collector_records[c],
+                              vec_len(im->collector_records[c]) / record_size,
+                              record_size, c);
+    }
+  } else {
+    n_records = 0;
+  }
+
+  for (c = 0; c < n_collectors; c++) {
+    vec_reset_length(im->collector_records[c]);
+  }
+  return n_records;
+}
+
+/* Report the sampling of every interface that samples, with the
+ * options templates that describe it */
+static void ipfix_send_sampling_packets(vlib_main_t * vm)
+{
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_sampling_value_t *values[2] = { 0, 0 }, *value;
+  ipfix_sampling_t *sampling;
+  u32 is_random;
+
+  vec_foreach(sampling, im->sampling) {
+    if (!sampling->interval) {
+      continue;
+    }
+
+    is_random = sampling->is_random;
+    vec_add2(values[is_random], value, 1);
+    value->ingress_interface = sampling - im->sampling;
+    if (is_random) {
+      value->selector_algorithm = SELECTOR_RANDOM_N_OUT_OF_N;
+      value->sampling_n = 1;
+      value->sampling_m = sampling->interval;
+    } else {
+      value->selector_algorithm = SELECTOR_SYSTEMATIC_COUNT;
+      value->sampling_n = 1;
+      value->sampling_m = sampling->interval - 1;
+    }
+  }
+
+  for (is_random = 0; is_random < 2; is_random++) {
+    ipfix_send_data_packets(vm, im->template_sampling[is_random],
+                            values[is_random], vec_len(values[is_random]),
+                            sizeof(ipfix_sampling_value_t), ~0);
+    vec_free(values[is_random]);
+  }
+}
+
+/* Queue a record for export, unless the queue is full. With a spill file
+ * the queue goes over, ipfix_spill_queues writes the excess out after
+ * the barrier. */
+static void ipfix_queue_record_ip4(ipfix_per_thread_data_t *ptd,
+                                   u32 record_idx) {
+  ipfix_main_t * im = &ipfix_main;
+
+  if (vec_len(im->export_queue_ip4) - im->export_queue_head_ip4
+      >= im->export_queue_max && im->spill[0].fd < 0) {
+    im->export_queue_dropped++;
+    return;
+  }
+  ipfix_export_record_ip4(ptd, record_idx, &im->export_queue_ip4);
+}
+
+static void ipfix_queue_record_ip6(ipfix_per_thread_data_t *ptd,
+                                   u32 record_idx) {
+  ipfix_main_t * im = &ipfix_main;
+
+  if (vec_len(im->export_queue_ip6) - im->export_queue_head_ip6
+      >= im->export_queue_max && im->spill[1].fd < 0) {
+    im->export_queue_dropped++;
+    return;
+  }
+  ipfix_export_record_ip6(ptd, record_idx, &im->export_queue_ip6);
+}
+
+/* Move the records a thread evicted to the export queues, as many as fit
+ * or all of them with a spill file */
+static void ipfix_queue_evicted_records(ipfix_per_thread_data_t *ptd) {
+  ipfix_main_t * im = &ipfix_main;
+  u32 n_queued, room;
+
+  n_queued = vec_len(im->export_queue_ip4) - im->export_queue_head_ip4;
+  room = n_queued < im->export_queue_max ? im->export_queue_max - n_queued : 0;
+  if (im->spill[0].fd >= 0) {
+    room = ~0;
+  }
+  room = clib_min(room, vec_len(ptd->evicted_records_ip4));
+  vec_add(im->export_queue_ip4, ptd->evicted_records_ip4, room);
+  im->export_queue_dropped += vec_len(ptd->evicted_records_ip4) - room;
+  vec_reset_length(ptd->evicted_records_ip4);
+
+  n_queued = vec_len(im->export_queue_ip6) - im->export_queue_head_ip6;
+  room = n_queued < im->export_queue_max ? im->export_queue_max - n_queued : 0;
+  if (im->spill[1].fd >= 0) {
+    room = ~0;
+  }
+  room = clib_min(room, vec_len(ptd->evicted_records_ip6));
+  vec_add(im->export_queue_ip6, ptd->evicted_records_ip6, room);
+  im->export_queue_dropped += vec_len(ptd->evicted_records_ip6) - room;
+  vec_reset_length(ptd->evicted_records_ip6);
+}
+
+static void ipfix_expire_record_ip4(ipfix_per_thread_data_t *ptd,
+                                    u32 record_idx, u64 current_time) {
+  ipfix_ip4_flow_record_t *record;
+  ipfix_flow_counters_t *counters, *reverse;
+  ipfix_main_t * im = &ipfix_main;
+  u64 start, end;
+
+  record = pool_elt_at_index(ptd->flow_records_ip4, record_idx);
+  counters = vec_elt_at_index(ptd->flow_counters_ip4, record_idx);
+  reverse = ipfix_flow_reverse_ip4(ptd, record_idx);
+  start = record->flow_start;
+  end = ipfix_flow_last_seen(start, counters, reverse);
+
+  if ((end + im->idle_flow_timeout) < current_time) {
+    ipfix_queue_record_ip4(ptd, record_idx);
+    ipfix_delete_record_ip4(ptd, record);
+    ipfix_count(ptd, IPFIX_COUNTER_FLOWS_EXPIRED, 1);
+    return;
+  }
+
+  if ((start + im->active_flow_timeout) < current_time) {
+    ipfix_queue_record_ip4(ptd, record_idx);
+
+    record->flow_start = current_time;
+    counters->flow_end = current_time;
+    counters->packet_delta_count = 0;
+    counters->octet_delta_count = 0;
+    if (reverse) {
+      reverse->flow_end = current_time;
+      reverse->packet_delta_count = 0;
+      reverse->octet_delta_count = 0;
+    }
+    start = end = current_time;
+  }
+
+  /* Still alive, wait for the next deadline */
+  record->timer_handle = ipfix_arm_timer(ptd, record_idx, IPFIX_TIMER_IP4,
+                                         start, end, current_time);
+}
+
+static void ipfix_expire_record_ip6(ipfix_per_thread_data_t *ptd,
+                                    u32 record_idx, u64 current_time) {
+  ipfix_ip6_flow_record_t *record;
+  ipfix_flow_counters_t *counters, *reverse;
+  ipfix_main_t * im = &ipfix_main;
+  u64 start, end;
+
+  record = pool_elt_at_index(ptd->flow_records_ip6, record_idx);
+  counters = vec_elt_at_index(ptd->flow_counters_ip6, record_idx);
+  reverse = ipfix_flow_reverse_ip6(ptd, record_idx);
+  start = record->flow_start;
+  end = ipfix_flow_last_seen(start, counters, reverse);
+
+  if ((end + im->idle_flow_timeout) < current_time) {
+    ipfix_queue_record_ip6(ptd, record_idx);
+    ipfix_delete_record_ip6(ptd, record);
+    ipfix_count(ptd, IPFIX_COUNTER_FLOWS_EXPIRED, 1);
+    return;
+  }
+
+  if ((start + im->active_flow_timeout) < current_time) {
+    ipfix_queue_record_ip6(ptd, record_idx);
+
+    record->flow_start = current_time;
+    counters->flow_end = current_time;
+    counters->packet_delta_count = 0;
+    counters->octet_delta_count = 0;
+    if (reverse) {
+      reverse->flow_end = current_time;
+      reverse->packet_delta_count = 0;
+      reverse->octet_delta_count = 0;
+    }
+    start = end = current_time;
+  }
+
+  record->timer_handle = ipfix_arm_timer(ptd, record_idx, IPFIX_TIMER_IP6,
+                                         start, end, current_time);
+}
+
+/* Run the thread's timer wheel up to `now` and handle only the records
+ * whose timer fired, the rest of the table is never looked at.
+ */
+static void ipfix_expire_records(ipfix_per_thread_data_t *ptd,
+                                 f64 now, u64 current_time) {
+  u32 *handle;
+
+  vec_reset_length(ptd->expired_timers);
+  ptd->expired_timers = tw_timer_expire_timers_vec_2t_1w_2048sl
+    (&ptd->timer_wheel, now, ptd->expired_timers);
+
+  vec_foreach(handle, ptd->expired_timers) {
+    /* 2t wheel handles carry the timer id in the top bit */
+    u32 record_idx = *handle & 0x7FFFFFFF;
+
+    if ((*handle >> 31) == IPFIX_TIMER_IP6) {
+      ipfix_expire_record_ip6(ptd, record_idx, current_time);
+    } else {
+      ipfix_expire_record_ip4(ptd, record_idx, current_time);
+    }
+  };
+}
+
+/* Give every live record a timer for its deadline under the current
+ * timeouts. Lowered timeouts from the CLI or API apply to the flows
+ * already metered this way, rather than after their old deadlines. */
+void ipfix_rearm_timers(vlib_main_t * vm) {
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_per_thread_data_t * ptd;
+  ipfix_ip4_flow_record_t * record4;
+  ipfix_ip6_flow_record_t * record6;
+  u64 current_time, end;
+  u32 idx;
+
+  vlib_worker_thread_barrier_sync (vm);
+  current_time = ipfix_time_now (vm);
+  vec_foreach (ptd, im->per_thread_data) {
+    pool_foreach (record4, ptd->flow_records_ip4, ({
+      idx = record4 - ptd->flow_records_ip4;
+      end = ipfix_flow_last_seen(record4->flow_start,
+                                 vec_elt_at_index(ptd->flow_counters_ip4, idx),
+                                 ipfix_flow_reverse_ip4(ptd, idx));
+      tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record4->timer_handle);
+      record4->timer_handle = ipfix_arm_timer(ptd, idx, IPFIX_TIMER_IP4,
+                                          record4->flow_start, end,
+                                          current_time);
+    }));
+    pool_foreach (record6, ptd->flow_records_ip6, ({
+      idx = record6 - ptd->flow_records_ip6;
+      end = ipfix_flow_last_seen(record6->flow_start,
+                                 vec_elt_at_index(ptd->flow_counters_ip6, idx),
+                                 ipfix_flow_reverse_ip6(ptd, idx));
+      tw_timer_stop_2t_1w_2048sl(&ptd->timer_wheel, record6->timer_handle);
+      record6->timer_handle = ipfix_arm_timer(ptd, idx, IPFIX_TIMER_IP6,
+                                          record6->flow_start, end,
+                                          current_time);
+    }));
+  }
+  vlib_worker_thread_barrier_release (vm);
 }
 
+/* Add and enable a flow rule on an interface, nothing is left behind
+ * if it fails */
+static int ipfix_offload_add(vnet_main_t * vnm, vnet_flow_t *flow,
+                             u32 hw_if_index, u32 *flow_index) {
+  int rv = vnet_flow_add(vnm, flow, flow_index);
+
+  if (rv == 0) {
+    rv = vnet_flow_enable(vnm, *flow_index, hw_if_index);
+    if (rv != 0) {
+      vnet_flow_del(vnm, *flow_index);
+    }
+  }
+  return rv;
+}
+
+static void ipfix_offload_del(vnet_main_t * vnm, u32 flow_index,
+                              u32 hw_if_index) {
+  vnet_flow_disable(vnm, flow_index, hw_if_index);
+  vnet_flow_del(vnm, flow_index);
+}
+
+/* The same rule for the packets of the other direction */
+static void ipfix_offload_swap(vnet_flow_t *flow) {
+  if (flow->type == VNET_FLOW_TYPE_IP6_N_TUPLE) {
+    vnet_flow_ip6_n_tuple_t *t = &flow->ip6_n_tuple;
+    ip6_address_and_mask_t addr = t->src_addr;
+    ip_port_and_mask_t port = t->src_port;
+
+    t->src_addr = t->dst_addr;
+    t->dst_addr = addr;
+    t->src_port = t->dst_port;
+    t->dst_port = port;
+  } else {
+    vnet_flow_ip4_n_tuple_t *t = &flow->ip4_n_tuple;
+    ip4_address_and_mask_t addr = t->src_addr;
+    ip_port_and_mask_t port = t->src_port;
+
+    t->src_addr = t->dst_addr;
+    t->dst_addr = addr;
+    t->src_port = t->dst_port;
+    t->dst_port = port;
+  }
+}
+
+/* Have the NIC mark the packets of a record, on the interface that
+ * received the packet that made it a candidate. The key of a biflow is
+ * ordered, its rule only matches one direction: the swapped one gets a
+ * second rule with the same mark, the meter tells the direction from the
+ * packet like for any other. */
+static void ipfix_offload_record(ipfix_per_thread_data_t *ptd,
+                                 ipfix_offload_candidate_t *candidate) {
+  ipfix_main_t * im = &ipfix_main;
+  vnet_main_t * vnm = im->vnet_main;
+  vnet_hw_interface_t * hw;
+  ipfix_offload_t * offload;
+  vnet_flow_t flow;
+  u32 *offload_index;
+  u64 value;
+  int rv;
+
+  memset(&flow, 0, sizeof(flow));
+  if (candidate->is_ipv6) {
+    ipfix_ip6_flow_record_t *record;
+
+    if (pool_is_free_index(ptd->flow_records_ip6, candidate->record_idx)) {
+      return;
+    }
+    record = pool_elt_at_index(ptd->flow_records_ip6, candidate->record_idx);
+    if (record->offload_index != ~0
+        || (record->flow_key.protocol != TCP_PROTOCOL
+            && record->flow_key.protocol != UDP_PROTOCOL)) {
+      return;
+    }
+    flow.type = VNET_FLOW_TYPE_IP6_N_TUPLE;
+    flow.ip6_n_tuple.src_addr.addr = record->flow_key.src;
+    flow.ip6_n_tuple.dst_addr.addr = record->flow_key.dst;
+    memset(&flow.ip6_n_tuple.src_addr.mask, 0xff, sizeof(ip6_address_t));
+    memset(&flow.ip6_n_tuple.dst_addr.mask, 0xff, sizeof(ip6_address_t));
+    flow.ip6_n_tuple.src_port.port =
+      clib_net_to_host_u16(record->flow_key.src_port);
+    flow.ip6_n_tuple.dst_port.port =
+      clib_net_to_host_u16(record->flow_key.dst_port);
+    flow.ip6_n_tuple.src_port.mask = 0xffff;
+    flow.ip6_n_tuple.dst_port.mask = 0xffff;
+    flow.ip6_n_tuple.protocol = record->flow_key.protocol;
+    offload_index = &record->offload_index;
+    value = candidate->record_idx
+      | (record->initiator_reversed ? IPFIX_VALUE_REVERSED : 0);
+  } else {
+    ipfix_ip4_flow_record_t *record;
+
+    if (pool_is_free_index(ptd->flow_records_ip4, candidate->record_idx)) {
+      return;
+    }
+    record = pool_elt_at_index(ptd->flow_records_ip4, candidate->record_idx);
+    if (record->offload_index != ~0
+        || (record->flow_key.protocol != TCP_PROTOCOL
+            && record->flow_key.protocol != UDP_PROTOCOL)) {
+      return;
+    }
+    flow.type = VNET_FLOW_TYPE_IP4_N_TUPLE;
+    flow.ip4_n_tuple.src_addr.addr = record->flow_key.src;
+    flow.ip4_n_tuple.dst_addr.addr = record->flow_key.dst;
+    flow.ip4_n_tuple.src_addr.mask.as_u32 = ~0;
+    flow.ip4_n_tuple.dst_addr.mask.as_u32 = ~0;
+    flow.ip4_n_tuple.src_port.port =
+      clib_net_to_host_u16(record->flow_key.src_port);
+    flow.ip4_n_tuple.dst_port.port =
+      clib_net_to_host_u16(record->flow_key.dst_port);
+    flow.ip4_n_tuple.src_port.mask = 0xffff;
+    flow.ip4_n_tuple.dst_port.mask = 0xffff;
+    flow.ip4_n_tuple.protocol = record->flow_key.protocol;
+    offload_index = &record->offload_index;
+    value = candidate->record_idx
+      | (record->initiator_reversed ? IPFIX_VALUE_REVERSED : 0);
+  }
+
+  hw = vnet_get_sup_hw_interface(vnm, candidate->sw_if_index);
+  if (clib_bitmap_get(im->offload_unsupported, hw->hw_if_index)) {
+    return;
+  }
+
+  pool_get(im->offloads, offload);
+  flow.actions = VNET_FLOW_ACTION_MARK;
+  flow.mark_flow_id = IPFIX_OFFLOAD_MARK_BASE + (offload - im->offloads);
+
+  offload->reverse_flow_index = ~0;
+  rv = ipfix_offload_add(vnm, &flow, hw->hw_if_index, &offload->flow_index);
+  if (rv == 0 && im->biflow) {
+    ipfix_offload_swap(&flow);
+    rv = ipfix_offload_add(vnm, &flow, hw->hw_if_index,
+                           &offload->reverse_flow_index);
+    if (rv != 0) {
+      ipfix_offload_del(vnm, offload->flow_index, hw->hw_if_index);
+    }
+  }
+  if (rv != 0) {
+    /* no point asking again for every heavy flow it receives */
+    clib_warning("%U does not take flow rules (%d), not offloading flows",
+                 format_vnet_hw_interface_name, vnm, hw->hw_if_index, rv);
+    im->offload_unsupported =
+      clib_bitmap_set(im->offload_unsupported, hw->hw_if_index, 1);
+    pool_put(im->offloads, offload);
+    return;
+  }
+
+  offload->hw_if_index = hw->hw_if_index;
+  offload->thread_index = ptd - im->per_thread_data;
+  offload->is_ipv6 = candidate->is_ipv6;
+  offload->record_value = value;
+  *offload_index = offload - im->offloads;
+}
+
+/* Bring the NIC flow rules in line with the flow tables, with the
+ * workers held: remove the rules of records that are gone and add rules
+ * for the records that crossed the offload threshold. vnet_flow has no
+ * way to read hardware counters back, so marked packets are still
+ * counted by the meter, it only skips the bihash search for them. Both
+ * rules of a biflow go on the interface of the candidate's packet: the
+ * other direction is only marked if it comes in there too, elsewhere it
+ * is still searched. */
+static void ipfix_sync_offloads(void)
+{
+  ipfix_main_t * im = &ipfix_main;
+  vnet_main_t * vnm = im->vnet_main;
+  ipfix_per_thread_data_t * ptd;
+  ipfix_offload_t * offload;
+  ipfix_offload_candidate_t * candidate;
+  u32 * stale = 0, * index;
+
+  pool_foreach(offload, im->offloads, ({
+    if (offload->record_value == ~0ULL) {
+      vec_add1(stale, offload - im->offloads);
+    }
+  }));
+  vec_foreach(index, stale) {
+    offload = pool_elt_at_index(im->offloads, *index);
+    ipfix_offload_del(vnm, offload->flow_index, offload->hw_if_index);
+    if (offload->reverse_flow_index != ~0) {
+      ipfix_offload_del(vnm, offload->reverse_flow_index,
+                        offload->hw_if_index);
+    }
+    pool_put(im->offloads, offload);
+  }
+  vec_free(stale);
+
+  vec_foreach(ptd, im->per_thread_data) {
+    vec_foreach(candidate, ptd->offload_candidates) {
+      if (pool_elts(im->offloads) >= im->max_offloads) {
+        break;
+      }
+      /* the rules match exact 5-tuples, not aggregates */
+      if (candidate->is_ipv6 ? im->aggregate_ip6 : im->aggregate_ip4) {
+        continue;
+      }
+      ipfix_offload_record(ptd, candidate);
+    }
+    vec_reset_length(ptd->offload_candidates);
+  }
+}
+
+/* Send the templates if they are due, or were changed */
+static void ipfix_send_templates(vlib_main_t * vm, u64 current_time)
+{
+  ipfix_main_t * im = &ipfix_main;
+
+  /* nothing was sent yet, always send the templates first */
+  if (!im->template_last_sent
+      || im->template_last_sent + im->template_timeout < current_time) {
+    ipfix_send_template_packet(vm);
+    ipfix_send_sampling_packets(vm);
+    im->template_last_sent = current_time;
+  }
+}
+
+/* Drop the sent records at the head of an export queue once they are
+ * half of it, or all of it */
+#define ipfix_compact_export_queue(q, head)                             \
+do {                                                                    \
+  if ((head) == vec_len(q)) {                                           \
+    vec_reset_length(q);                                                \
+    (head) = 0;                                                         \
+  } else if ((head) > vec_len(q) / 2) {                                 \
+    vec_delete(q, head, 0);                                             \
+    (head) = 0;                                                         \
+  }                                                                     \
+} while (0)
+
+/* Send the export queues, IPFIX_EXPORT_BATCH packets of each family at a
+ * time, suspending the process in between: the main thread stays with
+ * the other processes and the CLI, and with an export rate set the
+ * collector sees an even stream instead of the burst of a mass timeout.
+ *
+ * Returns once the queues are empty, buffers ran out or at `deadline`,
+ * the next expiry run. */
+static void ipfix_send_export_queues(vlib_main_t * vm, f64 deadline)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 per_packet_ip4, per_packet_ip6, n_ip4, n_ip6, n_sent_ip4, n_sent_ip6;
+  f64 pause;
+
+  while (1) {
+    /* the templates may change while the process is suspended */
+    ipfix_send_templates(vm, ipfix_time_now(vm));
+    /* records spilled to disk go as soon as the queues have room */
+    ipfix_unspill_queues();
+    per_packet_ip4 = ipfix_records_per_packet(im->template_ip4);
+    per_packet_ip6 = ipfix_records_per_packet(im->template_ip6);
+
+    n_ip4 = clib_min(IPFIX_EXPORT_BATCH * per_packet_ip4,
+                     vec_len(im->export_queue_ip4)
+                     - im->export_queue_head_ip4);
+    n_ip6 = clib_min(IPFIX_EXPORT_BATCH * per_packet_ip6,
+                     vec_len(im->export_queue_ip6)
+                     - im->export_queue_head_ip6);
+    if (n_ip4 == 0 && n_ip6 == 0) {
+      break;
+    }
+
+    n_sent_ip4 = ipfix_export_records(vm, im->template_ip4,
+                                      im->export_queue_ip4
+                                      + im->export_queue_head_ip4,
+                                      n_ip4, sizeof(ipfix_ip4_flow_value_t),
+                                      sizeof(ipfix_ip4_flow_key_t));
+    n_sent_ip6 = ipfix_export_records(vm, im->template_ip6,
+                                      im->export_queue_ip6
+                                      + im->export_queue_head_ip6,
+                                      n_ip6, sizeof(ipfix_ip6_flow_value_t),
+                                      sizeof(ipfix_ip6_flow_key_t));
+    ipfix_flush_frame(vm);
+    im->export_queue_head_ip4 += n_sent_ip4;
+    im->export_queue_head_ip6 += n_sent_ip6;
+    vlib_increment_simple_counter(&im->counters[IPFIX_COUNTER_RECORDS_EXPORTED],
+                                  vm->thread_index, 0,
+                                  n_sent_ip4 + n_sent_ip6);
+
+    /* out of buffers, the rest waits in the queues for the next run */
+    if (n_sent_ip4 < n_ip4 || n_sent_ip6 < n_ip6) {
+      break;
+    }
+
+    pause = 0;
+    if (im->export_rate) {
+      pause = (f64) ((n_ip4 + per_packet_ip4 - 1) / per_packet_ip4
+                     + (n_ip6 + per_packet_ip6 - 1) / per_packet_ip6)
+        / im->export_rate;
+    }
+    pause = clib_max(pause, IPFIX_EXPORT_YIELD);
+    if (vlib_time_now(vm) + pause >= deadline) {
+      break;
+    }
+    vlib_process_suspend(vm, pause);
+  }
+
+  ipfix_compact_export_queue(im->export_queue_ip4, im->export_queue_head_ip4);
+  ipfix_compact_export_queue(im->export_queue_ip6, im->export_queue_head_ip6);
+}
+
+/* Expires the flows every PROCESS_POLL_PERIOD and sends their records in
+ * between, see ipfix_send_export_queues */
 static uword ipfix_process_records_fn(vlib_main_t * vm,
                                    vlib_node_runtime_t * node,
                                    vlib_frame_t * frame)
 {
-  static u64 last_template = 0;
-  f64 poll_time_remaining = PROCESS_POLL_PERIOD;
+  f64 next_expiry = vlib_time_now(vm) + PROCESS_POLL_PERIOD;
   ipfix_main_t * im = &ipfix_main;
+  ipfix_per_thread_data_t * ptd;
 
   while (1) {
-    struct timespec current_time_clock;
-    u64 record_idx = 0;
-    poll_time_remaining = vlib_process_wait_for_event_or_clock(vm, poll_time_remaining);
-    clock_gettime(CLOCK_REALTIME, &current_time_clock);
-    u64 current_time = current_time_clock.tv_sec * 1e3 + current_time_clock.tv_nsec / 1e6;
-
-    if (last_template + im->template_timeout < current_time) {
-      ipfix_send_packet(im->vlib_main, 1, NULL);
-      last_template = current_time;
-    }
-
-    ipfix_expire_records(current_time);
-
-    vec_foreach_index(record_idx, im->expired_records_ip4) {
-      ipfix_ip4_flow_value_t *record;
-      netflow_v10_data_packet_t packet;
-      record = vec_elt_at_index(im->expired_records_ip4, record_idx);
-      ipfix_build_v10_packet(record, &packet, 0);
-      vec_add1(im->data_packets, packet);
-      vec_del1(im->expired_records_ip4, record_idx);
-    };
-
-    vec_foreach_index(record_idx, im->expired_records_ip6) {
-      ipfix_ip6_flow_value_t *record;
-      netflow_v10_data_packet_t packet;
-      record = vec_elt_at_index(im->expired_records_ip6, record_idx);
-      ipfix_build_v10_packet(record, &packet, 1);
-      vec_add1(im->data_packets, packet);
-      vec_del1(im->expired_records_ip6, record_idx);
-    };
+    vlib_process_wait_for_event_or_clock(vm,
+                                         clib_max(next_expiry
+                                                  - vlib_time_now(vm),
+                                                  IPFIX_EXPORT_YIELD));
+    /* same time base as the meter nodes, see ipfix_time_now */
+    f64 now = vlib_time_now(vm);
+    u64 current_time = (u64) (now * 1e3) + IPFIX_TIME_BASE;
+
+    if (now < next_expiry) {
+      continue;
+    }
+    next_expiry = now + PROCESS_POLL_PERIOD;
 
-    netflow_v10_data_packet_t *packet;
-    u64 packet_idx;
-    vec_foreach_index(packet_idx, im->data_packets) {
-      packet = vec_elt_at_index(im->data_packets, packet_idx);
+    ipfix_send_templates(vm, current_time);
 
-      /* FIXME: Instead of looping over packets and sending each one, the
-                loop should be in the function to fill up a frame with
-                multiple packets at a time */
-      ipfix_send_packet(im->vlib_main, 0, packet);
+    /* The workers own their flow tables, hold them while we harvest */
+    vlib_worker_thread_barrier_sync (vm);
+    vec_foreach (ptd, im->per_thread_data) {
+      ipfix_expire_records(ptd, now, current_time);
 
-      ipfix_free_v10_packet(packet);
-      vec_del1(im->data_packets, packet_idx);
-    };
+      /* flows the workers evicted to make room, already wall clock */
+      ipfix_queue_evicted_records(ptd);
 
-    if (vlib_process_suspend_time_is_zero(poll_time_remaining)) {
-      poll_time_remaining = PROCESS_POLL_PERIOD;
+      vlib_set_simple_counter(&im->counters[IPFIX_COUNTER_ACTIVE_FLOWS],
+                              ptd - im->per_thread_data, 0,
+                              ipfix_n_flows(ptd));
+    }
+    ipfix_sync_offloads();
+    vlib_worker_thread_barrier_release (vm);
+
+    /* the queues only go over their size with a spill file */
+    ipfix_spill_queues(0);
+
+    if (im->export_queue_dropped) {
+      vlib_node_increment_counter(vm, node->node_index,
+                                  IPFIX_ERROR_EXPORT_QUEUE_FULL,
+                                  im->export_queue_dropped);
+      vlib_increment_simple_counter(&im->counters[IPFIX_COUNTER_EXPORT_DROPS],
+                                    vm->thread_index, 0,
+                                    im->export_queue_dropped);
+      im->export_queue_dropped = 0;
     }
+
+    ipfix_send_export_queues(vm, next_expiry);
   }
   return 0;
 }
 
-static void ipfix_meter_ip4_fn(vlib_main_t * vm,
-                               vlib_node_runtime_t * node,
-                               vlib_frame_t * frame) {
-  ipfix_meter_fn_inline(vm, node, frame, 0);
+/* The pieces of the data plane "test ipfix benchmark" times, without the
+ * graph and the collectors around them, see bench.c */
+void ipfix_bench_meter(vlib_main_t * vm, ipfix_per_thread_data_t *ptd,
+                       u32 *buffers, u32 n_packets, u8 is_ipv6, u64 now) {
+  vlib_node_runtime_t *node;
+  u8 is_slow[VLIB_FRAME_SIZE];
+
+  if (is_ipv6) {
+    node = vlib_node_get_runtime(vm, ipfix_meter_ip6_node.index);
+    ipfix_meter_ip6(vm, node, ptd, buffers, n_packets, now, is_slow);
+  } else {
+    node = vlib_node_get_runtime(vm, ipfix_meter_ip4_node.index);
+    ipfix_meter_ip4(vm, node, ptd, buffers, n_packets, now, is_slow);
+  }
+}
+
+void ipfix_bench_expire(ipfix_per_thread_data_t *ptd, f64 now,
+                        u64 current_time) {
+  ipfix_expire_records(ptd, now, current_time);
+}
+
+/* Encode `n_records` records into `buffer` a message at a time, as the
+ * export does. Returns the number of messages. */
+u32 ipfix_bench_encode(u8 *buffer, u8 is_ipv6, void *records,
+                       u32 n_records) {
+  ipfix_main_t * im = &ipfix_main;
+  netflow_v10_template_t *template = is_ipv6 ? im->template_ip6
+    : im->template_ip4;
+  u32 record_size = is_ipv6 ? sizeof(ipfix_ip6_flow_value_t)
+    : sizeof(ipfix_ip4_flow_value_t);
+  u32 per_packet = ipfix_records_per_packet(template);
+  u32 i, n, n_packets = 0;
+
+  for (i = 0; i < n_records; i += n) {
+    n = clib_min(per_packet, n_records - i);
+    ipfix_write_v10_data_packet(buffer, template,
+                                (u8 *) records + i * record_size, n,
+                                record_size);
+    n_packets++;
+  }
+  return n_packets;
+}
+
+/* Meter the packets the meter nodes left for the slow path: IPv4 options
+ * and fragments, IPv6 extension headers. The meter node only sends the
+ * packets its sampler picked, every one of them is metered here. */
+always_inline uword
+ipfix_meter_slow_fn_inline (vlib_main_t * vm,
+                            vlib_node_runtime_t * node,
+                            vlib_frame_t * frame,
+                            u8 is_ipv6)
+{
+  u32 n_left_from, * from, * to_next, n_left_to_next;
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_per_thread_data_t * ptd =
+    vec_elt_at_index (im->per_thread_data, vlib_get_thread_index ());
+  u32 n_no_ports = 0, i;
+  u8 reversed;
+  u64 now;
+
+  from = vlib_frame_vector_args (frame);
+  n_left_from = frame->n_vectors;
+  now = ipfix_time_now (vm);
+
+  for (i = 0; i < n_left_from; i++) {
+    vlib_buffer_t *b0 = vlib_get_buffer (vm, from[i]);
+
+    if (is_ipv6) {
+      ip6_header_t *ip0 = vlib_buffer_get_current (b0);
+      clib_bihash_kv_40_8_t kv;
+
+      n_no_ports += !create_flow_key_ip6_slow(ptd,
+                                              (ipfix_ip6_flow_key_t*) &kv.key,
+                                              b0, ip0, now);
+      if (PREDICT_FALSE(im->aggregate_ip6)) {
+        ipfix_mask_key_ip6(&kv);
+      }
+      reversed = im->biflow
+        && ipfix_order_key_ip6((ipfix_ip6_flow_key_t*) &kv.key);
+      ipfix_meter_key_ip6(vm, node, ptd, &kv, ip6_octets(ip0), now,
+                          reversed);
+      if (PREDICT_FALSE((node->flags & VLIB_NODE_FLAG_TRACE)
+                        && (b0->flags & VLIB_BUFFER_IS_TRACED))) {
+        ipfix_trace_t *t = vlib_add_trace (vm, node, b0, sizeof (*t));
+        t->sw_if_index = vnet_buffer(b0)->sw_if_index[VLIB_RX];
+        t->next_index = IPFIX_NEXT_INTERFACE_OUTPUT;
+        ipfix_trace_key_ip6(ptd, &kv, t);
+      }
+    } else {
+      ip4_header_t *ip0 = vlib_buffer_get_current (b0);
+      clib_bihash_kv_16_8_t kv;
+
+      n_no_ports += !create_flow_key_ip4_slow(ptd,
+                                              (ipfix_ip4_flow_key_t*) &kv.key,
+                                              ip0, now);
+      if (PREDICT_FALSE(im->aggregate_ip4)) {
+        ipfix_mask_key_ip4(&kv);
+      }
+      reversed = im->biflow
+        && ipfix_order_key_ip4((ipfix_ip4_flow_key_t*) &kv.key);
+      ipfix_meter_key_ip4(vm, node, ptd, &kv,
+                          clib_net_to_host_u16(ip0->length), now, reversed);
+      if (PREDICT_FALSE((node->flags & VLIB_NODE_FLAG_TRACE)
+                        && (b0->flags & VLIB_BUFFER_IS_TRACED))) {
+        ipfix_trace_t *t = vlib_add_trace (vm, node, b0, sizeof (*t));
+        t->sw_if_index = vnet_buffer(b0)->sw_if_index[VLIB_RX];
+        t->next_index = IPFIX_NEXT_INTERFACE_OUTPUT;
+        ipfix_trace_key_ip4(ptd, &kv, t);
+      }
+    }
+  }
+
+  if (n_no_ports) {
+    vlib_node_increment_counter(vm, node->node_index,
+                                IPFIX_ERROR_FRAGMENT_NO_PORTS, n_no_ports);
+  }
+
+  /* all of them go on to the lookup, traced above */
+  while (n_left_from > 0) {
+    u32 n;
+
+    vlib_get_next_frame (vm, node, IPFIX_NEXT_INTERFACE_OUTPUT,
+                         to_next, n_left_to_next);
+    n = clib_min(n_left_from, n_left_to_next);
+    clib_memcpy(to_next, from, n * sizeof(u32));
+
+    from += n;
+    n_left_from -= n;
+    vlib_put_next_frame (vm, node, IPFIX_NEXT_INTERFACE_OUTPUT,
+                         n_left_to_next - n);
+  }
+
+  return frame->n_vectors;
+}
+
+static uword ipfix_meter_ip4_fn(vlib_main_t * vm,
+                                vlib_node_runtime_t * node,
+                                vlib_frame_t * frame) {
+  return ipfix_meter_fn_inline(vm, node, frame, 0);
+}
+
+static uword ipfix_meter_ip6_fn(vlib_main_t * vm,
+                                vlib_node_runtime_t * node,
+                                vlib_frame_t * frame) {
+  return ipfix_meter_fn_inline(vm, node, frame, 1);
+}
+
+static uword ipfix_meter_ip4_slow_fn(vlib_main_t * vm,
+                                     vlib_node_runtime_t * node,
+                                     vlib_frame_t * frame) {
+  return ipfix_meter_slow_fn_inline(vm, node, frame, 0);
 }
 
-static void ipfix_meter_ip6_fn(vlib_main_t * vm,
-                               vlib_node_runtime_t * node,
-                               vlib_frame_t * frame) {
-  ipfix_meter_fn_inline(vm, node, frame, 1);
+static uword ipfix_meter_ip6_slow_fn(vlib_main_t * vm,
+                                     vlib_node_runtime_t * node,
+                                     vlib_frame_t * frame) {
+  return ipfix_meter_slow_fn_inline(vm, node, frame, 1);
 }
 
 VLIB_REGISTER_NODE (ipfix_process_records) = {
   .function = ipfix_process_records_fn,
   .name = "ipfix-record-processing",
   .type = VLIB_NODE_TYPE_PROCESS,
+
+  .n_errors = ARRAY_LEN(ipfix_error_strings),
+  .error_strings = ipfix_error_strings,
 };
 
 VLIB_REGISTER_NODE (ipfix_meter_ip4_node) = {
@@ -959,6 +3178,7 @@ VLIB_REGISTER_NODE (ipfix_meter_ip4_node) = {
   /* edit / add dispositions here */
   .next_nodes = {
         [IPFIX_NEXT_INTERFACE_OUTPUT] = "ip4-lookup",
+        [IPFIX_NEXT_SLOW_PATH] = "ipfix-meter-ip4-slow",
   },
 };
 
@@ -975,7 +3195,44 @@ VLIB_REGISTER_NODE (ipfix_meter_ip6_node) = {
   .n_next_nodes = IPFIX_N_NEXT,
 
   /* edit / add dispositions here */
+  .next_nodes = {
+    [IPFIX_NEXT_INTERFACE_OUTPUT] = "ip6-lookup",
+    [IPFIX_NEXT_SLOW_PATH] = "ipfix-meter-ip6-slow",
+  },
+};
+
+VLIB_REGISTER_NODE (ipfix_meter_ip4_slow_node) = {
+  .function = ipfix_meter_ip4_slow_fn,
+  .name = "ipfix-meter-ip4-slow",
+  .vector_size = sizeof (u32),
+  .format_trace = format_ipfix_trace,
+  .type = VLIB_NODE_TYPE_INTERNAL,
+
+  .n_errors = ARRAY_LEN(ipfix_error_strings),
+  .error_strings = ipfix_error_strings,
+
+  .n_next_nodes = 1,
+  .next_nodes = {
+    [IPFIX_NEXT_INTERFACE_OUTPUT] = "ip4-lookup",
+  },
+};
+
+VLIB_REGISTER_NODE (ipfix_meter_ip6_slow_node) = {
+  .function = ipfix_meter_ip6_slow_fn,
+  .name = "ipfix-meter-ip6-slow",
+  .vector_size = sizeof (u32),
+  .format_trace = format_ipfix_trace,
+  .type = VLIB_NODE_TYPE_INTERNAL,
+
+  .n_errors = ARRAY_LEN(ipfix_error_strings),
+  .error_strings = ipfix_error_strings,
+
+  .n_next_nodes = 1,
   .next_nodes = {
     [IPFIX_NEXT_INTERFACE_OUTPUT] = "ip6-lookup",
   },
 };
+
+/* Pick the meter variant built for the best ISA this CPU has */
+VLIB_NODE_FUNCTION_MULTIARCH (ipfix_meter_ip4_node, ipfix_meter_ip4_fn);
+VLIB_NODE_FUNCTION_MULTIARCH (ipfix_meter_ip6_node, ipfix_meter_ip6_fn);
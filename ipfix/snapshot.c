@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2017 Igalia
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * @file
+ * @brief IPFIX Plugin, flow table snapshots and export queue spill files.
+ *
+ * A snapshot keeps the live flows across a restart: it is saved on exit,
+ * or with "ipfix snapshot", and loaded once on the next start, so the
+ * collector sees the flows go on instead of ending early.
+ *
+ * Spill files keep the export queues from dropping records when the
+ * collector cannot keep up: what goes over the queue size is appended to
+ * a file per family and read back as the queues drain.
+ */
+
+#include <vnet/vnet.h>
+#include <ipfix/ipfix.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IPFIX_SNAPSHOT_MAGIC 0x49504658 /* "IPFX" */
+#define IPFIX_SNAPSHOT_VERSION 1
+
+/* A snapshot file: this header, the IPv4 flows, then the IPv6 flows.
+ * The entry sizes are kept so that a changed layout is refused rather
+ * than misread. */
+typedef struct {
+  u32 magic;
+  u32 version;
+  u32 ip4_flow_size;
+  u32 ip6_flow_size;
+  u64 n_ip4;
+  u64 n_ip6;
+} ipfix_snapshot_header_t;
+
+/* Fill in a snapshot flow from record `index` of a family, but for the
+ * key, which the caller copies */
+static void ipfix_snapshot_flow (ipfix_per_thread_data_t * ptd, u32 index,
+                                 ipfix_flow_snapshot_t * flow, u8 is_ipv6)
+{
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_flow_counters_t * counters, * reverse;
+  u64 flow_start;
+
+  memset (flow, 0, sizeof (*flow));
+  if (is_ipv6) {
+    ipfix_ip6_flow_record_t * record =
+      pool_elt_at_index (ptd->flow_records_ip6, index);
+
+    flow_start = record->flow_start;
+    flow->initiator_reversed = record->initiator_reversed;
+    counters = vec_elt_at_index (ptd->flow_counters_ip6, index);
+    reverse = ipfix_flow_reverse_ip6 (ptd, index);
+  } else {
+    ipfix_ip4_flow_record_t * record =
+      pool_elt_at_index (ptd->flow_records_ip4, index);
+
+    flow_start = record->flow_start;
+    flow->initiator_reversed = record->initiator_reversed;
+    counters = vec_elt_at_index (ptd->flow_counters_ip4, index);
+    reverse = ipfix_flow_reverse_ip4 (ptd, index);
+  }
+
+  flow->flow_start = flow_start + im->wall_clock_offset;
+  flow->flow_end = ipfix_flow_last_seen (flow_start, counters, reverse)
+    + im->wall_clock_offset;
+  flow->packet_delta_count = counters->packet_delta_count;
+  flow->octet_delta_count = counters->octet_delta_count;
+  flow->reverse_packet_delta_count = reverse ? reverse->packet_delta_count : 0;
+  flow->reverse_octet_delta_count = reverse ? reverse->octet_delta_count : 0;
+  flow->thread_index = ptd - im->per_thread_data;
+}
+
+/**
+ * @brief Save the live flows of every thread to `path`.
+ *
+ * The file is written next to it and renamed over it once complete, a
+ * crash halfway leaves the previous snapshot. The workers wait at the
+ * barrier while the flows are copied to the file mapping, the disk
+ * writes happen after.
+ */
+clib_error_t * ipfix_snapshot_save (char * path)
+{
+  ipfix_main_t * im = &ipfix_main;
+  vlib_main_t * vm = vlib_get_main ();
+  ipfix_per_thread_data_t * ptd;
+  ipfix_snapshot_header_t * header;
+  ipfix_ip4_flow_snapshot_t * flow4;
+  ipfix_ip6_flow_snapshot_t * flow6;
+  ipfix_ip4_flow_record_t * record4;
+  ipfix_ip6_flow_record_t * record6;
+  clib_error_t * error = 0;
+  u64 n_ip4 = 0, n_ip6 = 0;
+  u8 * tmp_path;
+  void * base;
+  uword size;
+  int fd;
+
+  tmp_path = format (0, "%s.tmp%c", path, 0);
+  fd = open ((char *) tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    error = clib_error_return_unix (0, "open `%s'", tmp_path);
+    goto done;
+  }
+
+  vlib_worker_thread_barrier_sync (vm);
+
+  vec_foreach (ptd, im->per_thread_data) {
+    n_ip4 += pool_elts (ptd->flow_records_ip4);
+    n_ip6 += pool_elts (ptd->flow_records_ip6);
+  }
+  size = sizeof (*header) + n_ip4 * sizeof (*flow4) + n_ip6 * sizeof (*flow6);
+
+  if (ftruncate (fd, size) != 0) {
+    vlib_worker_thread_barrier_release (vm);
+    error = clib_error_return_unix (0, "ftruncate `%s'", tmp_path);
+    goto done;
+  }
+  base = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    vlib_worker_thread_barrier_release (vm);
+    error = clib_error_return_unix (0, "mmap `%s'", tmp_path);
+    goto done;
+  }
+
+  header = base;
+  header->magic = IPFIX_SNAPSHOT_MAGIC;
+  header->version = IPFIX_SNAPSHOT_VERSION;
+  header->ip4_flow_size = sizeof (*flow4);
+  header->ip6_flow_size = sizeof (*flow6);
+  header->n_ip4 = n_ip4;
+  header->n_ip6 = n_ip6;
+
+  flow4 = (ipfix_ip4_flow_snapshot_t *) (header + 1);
+  vec_foreach (ptd, im->per_thread_data) {
+    pool_foreach (record4, ptd->flow_records_ip4, ({
+      flow4->flow_key = record4->flow_key;
+      ipfix_snapshot_flow (ptd, record4 - ptd->flow_records_ip4,
+                           &flow4->flow, 0);
+      flow4++;
+    }));
+  }
+  flow6 = (ipfix_ip6_flow_snapshot_t *) flow4;
+  vec_foreach (ptd, im->per_thread_data) {
+    pool_foreach (record6, ptd->flow_records_ip6, ({
+      flow6->flow_key = record6->flow_key;
+      ipfix_snapshot_flow (ptd, record6 - ptd->flow_records_ip6,
+                           &flow6->flow, 1);
+      flow6++;
+    }));
+  }
+
+  vlib_worker_thread_barrier_release (vm);
+
+  if (msync (base, size, MS_SYNC) != 0)
+    error = clib_error_return_unix (0, "msync `%s'", tmp_path);
+  munmap (base, size);
+
+  if (!error && rename ((char *) tmp_path, path) != 0)
+    error = clib_error_return_unix (0, "rename `%s'", tmp_path);
+
+ done:
+  if (fd >= 0)
+    close (fd);
+  if (error)
+    unlink ((char *) tmp_path);
+  vec_free (tmp_path);
+  return error;
+}
+
+/**
+ * @brief Bring back the flows of the configured snapshot, on start.
+ *
+ * The flow hashes are only created by the startup config, hence main
+ * loop entry rather than ipfix_init. Flows go back to the thread that
+ * had them, or another one with fewer workers. The snapshot is removed
+ * once loaded: after a crash the same flows, exported since, must not
+ * come back a second time.
+ */
+static clib_error_t * ipfix_snapshot_restore (vlib_main_t * vm)
+{
+  ipfix_main_t * im = &ipfix_main;
+  char * path = (char *) im->snapshot_path;
+  u32 n_threads = vec_len (im->per_thread_data);
+  ipfix_snapshot_header_t * header;
+  ipfix_ip4_flow_snapshot_t * flow4;
+  ipfix_ip6_flow_snapshot_t * flow6;
+  ipfix_per_thread_data_t * ptd;
+  u64 i, n_restored = 0;
+  struct stat st;
+  void * base;
+  u64 now;
+  int fd;
+
+  if (!path)
+    return 0;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      clib_unix_warning ("open `%s'", path);
+    return 0;
+  }
+  if (fstat (fd, &st) != 0 || (uword) st.st_size < sizeof (*header)) {
+    clib_warning ("%s: not an ipfix snapshot", path);
+    close (fd);
+    return 0;
+  }
+  base = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (base == MAP_FAILED) {
+    clib_unix_warning ("mmap `%s'", path);
+    return 0;
+  }
+
+  header = base;
+  if (header->magic != IPFIX_SNAPSHOT_MAGIC
+      || header->version != IPFIX_SNAPSHOT_VERSION
+      || header->ip4_flow_size != sizeof (*flow4)
+      || header->ip6_flow_size != sizeof (*flow6)
+      || (uword) st.st_size != sizeof (*header)
+                               + header->n_ip4 * sizeof (*flow4)
+                               + header->n_ip6 * sizeof (*flow6)) {
+    clib_warning ("%s: not an ipfix snapshot, or of another version", path);
+    munmap (base, st.st_size);
+    return 0;
+  }
+
+  now = ipfix_time_now (vm);
+  flow4 = (ipfix_ip4_flow_snapshot_t *) (header + 1);
+  flow6 = (ipfix_ip6_flow_snapshot_t *) (flow4 + header->n_ip4);
+
+  vlib_worker_thread_barrier_sync (vm);
+  for (i = 0; i < header->n_ip4; i++) {
+    ptd = vec_elt_at_index (im->per_thread_data,
+                            flow4[i].flow.thread_index % n_threads);
+    n_restored += ipfix_restore_record_ip4 (ptd, &flow4[i], now);
+  }
+  for (i = 0; i < header->n_ip6; i++) {
+    ptd = vec_elt_at_index (im->per_thread_data,
+                            flow6[i].flow.thread_index % n_threads);
+    n_restored += ipfix_restore_record_ip6 (ptd, &flow6[i], now);
+  }
+  vlib_worker_thread_barrier_release (vm);
+
+  clib_warning ("restored %llu of %llu flows from %s", n_restored,
+                header->n_ip4 + header->n_ip6, path);
+  munmap (base, st.st_size);
+  unlink (path);
+  return 0;
+}
+
+VLIB_MAIN_LOOP_ENTER_FUNCTION (ipfix_snapshot_restore);
+
+/* Append `n` records to a spill file, returns how many made it */
+static u32 ipfix_spill_write (ipfix_spill_t * spill, void * records, u32 n,
+                              uword size)
+{
+  ssize_t written = pwrite (spill->fd, records, n * size,
+                            spill->write_offset);
+
+  if (written < 0) {
+    clib_unix_warning ("spill write");
+    return 0;
+  }
+  /* a record written in part is written over by the next one */
+  n = written / size;
+  spill->write_offset += n * size;
+  return n;
+}
+
+/* Read up to `n` records from the front of a spill file, returns how
+ * many it had */
+static u32 ipfix_spill_read (ipfix_spill_t * spill, void * records, u32 n,
+                             uword size)
+{
+  ssize_t n_read;
+
+  n = clib_min (n, (spill->write_offset - spill->read_offset) / size);
+  n_read = pread (spill->fd, records, n * size, spill->read_offset);
+  if (n_read < 0) {
+    clib_unix_warning ("spill read");
+    return 0;
+  }
+  n = n_read / size;
+  spill->read_offset += n * size;
+
+  /* all read back, start the file over */
+  if (spill->read_offset == spill->write_offset) {
+    if (ftruncate (spill->fd, 0) != 0)
+      clib_unix_warning ("spill truncate");
+    spill->read_offset = spill->write_offset = 0;
+  }
+  return n;
+}
+
+/**
+ * @brief Open the spill files of the "spill" startup option.
+ *
+ * `path` gets a .ip4 and a .ip6 suffix. Records a previous run spilled
+ * and did not get to export are exported first.
+ */
+clib_error_t * ipfix_spill_open (char * path)
+{
+  static char * suffix[2] = { "ip4", "ip6" };
+  uword record_size[2] = { sizeof (ipfix_ip4_flow_value_t),
+                           sizeof (ipfix_ip6_flow_value_t) };
+  ipfix_main_t * im = &ipfix_main;
+  ipfix_spill_t * spill;
+  clib_error_t * error = 0;
+  struct stat st;
+  u8 * file;
+  u8 is_ipv6;
+
+  for (is_ipv6 = 0; is_ipv6 < 2; is_ipv6++) {
+    spill = &im->spill[is_ipv6];
+    file = format (0, "%s.%s%c", path, suffix[is_ipv6], 0);
+    spill->fd = open ((char *) file, O_RDWR | O_CREAT, 0644);
+    if (spill->fd < 0 || fstat (spill->fd, &st) != 0) {
+      error = clib_error_return_unix (0, "open `%s'", file);
+      vec_free (file);
+      break;
+    }
+    spill->read_offset = 0;
+    spill->write_offset = st.st_size - st.st_size % record_size[is_ipv6];
+    vec_free (file);
+  }
+
+  if (error) {
+    for (is_ipv6 = 0; is_ipv6 < 2; is_ipv6++) {
+      if (im->spill[is_ipv6].fd >= 0)
+        close (im->spill[is_ipv6].fd);
+      im->spill[is_ipv6].fd = -1;
+    }
+  }
+  return error;
+}
+
+/* Move the records of an export queue past `keep` to its spill file,
+ * what the file does not take is dropped */
+#define ipfix_spill_queue(spill, q, head, keep)                         \
+do {                                                                    \
+  u32 _n_queued = vec_len (q) - (head);                                 \
+  u32 _n, _n_spilled;                                                   \
+                                                                        \
+  if ((spill)->fd < 0 || _n_queued <= (keep))                           \
+    break;                                                              \
+  _n = _n_queued - (keep);                                              \
+  _n_spilled = ipfix_spill_write ((spill), (q) + vec_len (q) - _n, _n,  \
+                                  sizeof ((q)[0]));                     \
+  ipfix_main.export_queue_dropped += _n - _n_spilled;                   \
+  _vec_len (q) -= _n;                                                   \
+} while (0)
+
+/* Top up an export queue from its spill file, IPFIX_SPILL_CHUNK records
+ * at most */
+#define ipfix_unspill_queue(spill, q, head)                             \
+do {                                                                    \
+  u32 _n_queued = vec_len (q) - (head);                                 \
+  u32 _n, _n_read;                                                      \
+  void * _records;                                                      \
+                                                                        \
+  if ((spill)->fd < 0 || (spill)->read_offset == (spill)->write_offset  \
+      || _n_queued >= ipfix_main.export_queue_max)                      \
+    break;                                                              \
+  _n = clib_min (ipfix_main.export_queue_max - _n_queued,               \
+                 IPFIX_SPILL_CHUNK);                                    \
+  vec_add2 (q, _records, _n);                                           \
+  _n_read = ipfix_spill_read ((spill), _records, _n, sizeof ((q)[0]));  \
+  _vec_len (q) -= _n - _n_read;                                         \
+} while (0)
+
+/**
+ * @brief Spill what the export queues hold over their size, or all of
+ * it. Only the process node and the exit function touch the queues.
+ */
+void ipfix_spill_queues (u8 all)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u32 keep = all ? 0 : im->export_queue_max;
+
+  ipfix_spill_queue (&im->spill[0], im->export_queue_ip4,
+                     im->export_queue_head_ip4, keep);
+  ipfix_spill_queue (&im->spill[1], im->export_queue_ip6,
+                     im->export_queue_head_ip6, keep);
+}
+
+void ipfix_unspill_queues (void)
+{
+  ipfix_main_t * im = &ipfix_main;
+
+  ipfix_unspill_queue (&im->spill[0], im->export_queue_ip4,
+                       im->export_queue_head_ip4);
+  ipfix_unspill_queue (&im->spill[1], im->export_queue_ip6,
+                       im->export_queue_head_ip6);
+}
+
+/* On the way out the flows go to the snapshot, and the records still
+ * waiting for export to the spill files */
+static clib_error_t * ipfix_snapshot_exit (vlib_main_t * vm)
+{
+  ipfix_main_t * im = &ipfix_main;
+  clib_error_t * error;
+
+  if (im->snapshot_path) {
+    error = ipfix_snapshot_save ((char *) im->snapshot_path);
+    if (error)
+      clib_error_report (error);
+  }
+  ipfix_spill_queues (1);
+  return 0;
+}
+
+VLIB_MAIN_LOOP_EXIT_FUNCTION (ipfix_snapshot_exit);
+
+static clib_error_t * ipfix_snapshot_command_fn (vlib_main_t * vm,
+                                                 unformat_input_t * input,
+                                                 vlib_cli_command_t * cmd)
+{
+  ipfix_main_t * im = &ipfix_main;
+  u8 * path = 0;
+  clib_error_t * error;
+
+  if (unformat (input, "%s", &path)) {
+    vec_add1 (path, 0);
+  } else if (im->snapshot_path) {
+    path = vec_dup (im->snapshot_path);
+  } else {
+    return clib_error_return (0, "expected a path, no snapshot is configured");
+  }
+
+  error = ipfix_snapshot_save ((char *) path);
+  if (!error)
+    vlib_cli_output (vm, "flows saved to %s", path);
+  vec_free (path);
+  return error;
+}
+
+/**
+ * @brief CLI command to save the flow table now, e.g. before an upgrade.
+ */
+VLIB_CLI_COMMAND (ipfix_snapshot_command, static) = {
+  .path = "ipfix snapshot",
+  .short_help = "ipfix snapshot [<path>]",
+  .function = ipfix_snapshot_command_fn,
+};